@@ -0,0 +1,346 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+
+static struct alias **alias_table;
+static size_t alias_table_size;
+static size_t naliases;
+static size_t alias_generation;
+
+
+PURE_FUNC
+static size_t
+hash_alias_name(const char *name, size_t length)
+{
+	size_t hash = 5381;
+	while (length--)
+		hash = (hash << 5) + hash + (unsigned char)*name++;
+	return hash;
+}
+
+
+static struct alias **
+find_alias(const char *name, size_t length, size_t hash)
+{
+	struct alias **aliasp;
+
+	aliasp = &alias_table[hash & (alias_table_size - 1)];
+	for (; *aliasp; aliasp = &(*aliasp)->next)
+		if ((*aliasp)->hash == hash && (*aliasp)->name_length == length && !memcmp((*aliasp)->name, name, length))
+			break;
+	return aliasp;
+}
+
+
+static void
+grow_alias_table(void)
+{
+	struct alias **old_table = alias_table, *alias, *next;
+	size_t old_size = alias_table_size, i, bucket;
+
+	alias_table_size = old_size ? old_size * 2 : ALIAS_TABLE_INITIAL_SIZE;
+	alias_table = ecalloc(alias_table_size, sizeof(*alias_table));
+
+	for (i = 0; i < old_size; i++) {
+		for (alias = old_table[i]; alias; alias = next) {
+			next = alias->next;
+			bucket = alias->hash & (alias_table_size - 1);
+			alias->next = alias_table[bucket];
+			alias_table[bucket] = alias;
+		}
+	}
+
+	free(old_table);
+}
+
+
+struct alias *
+get_alias(const char *name, size_t length)
+{
+	/* this is the common case for non-interactive shells,
+	 * and is checked for every word in command position */
+	if (!naliases)
+		return NULL;
+	return *find_alias(name, length, hash_alias_name(name, length));
+}
+
+
+static struct parser_state *copy_parser_state(const struct parser_state *state, size_t line_number);
+
+
+/* The expansion of an alias is reported at the line where the alias is used */
+struct argument *
+copy_raw_argument(const struct argument *argument, size_t line_number)
+{
+	struct argument *copy = NULL, **nextp = &copy;
+
+	for (; argument; argument = argument->next_part) {
+		*nextp = emalloc(sizeof(**nextp));
+		**nextp = *argument;
+		(*nextp)->line_number = line_number;
+		switch (argument->type) {
+		case QUOTED:
+		case UNQUOTED:
+			(*nextp)->text = emalloc(argument->length + 1);
+			memcpy((*nextp)->text, argument->text, argument->length + 1);
+			break;
+
+		case QUOTE_EXPRESSION:
+		case BACKQUOTE_EXPRESSION:
+		case ARITHMETIC_EXPRESSION:
+		case VARIABLE_SUBSTITUTION:
+		case SUBSHELL_SUBSTITUTION:
+		case PROCESS_SUBSTITUTION_INPUT:
+		case PROCESS_SUBSTITUTION_OUTPUT:
+		case PROCESS_SUBSTITUTION_INPUT_OUTPUT:
+		case SUBSHELL:
+		case ARITHMETIC_SUBSHELL:
+			(*nextp)->child = copy_parser_state(argument->child, line_number);
+			break;
+
+		case REDIRECTION:
+		case FUNCTION_MARK:
+			break;
+
+		default:
+		case VARIABLE: /* used by interpreter, not parser */
+		case OPERATOR: /* ditto */
+		case COMMAND: /* ditto */
+			abort();
+		}
+		nextp = &(*nextp)->next_part;
+	}
+
+	*nextp = NULL;
+	return copy;
+}
+
+
+struct redirection *
+copy_raw_redirection(const struct redirection *redirection, size_t line_number)
+{
+	struct redirection *copy;
+
+	copy = ecalloc(1, sizeof(*copy));
+	copy->type = redirection->type;
+	copy->left_hand_side = copy_raw_argument(redirection->left_hand_side, line_number);
+	return copy;
+}
+
+
+static struct command *
+copy_raw_command(const struct command *command, size_t line_number)
+{
+	struct command *copy;
+	size_t i;
+
+	copy = emalloc(sizeof(*copy));
+	*copy = *command;
+	copy->terminal_line_number = line_number;
+	copy->arguments = emalloc(command->narguments * sizeof(*copy->arguments) + 1);
+	for (i = 0; i < command->narguments; i++)
+		copy->arguments[i] = copy_raw_argument(command->arguments[i], line_number);
+	copy->redirections = emalloc(command->nredirections * sizeof(*copy->redirections) + 1);
+	for (i = 0; i < command->nredirections; i++)
+		copy->redirections[i] = copy_raw_redirection(command->redirections[i], line_number);
+	return copy;
+}
+
+
+static struct parser_state *
+copy_parser_state(const struct parser_state *state, size_t line_number)
+{
+	struct parser_state *copy;
+	size_t i;
+
+	copy = ecalloc(1, sizeof(*copy));
+	copy->ncommands = state->ncommands;
+	copy->commands = emalloc(state->ncommands * sizeof(*copy->commands) + 1);
+	for (i = 0; i < state->ncommands; i++)
+		copy->commands[i] = copy_raw_command(state->commands[i], line_number);
+	copy->narguments = state->narguments;
+	copy->arguments = emalloc(state->narguments * sizeof(*copy->arguments) + 1);
+	for (i = 0; i < state->narguments; i++)
+		copy->arguments[i] = copy_raw_argument(state->arguments[i], line_number);
+	copy->nredirections = state->nredirections;
+	copy->redirections = emalloc(state->nredirections * sizeof(*copy->redirections) + 1);
+	for (i = 0; i < state->nredirections; i++)
+		copy->redirections[i] = copy_raw_redirection(state->redirections[i], line_number);
+	return copy;
+}
+
+
+static struct parser_state *
+tokenise_alias(const char *name, const char *value)
+{
+	struct parser_context ctx;
+	struct parser_state *expansion = NULL, *state;
+	struct command *command;
+	size_t length = strlen(value), parsed, nremoved;
+	char *code;
+
+	/* the expansion is tokenised once, here, rather than every time
+	 * it is used, but aliases in it are substituted when it is used */
+	initialise_parser_context(&ctx, 1, 1);
+	ctx.do_not_run = 1;
+	ctx.no_alias_substitution = 1;
+	ctx.end_of_file_reached = 1;
+	code = emalloc(length + 1);
+	memcpy(code, value, length + 1);
+	parsed = parse(&ctx, code, length, &nremoved);
+	push_whitespace(&ctx, 0);
+
+	if (parsed < length - nremoved || ctx.mode_stack->previous || ctx.parser_state->need_right_hand_side)
+		weprintf("alias: %s: value ends within a quote, substitution, or redirection, which is not supported\n", name);
+	else if (ctx.here_document_stack->first)
+		weprintf("alias: %s: here-documents in aliases are not supported\n", name);
+	else
+		expansion = ctx.parser_state;
+
+	if (!expansion) {
+		for (state = ctx.parser_state; state->parent; state = state->parent);
+		destroy_parser_state(state);
+	} else if (expansion->ncommands) {
+		/* push_end_of_file() terminates the last command with a newline,
+		 * but the words after the last terminal shall be joined with
+		 * the words after the alias when it is used; an actual newline
+		 * would have advanced the line number */
+		command = expansion->commands[expansion->ncommands - 1];
+		if (command->terminal == NEWLINE && command->terminal_line_number == ctx.tokeniser_line_number) {
+			expansion->ncommands -= 1;
+			free(expansion->arguments);
+			free(expansion->redirections);
+			expansion->arguments = command->arguments;
+			expansion->narguments = command->narguments;
+			expansion->redirections = command->redirections;
+			expansion->nredirections = command->nredirections;
+			free(command);
+		}
+	}
+	while (ctx.mode_stack) {
+		struct mode_stack *previous = ctx.mode_stack->previous;
+		free(ctx.mode_stack);
+		ctx.mode_stack = previous;
+	}
+	free(ctx.here_document_stack);
+	free(ctx.interpreter_state);
+	free(code);
+	return expansion;
+}
+
+
+int
+define_alias(const char *name, size_t name_length, const char *value)
+{
+	struct parser_state *expansion;
+	struct alias **aliasp, *alias;
+	size_t hash, length;
+
+	expansion = tokenise_alias(name, value);
+	if (!expansion)
+		return -1;
+
+	if (naliases >= alias_table_size / 4 * 3)
+		grow_alias_table();
+
+	hash = hash_alias_name(name, name_length);
+	aliasp = find_alias(name, name_length, hash);
+	alias = *aliasp;
+	if (alias) {
+		free(alias->value);
+		destroy_parser_state(alias->expansion);
+	} else {
+		alias = *aliasp = ecalloc(1, sizeof(*alias));
+		alias->name = emalloc(name_length + 1);
+		memcpy(alias->name, name, name_length);
+		alias->name[name_length] = '\0';
+		alias->name_length = name_length;
+		alias->hash = hash;
+		naliases += 1;
+	}
+
+	length = strlen(value);
+	alias->value = estrdup(value);
+	alias->expansion = expansion;
+	alias->trailing_blank = (length && isblank(value[length - 1]) && (length < 2 || value[length - 2] != '\\'));
+	alias_generation += 1;
+	return 0;
+}
+
+
+static void
+free_alias(struct alias *alias)
+{
+	free(alias->name);
+	free(alias->value);
+	destroy_parser_state(alias->expansion);
+	free(alias);
+}
+
+
+int
+undefine_alias(const char *name, size_t name_length)
+{
+	struct alias **aliasp, *alias;
+
+	if (!naliases)
+		return -1;
+	aliasp = find_alias(name, name_length, hash_alias_name(name, name_length));
+	if (!(alias = *aliasp))
+		return -1;
+
+	*aliasp = alias->next;
+	free_alias(alias);
+	naliases -= 1;
+	alias_generation += 1;
+	return 0;
+}
+
+
+void
+undefine_all_aliases(void)
+{
+	struct alias *alias, *next;
+	size_t i;
+
+	for (i = 0; i < alias_table_size; i++) {
+		for (alias = alias_table[i]; alias; alias = next) {
+			next = alias->next;
+			free_alias(alias);
+		}
+		alias_table[i] = NULL;
+	}
+	if (naliases) {
+		naliases = 0;
+		alias_generation += 1;
+	}
+}
+
+
+static int
+alias_name_cmp(const void *a, const void *b)
+{
+	return strcmp((*(struct alias *const *)a)->name, (*(struct alias *const *)b)->name);
+}
+
+
+size_t
+get_aliases(struct alias ***aliasesp)
+{
+	struct alias *alias;
+	size_t i, n = 0;
+
+	*aliasesp = emalloc(naliases * sizeof(**aliasesp) + 1);
+	for (i = 0; i < alias_table_size; i++)
+		for (alias = alias_table[i]; alias; alias = alias->next)
+			(*aliasesp)[n++] = alias;
+	qsort(*aliasesp, n, sizeof(**aliasesp), alias_name_cmp);
+	return n;
+}
+
+
+size_t
+get_alias_generation(void)
+{
+	return alias_generation;
+}
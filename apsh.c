@@ -1,11 +1,13 @@
 /* See LICENSE file for copyright and license details. */
 #include "common.h"
+#include <locale.h>
 
-USAGE("");
+USAGE("[-nkITV] [-j jobs] [-K cache-directory] [file]");
 
 
 int login_shell;
 int posix_mode;
+int check_syntax_only;
 
 
 void
@@ -27,20 +29,17 @@ initialise_parser_context(struct parser_context *ctx, int need_tokeniser, int ne
 }
 
 
-static int
-is_sh(char *name)
+static ssize_t
+read_file(void *fdp, char *buffer, size_t size)
 {
-	if (!strcmp(name, "sh"))
-		return 1;
-	name = strrchr(name, '/');
-	return name && !strcmp(name, "/sh");
+	return read(*(int *)fdp, buffer, size);
 }
 
 
-int
-main(int argc, char *argv[])
+void
+parse_input(struct parser_context *ctx, ssize_t (*read_input)(void *source, char *buffer, size_t size),
+            void *source, const char *name)
 {
-	struct parser_context ctx;
 	char *buffer = NULL;
 	size_t buffer_size = 0;
 	size_t buffer_head = 0;
@@ -48,22 +47,6 @@ main(int argc, char *argv[])
 	ssize_t r;
 	size_t n, nremoved;
 
-	ARGBEGIN {
-	default:
-		usage();
-	} ARGEND;
-
-	if (argc)
-		usage();
-
-	login_shell = (argv0[0] == '-');
-	posix_mode = is_sh(&argv0[login_shell]);
-
-	initialise_parser_context(&ctx, 1, 1);
-	ctx.tty_input = (char)isatty(STDIN_FILENO);
-	if (ctx.tty_input)
-		weprintf("apsh is currently not implemented to be interactive\n");
-
 	for (;;) {
 		if (buffer_size - buffer_head < PARSE_RINGBUFFER_MIN_AVAILABLE) {
 			if (buffer_tail && buffer_head - buffer_tail <= buffer_tail) {
@@ -75,31 +58,160 @@ main(int argc, char *argv[])
 				buffer = erealloc(buffer, buffer_size += PARSE_RINGBUFFER_INCREASE_SIZE);
 		}
 
-		r = read(STDIN_FILENO, &buffer[buffer_head], buffer_size - buffer_head);
+		r = read_input(source, &buffer[buffer_head], buffer_size - buffer_head);
 		if (r <= 0) {
 			if (!r)
 				break;
-			eprintf("read <stdin>:");
+			eprintf("read %s:", name);
 		}
 		n = (size_t)r;
 
 		buffer_head += n;
-		buffer_tail += n = parse(&ctx, &buffer[buffer_tail], buffer_head - buffer_tail, &nremoved);
+		buffer_tail += n = parse(ctx, &buffer[buffer_tail], buffer_head - buffer_tail, &nremoved);
 		buffer_head -= nremoved;
 	}
 
-	ctx.end_of_file_reached = 1;
-	buffer_tail += parse(&ctx, &buffer[buffer_tail], buffer_head - buffer_tail, &nremoved);
+	ctx->end_of_file_reached = 1;
+	buffer_tail += parse(ctx, &buffer[buffer_tail], buffer_head - buffer_tail, &nremoved);
 	buffer_head -= nremoved;
-	if (buffer_tail != buffer_head || ctx.premature_end_of_file)
+	if (buffer_tail != buffer_head || ctx->premature_end_of_file)
 		eprintf("premature end of file reached\n");
 
+	free(buffer);
+}
+
+
+void
+parse_file(struct parser_context *ctx, int fd, const char *name)
+{
+	parse_input(ctx, read_file, &fd, name);
+}
+
+
+static int
+is_sh(char *name)
+{
+	if (!strcmp(name, "sh"))
+		return 1;
+	name = strrchr(name, '/');
+	return name && !strcmp(name, "/sh");
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	struct parser_context ctx;
+	struct compiled_cache *cache;
+	const char *script_path = NULL, *name;
+	const char *cache_dir = NULL;
+	int use_cache = 0, verify_cache = 0, ignore_cache = 0, use_threads = 0;
+	int input_fd = STDIN_FILENO;
+	size_t jobs = 0;
+	char *end;
+
+	/* pathname expansion results are sorted by the collation sequence */
+	setlocale(LC_COLLATE, "");
+
+	ARGBEGIN {
+	case 'n':
+		check_syntax_only = 1;
+		break;
+	case 'k':
+		use_cache = 1;
+		cache_dir = NULL;
+		break;
+	case 'K':
+		use_cache = 1;
+		cache_dir = EARGF(usage());
+		break;
+	case 'I':
+		ignore_cache = 1;
+		break;
+	case 'j':
+		errno = 0;
+		jobs = (size_t)strtoul(EARGF(usage()), &end, 10);
+		if (errno || *end || !jobs)
+			usage();
+		break;
+	case 'T':
+		use_threads = 1;
+		break;
+	case 'V':
+		verify_cache = 1;
+		break;
+	default:
+		usage();
+	} ARGEND;
+
+	if (argc > 1)
+		usage();
+
+	if (argc) {
+		script_path = argv[0];
+		input_fd = open(script_path, O_RDONLY | O_CLOEXEC);
+		if (input_fd < 0)
+			eprintf("open %s O_RDONLY:", script_path);
+	} else if (use_cache) {
+		weprintf("compiled cache is only used for script files\n");
+		use_cache = 0;
+	}
+
+	login_shell = (argv0[0] == '-');
+	posix_mode = is_sh(&argv0[login_shell]);
+
+	/* before anything is forked, so that every fork shares it */
+	if (!check_syntax_only)
+		create_variable_store();
+
+	/* a script is not given any positional parameters */
+	name = script_path ? script_path : argv0;
+	set_variable(get_variable_slot("0", 1), name, strlen(name));
+	set_variable_integer(get_variable_slot("#", 1), 0);
+	set_variable_integer(get_variable_slot("$", 1), (int64_t)getpid());
+
+	initialise_parser_context(&ctx, 1, 1);
+	ctx.run_commands = 1;
+	ctx.tty_input = (char)isatty(input_fd);
+	if (ctx.tty_input)
+		weprintf("apsh is currently not implemented to be interactive\n");
+
+	if (use_cache) {
+		/* in syntax check mode, the cache is rebuilt, with all function
+		 * bodies interpreted, rather than loaded, making it possible to
+		 * build the cache without running the script */
+		if (!ignore_cache && !check_syntax_only) {
+			cache = load_compiled_cache(input_fd, script_path, cache_dir, verify_cache);
+			if (cache) {
+				while (read_compiled_commands(cache, ctx.interpreter_state)) {
+					execute_and_release(ctx.interpreter_state->commands, ctx.interpreter_state->ncommands);
+					ctx.interpreter_state->ncommands = 0;
+				}
+				close_compiled_cache(cache, 0);
+				goto out;
+			}
+		}
+		ctx.compiled_cache = create_compiled_cache(input_fd, script_path, cache_dir);
+	}
+
+	name = script_path ? script_path : "<stdin>";
+	if (check_syntax_only && parse_file_in_parallel(&ctx, input_fd, name, jobs))
+		;
+	else if (use_threads)
+		parse_file_threaded(&ctx, input_fd, name);
+	else
+		parse_file(&ctx, input_fd, name);
+
+	close_compiled_cache(ctx.compiled_cache, 1);
+
+out:
 	free(ctx.parser_state->commands);
 	free(ctx.parser_state->arguments);
 	free(ctx.parser_state->redirections);
 	free(ctx.parser_state);
 	free(ctx.here_document_stack);
+	free(ctx.mode_stack);
+	free(ctx.interpreter_state->commands);
 	free(ctx.interpreter_state);
-	free(buffer);
-	return 0;
+	return last_exit_status;
 }
@@ -0,0 +1,96 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+
+/* Memory that lives until the arena is reset, allocated by bumping
+ * an offset; when a chunk is full, a new one is allocated, and when
+ * the arena is reset, the chunks are merged into one large enough
+ * for all of them, so that the arena stops growing after a few uses */
+
+#define ARENA_ALIGNMENT (sizeof(void *) > sizeof(int64_t) ? sizeof(void *) : sizeof(int64_t))
+
+struct arena_chunk {
+	struct arena_chunk *previous;
+	size_t size;
+	size_t used;
+	union {
+		void *pointer;
+		int64_t integer;
+	} data[];
+};
+
+
+void *
+arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk = arena->chunk;
+	size_t chunk_size;
+	void *ret;
+
+	size = (size + (ARENA_ALIGNMENT - 1)) & ~(ARENA_ALIGNMENT - 1);
+
+	if (!chunk || chunk->size - chunk->used < size) {
+		chunk_size = MAX(chunk ? chunk->size * 2 : ARENA_INITIAL_SIZE, size);
+		chunk = emalloc(offsetof(struct arena_chunk, data) + chunk_size);
+		chunk->previous = arena->chunk;
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		arena->chunk = chunk;
+		arena->size += chunk_size;
+	}
+
+	ret = &((char *)chunk->data)[chunk->used];
+	chunk->used += size;
+	return ret;
+}
+
+
+char *
+arena_strndup(struct arena *arena, const char *text, size_t length)
+{
+	char *ret = arena_alloc(arena, length + 1);
+	memcpy(ret, text, length);
+	ret[length] = '\0';
+	return ret;
+}
+
+
+void
+arena_reset(struct arena *arena)
+{
+	struct arena_chunk *chunk = arena->chunk, *previous;
+	size_t size = arena->size;
+
+	if (!chunk)
+		return;
+
+	if (!chunk->previous) {
+		chunk->used = 0;
+		return;
+	}
+
+	for (; chunk; chunk = previous) {
+		previous = chunk->previous;
+		free(chunk);
+	}
+
+	chunk = emalloc(offsetof(struct arena_chunk, data) + size);
+	chunk->previous = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	arena->chunk = chunk;
+}
+
+
+void
+arena_destroy(struct arena *arena)
+{
+	struct arena_chunk *chunk, *previous;
+
+	for (chunk = arena->chunk; chunk; chunk = previous) {
+		previous = chunk->previous;
+		free(chunk);
+	}
+	arena->chunk = NULL;
+	arena->size = 0;
+}
@@ -0,0 +1,997 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+#include <setjmp.h>
+
+
+enum arithmetic_opcode {
+	PUSH_CONSTANT,
+	PUSH_VARIABLE,
+	STORE_VARIABLE, /* leaves the value on the stack */
+	PRE_INCREMENT,
+	PRE_DECREMENT,
+	POST_INCREMENT,
+	POST_DECREMENT,
+	/* unary, pops 1 and pushes 1 */
+	NEGATE,
+	COMPLEMENT,
+	LOGICAL_NOT,
+	TO_BOOLEAN,
+	/* binary, pops 2 and pushes 1 */
+	POWER,
+	MULTIPLY,
+	DIVIDE,
+	MODULO,
+	ADD,
+	SUBTRACT,
+	SHIFT_LEFT,
+	SHIFT_RIGHT,
+	LESS,
+	LESS_EQUAL,
+	GREATER,
+	GREATER_EQUAL,
+	EQUAL,
+	NOT_EQUAL,
+	BITWISE_AND,
+	BITWISE_XOR,
+	BITWISE_OR,
+	/* control flow, .offset is relative to the next instruction */
+	AND_JUMP, /* if top is 0, jump, otherwise pop */
+	OR_JUMP, /* if top is non-0, replace with 1 and jump, otherwise pop */
+	JUMP_IF_ZERO, /* pops */
+	JUMP,
+	DISCARD
+};
+
+struct arithmetic_instruction {
+	enum arithmetic_opcode opcode;
+	union {
+		int64_t value;
+		struct variable *variable;
+		size_t offset;
+	};
+};
+
+struct arithmetic_program {
+	struct arithmetic_instruction *instructions;
+	size_t ninstructions;
+	size_t stack_size;
+	char *source; /* NULL if compiled at parse-time, otherwise the expanded text it was compiled from */
+};
+
+struct arithmetic_compiler {
+	const char *s;
+	const char *error;
+	size_t line_number;
+	struct arithmetic_instruction *instructions;
+	size_t ninstructions;
+	size_t size;
+	jmp_buf on_error;
+};
+
+struct binary_operator {
+	char token[3];
+	unsigned char precedence;
+	enum arithmetic_opcode opcode;
+};
+
+/* longer tokens must be listed before their prefixes */
+static const struct binary_operator binary_operators[] = {
+	{"||",  1, OR_JUMP},
+	{"&&",  2, AND_JUMP},
+	{"|",   3, BITWISE_OR},
+	{"^",   4, BITWISE_XOR},
+	{"&",   5, BITWISE_AND},
+	{"==",  6, EQUAL},
+	{"!=",  6, NOT_EQUAL},
+	{"<<",  8, SHIFT_LEFT},
+	{">>",  8, SHIFT_RIGHT},
+	{"<=",  7, LESS_EQUAL},
+	{">=",  7, GREATER_EQUAL},
+	{"<",   7, LESS},
+	{">",   7, GREATER},
+	{"+",   9, ADD},
+	{"-",   9, SUBTRACT},
+	{"**", 11, POWER},
+	{"*",  10, MULTIPLY},
+	{"/",  10, DIVIDE},
+	{"%",  10, MODULO}
+};
+
+static const struct binary_operator assignment_operators[] = {
+	{"<<", 0, SHIFT_LEFT},
+	{">>", 0, SHIFT_RIGHT},
+	{"*",  0, MULTIPLY},
+	{"/",  0, DIVIDE},
+	{"%",  0, MODULO},
+	{"+",  0, ADD},
+	{"-",  0, SUBTRACT},
+	{"&",  0, BITWISE_AND},
+	{"^",  0, BITWISE_XOR},
+	{"|",  0, BITWISE_OR}
+};
+
+
+static int64_t evaluate_variable(struct variable *variable, size_t line_number, size_t depth);
+
+
+static int
+apply_unary(enum arithmetic_opcode opcode, int64_t a, int64_t *resultp)
+{
+	switch (opcode) {
+	case NEGATE:      *resultp = (int64_t)(0 - (uint64_t)a); break;
+	case COMPLEMENT:  *resultp = ~a;                         break;
+	case LOGICAL_NOT: *resultp = !a;                         break;
+	case TO_BOOLEAN:  *resultp = !!a;                        break;
+	default:
+		abort();
+	}
+	return 1;
+}
+
+
+static int
+apply_binary(enum arithmetic_opcode opcode, int64_t a, int64_t b, int64_t *resultp)
+{
+	uint64_t base, result;
+
+	/* arithmetic is done unsigned, so that overflow wraps rather than being undefined */
+	switch (opcode) {
+	case POWER:
+		if (b < 0)
+			return 0;
+		for (base = (uint64_t)a, result = 1; b; b >>= 1, base *= base)
+			if (b & 1)
+				result *= base;
+		*resultp = (int64_t)result;
+		break;
+	case MULTIPLY: *resultp = (int64_t)((uint64_t)a * (uint64_t)b); break;
+	case DIVIDE:
+		if (!b)
+			return 0;
+		*resultp = (b == -1) ? (int64_t)(0 - (uint64_t)a) : a / b;
+		break;
+	case MODULO:
+		if (!b)
+			return 0;
+		*resultp = (b == -1) ? 0 : a % b;
+		break;
+	case ADD:           *resultp = (int64_t)((uint64_t)a + (uint64_t)b);        break;
+	case SUBTRACT:      *resultp = (int64_t)((uint64_t)a - (uint64_t)b);        break;
+	case SHIFT_LEFT:    *resultp = (int64_t)((uint64_t)a << (b & 63));          break;
+	case SHIFT_RIGHT:   *resultp = a >> (b & 63);                               break;
+	case LESS:          *resultp = a < b;                                       break;
+	case LESS_EQUAL:    *resultp = a <= b;                                      break;
+	case GREATER:       *resultp = a > b;                                       break;
+	case GREATER_EQUAL: *resultp = a >= b;                                      break;
+	case EQUAL:         *resultp = a == b;                                      break;
+	case NOT_EQUAL:     *resultp = a != b;                                      break;
+	case BITWISE_AND:   *resultp = a & b;                                       break;
+	case BITWISE_XOR:   *resultp = a ^ b;                                       break;
+	case BITWISE_OR:    *resultp = a | b;                                       break;
+	default:
+		abort();
+	}
+	return 1;
+}
+
+
+static void
+arithmetic_error(struct arithmetic_compiler *c, const char *error)
+{
+	c->error = error;
+	longjmp(c->on_error, 1);
+}
+
+
+static size_t
+emit(struct arithmetic_compiler *c, enum arithmetic_opcode opcode)
+{
+	if (c->ninstructions == c->size)
+		c->instructions = erealloc(c->instructions, (c->size = c->size ? c->size * 2 : 16) * sizeof(*c->instructions));
+	memset(&c->instructions[c->ninstructions], 0, sizeof(*c->instructions));
+	c->instructions[c->ninstructions].opcode = opcode;
+	return c->ninstructions++;
+}
+
+
+static void
+emit_constant(struct arithmetic_compiler *c, int64_t value)
+{
+	size_t i = emit(c, PUSH_CONSTANT);
+	c->instructions[i].value = value;
+}
+
+
+static void
+emit_variable(struct arithmetic_compiler *c, enum arithmetic_opcode opcode, struct variable *variable)
+{
+	size_t i = emit(c, opcode);
+	c->instructions[i].variable = variable;
+}
+
+
+static void
+patch_jump(struct arithmetic_compiler *c, size_t jump)
+{
+	c->instructions[jump].offset = c->ninstructions - (jump + 1);
+}
+
+
+static int
+is_constant(struct arithmetic_compiler *c, size_t start)
+{
+	return c->ninstructions == start + 1 && c->instructions[start].opcode == PUSH_CONSTANT;
+}
+
+
+static void
+remove_instructions(struct arithmetic_compiler *c, size_t start, size_t count)
+{
+	/* jumps are relative, so moving whole sub-expressions is safe */
+	memmove(&c->instructions[start], &c->instructions[start + count],
+	        (c->ninstructions - start - count) * sizeof(*c->instructions));
+	c->ninstructions -= count;
+}
+
+
+static void
+fold_unary(struct arithmetic_compiler *c, size_t start)
+{
+	struct arithmetic_instruction *instructions = c->instructions;
+	int64_t result;
+
+	if (c->ninstructions == start + 2 && instructions[start].opcode == PUSH_CONSTANT &&
+	    apply_unary(instructions[start + 1].opcode, instructions[start].value, &result)) {
+		c->ninstructions = start;
+		emit_constant(c, result);
+	}
+}
+
+
+static void
+fold_binary(struct arithmetic_compiler *c, size_t start)
+{
+	struct arithmetic_instruction *instructions = c->instructions;
+	int64_t result;
+
+	/* division by zero is left for evaluation, so that it is only
+	 * reported if the expression is actually evaluated */
+	if (c->ninstructions == start + 3 &&
+	    instructions[start + 0].opcode == PUSH_CONSTANT &&
+	    instructions[start + 1].opcode == PUSH_CONSTANT &&
+	    apply_binary(instructions[start + 2].opcode, instructions[start].value, instructions[start + 1].value, &result)) {
+		c->ninstructions = start;
+		emit_constant(c, result);
+	}
+}
+
+
+static void
+skip_whitespace(struct arithmetic_compiler *c)
+{
+	while (*c->s == ' ' || *c->s == '\t' || *c->s == '\n')
+		c->s++;
+}
+
+
+static int
+skip_token(struct arithmetic_compiler *c, const char *token)
+{
+	size_t length = strlen(token);
+	skip_whitespace(c);
+	if (strncmp(c->s, token, length))
+		return 0;
+	c->s += length;
+	return 1;
+}
+
+
+PURE_FUNC
+static size_t
+get_identifier_length(const char *s)
+{
+	size_t length = 0;
+	if (isalpha(*s) || *s == '_')
+		for (length = 1; isalnum(s[length]) || s[length] == '_'; length++);
+	return length;
+}
+
+
+static struct variable *
+compile_identifier(struct arithmetic_compiler *c)
+{
+	struct variable *variable;
+	size_t length;
+
+	skip_whitespace(c);
+	length = get_identifier_length(c->s);
+	if (!length)
+		arithmetic_error(c, "expected variable name");
+	variable = get_variable_slot(c->s, length);
+	c->s += length;
+	return variable;
+}
+
+
+PURE_FUNC
+static int
+get_digit_value(char ch, unsigned base)
+{
+	if (isdigit(ch))
+		return ch - '0';
+	if (base <= 36) {
+		if (isalpha(ch))
+			return tolower(ch) - 'a' + 10;
+	} else {
+		if (islower(ch))
+			return ch - 'a' + 10;
+		if (isupper(ch))
+			return ch - 'A' + 36;
+		if (ch == '@')
+			return 62;
+		if (ch == '_')
+			return 63;
+	}
+	return -1;
+}
+
+
+static int
+parse_integer(const char **sp, int64_t *valuep, size_t line_number)
+{
+	const char *s = *sp;
+	uint64_t value = 0;
+	unsigned base = 10;
+	int digit;
+
+	if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X') && isxdigit(s[2])) {
+		base = 16;
+		s = &s[2];
+	} else if (s[0] == '0') {
+		base = 8;
+	} else {
+		for (; isdigit(*s); s++)
+			value = value * 10 + (uint64_t)(*s - '0');
+		if (*s != '#' || !check_extension("#", line_number))
+			goto out;
+		if (value < 2 || value > 64)
+			return 0;
+		base = (unsigned)value;
+		value = 0;
+		s++;
+		if (get_digit_value(*s, base) < 0)
+			return 0;
+	}
+
+	for (; isalnum(*s) || *s == '@' || *s == '_'; s++) {
+		digit = get_digit_value(*s, base);
+		if (digit < 0 || (unsigned)digit >= base)
+			return 0;
+		value = value * base + (uint64_t)digit;
+	}
+
+out:
+	if (isalnum(*s) || *s == '_' || *s == '@' || *s == '#')
+		return 0;
+	*sp = s;
+	*valuep = (int64_t)value;
+	return 1;
+}
+
+
+static void compile_comma(struct arithmetic_compiler *c);
+static void compile_assignment(struct arithmetic_compiler *c);
+static void compile_conditional(struct arithmetic_compiler *c);
+
+
+static void
+compile_operand(struct arithmetic_compiler *c)
+{
+	struct variable *variable;
+	int64_t value;
+
+	skip_whitespace(c);
+	if (*c->s == '(') {
+		c->s++;
+		compile_comma(c);
+		if (!skip_token(c, ")"))
+			arithmetic_error(c, "expected ')'");
+	} else if (isdigit(*c->s)) {
+		if (!parse_integer(&c->s, &value, c->line_number))
+			arithmetic_error(c, "invalid number");
+		emit_constant(c, value);
+	} else if (get_identifier_length(c->s)) {
+		variable = compile_identifier(c);
+		if (skip_token(c, "++"))
+			emit_variable(c, POST_INCREMENT, variable);
+		else if (skip_token(c, "--"))
+			emit_variable(c, POST_DECREMENT, variable);
+		else
+			emit_variable(c, PUSH_VARIABLE, variable);
+	} else {
+		arithmetic_error(c, *c->s ? "expected operand" : "missing operand");
+	}
+}
+
+
+static void
+compile_unary(struct arithmetic_compiler *c)
+{
+	size_t start = c->ninstructions;
+	enum arithmetic_opcode opcode;
+	const char *s;
+
+	skip_whitespace(c);
+	if ((c->s[0] == '+' || c->s[0] == '-') && c->s[1] == c->s[0]) {
+		for (s = &c->s[2]; *s == ' ' || *s == '\t' || *s == '\n'; s++);
+		if (get_identifier_length(s)) {
+			opcode = c->s[0] == '+' ? PRE_INCREMENT : PRE_DECREMENT;
+			c->s += 2;
+			emit_variable(c, opcode, compile_identifier(c));
+			return;
+		}
+	}
+
+	switch (*c->s) {
+	case '+': c->s++; compile_unary(c); return;
+	case '-': opcode = NEGATE;      break;
+	case '~': opcode = COMPLEMENT;  break;
+	case '!': opcode = LOGICAL_NOT; break;
+	default:
+		compile_operand(c);
+		return;
+	}
+
+	c->s++;
+	compile_unary(c);
+	emit(c, opcode);
+	fold_unary(c, start);
+}
+
+
+static const struct binary_operator *
+get_binary_operator(struct arithmetic_compiler *c)
+{
+	size_t i, length;
+
+	skip_whitespace(c);
+	for (i = 0; i < ELEMSOF(binary_operators); i++) {
+		length = strlen(binary_operators[i].token);
+		if (strncmp(c->s, binary_operators[i].token, length))
+			continue;
+		/* "a == b" is a comparison, but "a = b" and "a += b" are not binary operators */
+		if (c->s[length] == '=' && binary_operators[i].opcode != EQUAL && binary_operators[i].opcode != NOT_EQUAL &&
+		    binary_operators[i].opcode != LESS_EQUAL && binary_operators[i].opcode != GREATER_EQUAL)
+			return NULL;
+		if (binary_operators[i].opcode == POWER && !check_extension("**", c->line_number))
+			return NULL;
+		return &binary_operators[i];
+	}
+	return NULL;
+}
+
+
+static void
+compile_binary(struct arithmetic_compiler *c, unsigned min_precedence)
+{
+	const struct binary_operator *op;
+	size_t start = c->ninstructions, jump;
+	int64_t value;
+	int decided;
+
+	compile_unary(c);
+
+	while ((op = get_binary_operator(c)) && op->precedence >= min_precedence) {
+		c->s += strlen(op->token);
+
+		if (op->opcode == AND_JUMP || op->opcode == OR_JUMP) {
+			if (is_constant(c, start)) {
+				/* the right-hand side must still be valid, but is dropped if it cannot affect the result */
+				value = c->instructions[start].value;
+				decided = (op->opcode == AND_JUMP) ? !value : !!value;
+				compile_binary(c, op->precedence + 1U);
+				if (decided) {
+					c->ninstructions = start;
+					emit_constant(c, op->opcode == OR_JUMP);
+					continue;
+				}
+				remove_instructions(c, start, 1);
+			} else {
+				jump = emit(c, op->opcode);
+				compile_binary(c, op->precedence + 1U);
+				emit(c, TO_BOOLEAN);
+				patch_jump(c, jump);
+				continue;
+			}
+			emit(c, TO_BOOLEAN);
+			fold_unary(c, start);
+		} else {
+			/* ** is right-associative */
+			compile_binary(c, op->precedence + (op->opcode != POWER));
+			emit(c, op->opcode);
+			fold_binary(c, start);
+		}
+	}
+}
+
+
+static void
+compile_conditional(struct arithmetic_compiler *c)
+{
+	size_t start = c->ninstructions, then_end, branch, jump;
+	int64_t value;
+
+	compile_binary(c, 1);
+	if (!skip_token(c, "?"))
+		return;
+
+	if (is_constant(c, start)) {
+		value = c->instructions[start].value;
+		c->ninstructions = start;
+		compile_comma(c);
+		then_end = c->ninstructions;
+		if (!skip_token(c, ":"))
+			arithmetic_error(c, "expected ':'");
+		compile_conditional(c);
+		if (value)
+			c->ninstructions = then_end;
+		else
+			remove_instructions(c, start, then_end - start);
+	} else {
+		branch = emit(c, JUMP_IF_ZERO);
+		compile_comma(c);
+		jump = emit(c, JUMP);
+		patch_jump(c, branch);
+		if (!skip_token(c, ":"))
+			arithmetic_error(c, "expected ':'");
+		compile_conditional(c);
+		patch_jump(c, jump);
+	}
+}
+
+
+static void
+compile_assignment(struct arithmetic_compiler *c)
+{
+	const struct binary_operator *op = NULL;
+	struct variable *variable;
+	const char *s;
+	size_t i, length;
+
+	skip_whitespace(c);
+	length = get_identifier_length(c->s);
+	if (!length)
+		goto not_assignment;
+
+	for (s = &c->s[length]; *s == ' ' || *s == '\t' || *s == '\n'; s++);
+	if (*s == '=') {
+		if (s[1] == '=')
+			goto not_assignment;
+	} else {
+		for (i = 0; i < ELEMSOF(assignment_operators); i++) {
+			op = &assignment_operators[i];
+			if (!strncmp(s, op->token, strlen(op->token)) && s[strlen(op->token)] == '=')
+				break;
+		}
+		if (i == ELEMSOF(assignment_operators))
+			goto not_assignment;
+		s += strlen(op->token);
+	}
+
+	variable = compile_identifier(c);
+	c->s = &s[1];
+	if (op)
+		emit_variable(c, PUSH_VARIABLE, variable);
+	compile_assignment(c);
+	if (op)
+		emit(c, op->opcode);
+	emit_variable(c, STORE_VARIABLE, variable);
+	return;
+
+not_assignment:
+	compile_conditional(c);
+}
+
+
+static void
+compile_comma(struct arithmetic_compiler *c)
+{
+	size_t start = c->ninstructions;
+
+	compile_assignment(c);
+	while (skip_token(c, ",")) {
+		if (is_constant(c, start))
+			c->ninstructions = start;
+		else
+			emit(c, DISCARD);
+		start = c->ninstructions;
+		compile_assignment(c);
+	}
+}
+
+
+PURE_FUNC
+static size_t
+get_stack_size(const struct arithmetic_instruction *instructions, size_t ninstructions)
+{
+	size_t i, depth = 0, max_depth = 0;
+
+	/* branches are treated as if they were not taken, which can only
+	 * overestimate the depth, as both arms of ?: and the right-hand
+	 * side of && and || each push exactly one value */
+	for (i = 0; i < ninstructions; i++) {
+		switch (instructions[i].opcode) {
+		case PUSH_CONSTANT:
+		case PUSH_VARIABLE:
+		case PRE_INCREMENT:
+		case PRE_DECREMENT:
+		case POST_INCREMENT:
+		case POST_DECREMENT:
+			depth += 1;
+			break;
+		case AND_JUMP:
+		case OR_JUMP:
+		case JUMP_IF_ZERO:
+		case DISCARD:
+			depth -= 1;
+			break;
+		default:
+			if (instructions[i].opcode >= POWER && instructions[i].opcode <= BITWISE_OR)
+				depth -= 1;
+			break;
+		}
+		if (depth > max_depth)
+			max_depth = depth;
+	}
+
+	return max_depth;
+}
+
+
+static int
+compile_program(struct arithmetic_compiler *c)
+{
+	if (setjmp(c->on_error))
+		return 0;
+
+	skip_whitespace(c);
+	if (!*c->s) {
+		/* "$(( ))" evaluates to 0 */
+		emit_constant(c, 0);
+	} else {
+		compile_comma(c);
+		skip_whitespace(c);
+		if (*c->s)
+			arithmetic_error(c, *c->s == ')' ? "unbalanced ')'" : "unexpected token");
+	}
+	return 1;
+}
+
+
+static struct arithmetic_program *
+compile_arithmetic_text(const char *text, size_t line_number, const char **errorp)
+{
+	struct arithmetic_compiler c;
+	struct arithmetic_program *program;
+
+	memset(&c, 0, sizeof(c));
+	c.s = text;
+	c.line_number = line_number;
+
+	if (!compile_program(&c)) {
+		free(c.instructions);
+		if (errorp)
+			*errorp = c.error;
+		return NULL;
+	}
+
+	program = ecalloc(1, sizeof(*program));
+	program->instructions = c.instructions;
+	program->ninstructions = c.ninstructions;
+	program->stack_size = get_stack_size(c.instructions, c.ninstructions);
+	return program;
+}
+
+
+static void
+append_text(char **textp, size_t *lengthp, size_t *sizep, const char *text, size_t length)
+{
+	if (*lengthp + length + 1 > *sizep)
+		*textp = erealloc(*textp, *sizep = (*lengthp + length + 1) * 2);
+	memcpy(&(*textp)[*lengthp], text, length);
+	*lengthp += length;
+	(*textp)[*lengthp] = '\0';
+}
+
+
+static int
+get_expression_text(struct interpreter_state *expression, char **textp, size_t *lengthp, size_t *sizep)
+{
+	struct argument *part;
+	int constant = 1;
+	size_t i;
+
+	for (i = 0; i < expression->narguments; i++) {
+		for (part = expression->arguments[i]; part; part = part->next_part) {
+			switch (part->type) {
+			case QUOTED:
+			case UNQUOTED:
+				append_text(textp, lengthp, sizep, part->text, part->length);
+				break;
+
+			case ARITHMETIC_EXPRESSION:
+				/* nested parentheses are compiled as part of the outermost expression */
+				free_arithmetic_program(part->command->arithmetic);
+				part->command->arithmetic = NULL;
+				append_text(textp, lengthp, sizep, "(", 1);
+				constant &= get_expression_text(part->command, textp, lengthp, sizep);
+				append_text(textp, lengthp, sizep, ")", 1);
+				break;
+
+			case QUOTE_EXPRESSION:
+				constant &= get_expression_text(part->command, textp, lengthp, sizep);
+				break;
+
+			default:
+				/* VARIABLE, VARIABLE_SUBSTITUTION and command substitutions
+				 * are substituted as text before the expression is parsed */
+				constant = 0;
+				break;
+			}
+		}
+	}
+
+	return constant;
+}
+
+
+void
+compile_arithmetic_expression(struct argument *argument)
+{
+	struct interpreter_state *expression = argument->command;
+	char *text = NULL;
+	size_t length = 0, size = 0;
+
+	free_arithmetic_program(expression->arithmetic);
+	expression->arithmetic = NULL;
+
+	if (!get_expression_text(expression, &text, &length, &size)) {
+		/* the tree is kept and the expression is compiled when
+		 * it is evaluated, as substitutions may insert operators */
+		free(text);
+		return;
+	}
+
+	/* syntax errors are not reported until the expression is
+	 * evaluated, as it may be in code that is never run */
+	expression->arithmetic = compile_arithmetic_text(text ? text : "", argument->line_number, NULL);
+	free(text);
+}
+
+
+static int64_t
+run_arithmetic_program(const struct arithmetic_program *program, size_t line_number, size_t depth)
+{
+	int64_t stack_buffer[32], *stack = stack_buffer, a, result;
+	const struct arithmetic_instruction *instruction, *end;
+	size_t top = 0;
+
+	if (program->stack_size > ELEMSOF(stack_buffer))
+		stack = emalloc(program->stack_size * sizeof(*stack));
+
+	instruction = program->instructions;
+	end = &instruction[program->ninstructions];
+	for (; instruction < end; instruction++) {
+		switch (instruction->opcode) {
+		case PUSH_CONSTANT:
+			stack[top++] = instruction->value;
+			break;
+
+		case PUSH_VARIABLE:
+			stack[top++] = evaluate_variable(instruction->variable, line_number, depth);
+			break;
+
+		case STORE_VARIABLE:
+			set_variable_integer(instruction->variable, stack[top - 1]);
+			break;
+
+		case PRE_INCREMENT:
+		case PRE_DECREMENT:
+		case POST_INCREMENT:
+		case POST_DECREMENT:
+			a = evaluate_variable(instruction->variable, line_number, depth);
+			if (instruction->opcode == PRE_INCREMENT || instruction->opcode == POST_INCREMENT)
+				result = (int64_t)((uint64_t)a + 1);
+			else
+				result = (int64_t)((uint64_t)a - 1);
+			set_variable_integer(instruction->variable, result);
+			stack[top++] = (instruction->opcode == PRE_INCREMENT || instruction->opcode == PRE_DECREMENT) ? result : a;
+			break;
+
+		case NEGATE:
+		case COMPLEMENT:
+		case LOGICAL_NOT:
+		case TO_BOOLEAN:
+			apply_unary(instruction->opcode, stack[top - 1], &stack[top - 1]);
+			break;
+
+		case POWER:
+		case MULTIPLY:
+		case DIVIDE:
+		case MODULO:
+		case ADD:
+		case SUBTRACT:
+		case SHIFT_LEFT:
+		case SHIFT_RIGHT:
+		case LESS:
+		case LESS_EQUAL:
+		case GREATER:
+		case GREATER_EQUAL:
+		case EQUAL:
+		case NOT_EQUAL:
+		case BITWISE_AND:
+		case BITWISE_XOR:
+		case BITWISE_OR:
+			top -= 1;
+			if (!apply_binary(instruction->opcode, stack[top - 1], stack[top], &stack[top - 1])) {
+				if (instruction->opcode == POWER)
+					eprintf("exponent less than 0 in arithmetic expression at line %zu\n", line_number);
+				eprintf("division by zero in arithmetic expression at line %zu\n", line_number);
+			}
+			break;
+
+		case AND_JUMP:
+			if (!stack[top - 1])
+				instruction += instruction->offset;
+			else
+				top -= 1;
+			break;
+
+		case OR_JUMP:
+			if (stack[top - 1])
+				stack[top - 1] = 1, instruction += instruction->offset;
+			else
+				top -= 1;
+			break;
+
+		case JUMP_IF_ZERO:
+			if (!stack[--top])
+				instruction += instruction->offset;
+			break;
+
+		case JUMP:
+			instruction += instruction->offset;
+			break;
+
+		case DISCARD:
+			top -= 1;
+			break;
+
+		default:
+			abort();
+		}
+	}
+
+	result = stack[top - 1];
+	if (stack != stack_buffer)
+		free(stack);
+	return result;
+}
+
+
+static int64_t
+evaluate_text(const char *text, size_t line_number, size_t depth)
+{
+	struct arithmetic_program *program;
+	const char *error;
+	int64_t result;
+
+	program = compile_arithmetic_text(text, line_number, &error);
+	if (!program)
+		eprintf("%s in arithmetic expression \"%s\" at line %zu\n", error, text, line_number);
+	result = run_arithmetic_program(program, line_number, depth);
+	free_arithmetic_program(program);
+	return result;
+}
+
+
+static int64_t
+evaluate_variable(struct variable *variable, size_t line_number, size_t depth)
+{
+	struct text_buffer copy = {NULL, 0, 0};
+	const char *text, *s;
+	size_t length;
+	int64_t value;
+	int negative;
+
+	if (get_variable_integer(variable, &value))
+		return value;
+	text = get_variable_value(variable, &length, &copy);
+	if (!text)
+		return 0;
+
+	s = text;
+	while (*s == ' ' || *s == '\t' || *s == '\n')
+		s++;
+	if (!*s) {
+		value = 0;
+		goto out;
+	}
+	negative = (*s == '-');
+	s += (*s == '-' || *s == '+');
+	if (isdigit(*s) && parse_integer(&s, &value, line_number)) {
+		while (*s == ' ' || *s == '\t' || *s == '\n')
+			s++;
+		if (!*s) {
+			value = negative ? (int64_t)(0 - (uint64_t)value) : value;
+			cache_variable_integer(variable, text, length, value);
+			goto out;
+		}
+	}
+
+	/* the value is itself an expression */
+	if (depth >= ARITHMETIC_RECURSION_LIMIT)
+		eprintf("expression recursion level exceeded for \"%s\" at line %zu\n", variable->name, line_number);
+	value = evaluate_text(text, line_number, depth + 1);
+
+out:
+	free(copy.text);
+	return value;
+}
+
+
+int
+is_arithmetic_expression_compiled(const struct interpreter_state *expression)
+{
+	return expression->arithmetic && !expression->arithmetic->source;
+}
+
+
+int64_t
+evaluate_arithmetic_text(const char *text, size_t line_number)
+{
+	return evaluate_text(text, line_number, 0);
+}
+
+
+int64_t
+evaluate_arithmetic_expression(struct interpreter_state *expression, const char *expanded_text, size_t line_number)
+{
+	struct arithmetic_program *program = expression->arithmetic;
+	const char *error;
+
+	if (!program || (program->source && strcmp(program->source, expanded_text))) {
+		/* substitutions usually expand to the same text (say a
+		 * variable holding an operator), so the last compilation
+		 * is kept for the next evaluation */
+		program = compile_arithmetic_text(expanded_text, line_number, &error);
+		if (!program)
+			eprintf("%s in arithmetic expression \"%s\" at line %zu\n", error, expanded_text, line_number);
+		program->source = estrdup(expanded_text);
+		free_arithmetic_program(expression->arithmetic);
+		expression->arithmetic = program;
+	}
+
+	return run_arithmetic_program(program, line_number, 0);
+}
+
+
+void
+free_arithmetic_program(struct arithmetic_program *program)
+{
+	if (program) {
+		free(program->instructions);
+		free(program->source);
+		free(program);
+	}
+}
+
+
+size_t
+measure_arithmetic_program(const struct arithmetic_program *program)
+{
+	if (!program)
+		return 0;
+	return sizeof(*program) + program->ninstructions * sizeof(*program->instructions) +
+	       (program->source ? strlen(program->source) + 1 : 0);
+}
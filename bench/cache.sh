@@ -0,0 +1,51 @@
+#!/bin/sh
+# Times the startup of a script of SIZE MiB, mostly function
+# definitions and assignments, that runs little: without the compiled
+# cache, with -k when the cache does not exist yet (a cold start, which
+# also writes it), and with -k when it does (a warm start)
+# usage: [SIZE=n] [REPEAT=n] cache.sh apsh
+
+set -e
+apsh="$1"
+size="${SIZE:-16}"
+repeat="${REPEAT:-3}"
+dir="$(mktemp -d)"
+trap 'rm -rf -- "$dir"' EXIT
+
+awk -v size=$(( size * 1024 * 1024 )) 'BEGIN {
+	for (i = 0; n < size; i++) {
+		text = sprintf("f%d() {\n\tcase $1 in\n\ta|b) x=\"$2 %d\";;\n\t*) y=$(( $2 + %d ));;\n\tesac\n}\nv%d=\"${w%%.*} %d\"\n", i, i, i, i % 1000, i)
+		printf "%s", text
+		n += length(text)
+	}
+	print "f1 a b"
+}' > "$dir/script"
+
+now () {
+	date +%s%N
+}
+
+best () {
+	mode="$1"
+	shift
+	min=
+	n=0
+	while test $n -lt "$repeat"; do
+		if test "$mode" = cold; then
+			rm -f -- "$dir/.script.apshc"
+		fi
+		start=$(now)
+		"$@" "$dir/script"
+		t=$(( ($(now) - start) / 1000000 ))
+		if test -z "$min" || test $t -lt $min; then
+			min=$t
+		fi
+		n=$(( n + 1 ))
+	done
+	printf '%s' "$min"
+}
+
+printf '%-16s %10s\n' '' 'ms'
+printf '%-16s %10s\n' 'no cache' "$(best none "$apsh")"
+printf '%-16s %10s\n' 'cold cache' "$(best cold "$apsh" -k)"
+printf '%-16s %10s\n' 'warm cache' "$(best warm "$apsh" -k)"
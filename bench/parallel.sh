@@ -0,0 +1,41 @@
+#!/bin/sh
+# Times the parallel front-end on a flat script of SIZE MiB of
+# simple commands, with each number of jobs in JOBS (by default one
+# up to the number of processors): checking the syntax with -n -j,
+# and building the compiled cache, which is also done with -n
+# usage: [SIZE=n] [JOBS="n ..."] parallel.sh apsh
+
+set -e
+apsh="$1"
+size="${SIZE:-32}"
+jobs="${JOBS:-$(seq "$(getconf _NPROCESSORS_ONLN)")}"
+dir="$(mktemp -d)"
+trap 'rm -rf -- "$dir"' EXIT
+
+awk -v size=$(( size * 1024 * 1024 )) 'BEGIN {
+	for (i = 0; n < size; i++) {
+		line = sprintf("x%d=\"value $y %d\"\necho \"$x%d\" a b c > /dev/null\ntest -n \"$x%d\" && : ${x%d#value}\n", i % 100, i, i % 100, i % 100, i % 100)
+		printf "%s", line
+		n += length(line)
+	}
+}' > "$dir/script"
+mkdir "$dir/cache"
+
+now () {
+	date +%s%N
+}
+
+mbps () {
+	printf '%s' $(( size * 1048576 * 1000 / ($2 - $1) ))
+}
+
+printf '%6s %14s %14s\n' jobs '-n MB/s' 'cache MB/s'
+for j in $jobs; do
+	start=$(now)
+	"$apsh" -n -j $j "$dir/script"
+	checked=$(now)
+	"$apsh" -n -j $j -K "$dir/cache" "$dir/script"
+	cached=$(now)
+	rm -f -- "$dir/cache"/*
+	printf '%6s %14s %14s\n' $j "$(mbps $start $checked)" "$(mbps $checked $cached)"
+done
@@ -0,0 +1,74 @@
+#!/bin/sh
+# Compares '<>|', a socket that both stages can read and write,
+# with two unidirectional pipes, one of which is made with mkpipe:
+# the round-trip latency of ROUNDS one-byte requests and replies,
+# and the throughput of BYTES bytes from head(1) into wc(1), for
+# each socket type; perl(1) is used for the two ends of the round trips
+# usage: [ROUNDS=n] [BYTES=n] socketpipe.sh apsh
+
+set -e
+apsh="$1"
+rounds="${ROUNDS:-100000}"
+bytes="${BYTES:-1000000000}"
+dir="$(mktemp -d)"
+trap 'rm -rf -- "$dir"' EXIT
+
+# usage: perl -e "$pingpong" client|server rounds input-fd output-fd
+pingpong='
+	use Time::HiRes qw(time);
+	($role, $rounds, $in, $out) = @ARGV;
+	open(IN, "<&=", $in) or die;
+	open(OUT, ">&=", $out) or die;
+	$start = time;
+	for (1 .. $rounds) {
+		if ($role eq "client") {
+			syswrite(OUT, "x", 1) == 1 or die;
+			sysread(IN, $byte, 1) == 1 or die;
+		} else {
+			sysread(IN, $byte, 1) == 1 or exit;
+			syswrite(OUT, $byte, 1) == 1 or die;
+		}
+	}
+	printf STDERR "%.2f\n", (time - $start) * 1e6 / $rounds if $role eq "client";
+'
+
+cat > "$dir/script" <<SCRIPT
+pingpong='$pingpong'
+APSH_SOCKET_TYPE=stream
+perl -e "\$pingpong" client $rounds 1 1 2>&3 <>| perl -e "\$pingpong" server $rounds 0 0
+APSH_SOCKET_TYPE=seqpacket
+perl -e "\$pingpong" client $rounds 1 1 2>&3 <>| perl -e "\$pingpong" server $rounds 0 0
+mkpipe back
+perl -e "\$pingpong" client $rounds 0 1 <&back 2>&3 | perl -e "\$pingpong" server $rounds 0 1 >&back
+rmpipe back
+
+APSH_SOCKET_TYPE=stream
+date +%s%N >&3
+head -c $bytes /dev/zero <>| wc -c > /dev/null
+date +%s%N >&3
+APSH_SOCKET_TYPE=seqpacket
+head -c $bytes /dev/zero <>| wc -c > /dev/null
+date +%s%N >&3
+head -c $bytes /dev/zero | wc -c > /dev/null
+date +%s%N >&3
+SCRIPT
+"$apsh" "$dir/script" 3> "$dir/output"
+
+{
+	read -r stream
+	read -r seqpacket
+	read -r pipes
+	read -r start
+	read -r stream_end
+	read -r seqpacket_end
+	read -r pipe_end
+} < "$dir/output"
+
+mbps () {
+	printf '%s' $(( bytes * 1000 / ($2 - $1) ))
+}
+
+printf '%-16s %16s %16s\n' '' 'round trip us' 'throughput MB/s'
+printf '%-16s %16s %16s\n' '<>| stream' "$stream" "$(mbps $start $stream_end)"
+printf '%-16s %16s %16s\n' '<>| seqpacket' "$seqpacket" "$(mbps $stream_end $seqpacket_end)"
+printf '%-16s %16s %16s\n' 'two pipes' "$pipes" "$(mbps $seqpacket_end $pipe_end)"
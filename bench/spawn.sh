@@ -0,0 +1,42 @@
+#!/bin/sh
+# Times the launch of external commands at several sizes of the
+# shell: a pipeline of literal words is started with posix_spawn(3),
+# while a stage with an expansion in it is run in a fork of the shell,
+# whose cost grows with the memory it has to copy the page tables of.
+# The shell is inflated with a variable of SIZES MiB (and the buffers
+# that it passes through), and each pipeline is run COUNT times
+# usage: [SIZES="n ..."] [COUNT=n] spawn.sh apsh
+
+set -e
+apsh="$1"
+sizes="${SIZES:-0 64 256}"
+count="${COUNT:-200}"
+dir="$(mktemp -d)"
+trap 'rm -rf -- "$dir"' EXIT
+
+words=$(seq "$count" | tr '\n' ' ')
+
+printf '%10s %10s %12s %12s\n' 'size MiB' 'RSS MiB' 'spawn us' 'fork us'
+for size in $sizes; do
+	cat > "$dir/script" <<SCRIPT
+t=/bin/true
+big=\$(head -c $(( size * 1024 * 1024 )) /dev/zero | tr '\\0' x)
+: "\$big"
+date +%s%N
+for i in $words; do /bin/true | /bin/true; done
+date +%s%N
+for i in $words; do \$t | \$t; done
+date +%s%N
+grep VmRSS /proc/\$\$/status
+SCRIPT
+	"$apsh" "$dir/script" > "$dir/output"
+	{
+		read -r start
+		read -r spawned
+		read -r forked
+		read -r _ rss _
+	} < "$dir/output"
+	# two stages per pipeline
+	printf '%10s %10s %12s %12s\n' "$size" $(( rss / 1024 )) \
+		$(( (spawned - start) / 2000 / count )) $(( (forked - spawned) / 2000 / count ))
+done
@@ -0,0 +1,52 @@
+#!/bin/sh
+# Times field splitting of SIZE MiB of words, with the default IFS,
+# which is searched for 16 bytes at a time where SSE2 is available,
+# and with a custom IFS, which uses the IFS bitmap; the time of the
+# same expansion in double quotes, which is not split, is subtracted
+# usage: [SIZE=n] [REPEAT=n] split.sh apsh
+
+set -e
+apsh="$1"
+size="${SIZE:-64}"
+repeat="${REPEAT:-3}"
+dir="$(mktemp -d)"
+trap 'rm -rf -- "$dir"' EXIT
+
+words () {
+	awk -v size=$(( size * 1024 * 1024 )) -v separators="$1" 'BEGIN {
+		n = split(separators, separator, "")
+		for (i = 0; length_ < size; i++) {
+			word = substr("abcdefghijklmnopqrstuvwxyz", 1, 1 + i % 26) separator[1 + i % n]
+			printf "%s", word
+			length_ += length(word)
+		}
+	}'
+}
+
+words ' 	
+' > "$dir/default"
+words ',;' > "$dir/custom"
+
+time_split () {
+	{
+		printf '%s\n' "text=\$(cat $1)"
+		if test -n "$2"; then
+			printf '%s\n' "IFS='$2'"
+		fi
+		i=0
+		while test $i -lt "$repeat"; do
+			printf '%s\n' 'date +%s%N' ': "$text"' 'date +%s%N' ': $text'
+			i=$(( i + 1 ))
+		done
+		printf '%s\n' 'date +%s%N'
+	} > "$dir/script"
+	"$apsh" "$dir/script" | awk -v size="$size" '
+		NR > 1 && NR % 2 == 0 { quoted = $1 - last }
+		NR > 1 && NR % 2 == 1 && (!best || $1 - last - quoted < best) { best = $1 - last - quoted }
+		{ last = $1 }
+		END { printf "%d", size * 1048576 * 1000 / best }'
+}
+
+printf '%-16s %10s\n' IFS 'MB/s'
+printf '%-16s %10s\n' default "$(time_split "$dir/default")"
+printf '%-16s %10s\n' "',;'" "$(time_split "$dir/custom" ',;')"
@@ -0,0 +1,79 @@
+#!/bin/sh
+# Times the same string-processing loops in apsh, bash and dash:
+# prefix and suffix removal, which all three have, and replacement,
+# substrings and case conversion, which dash does not have.
+# Each loop runs 10^DEPTH iterations, and the best of REPEAT runs
+# is printed in milliseconds; a shell that is not installed is skipped
+# usage: [DEPTH=n] [REPEAT=n] strings.sh apsh
+
+set -e
+apsh="$1"
+depth="${DEPTH:-5}"
+repeat="${REPEAT:-3}"
+dir="$(mktemp -d)"
+trap 'rm -rf -- "$dir"' EXIT
+
+loop () {
+	printf '%s\n' 'path=/usr/local/share/doc/apsh/README.txt'
+	i=0
+	while test $i -lt "$depth"; do
+		printf '%s\n' "for d$i in 0 1 2 3 4 5 6 7 8 9; do"
+		i=$(( i + 1 ))
+	done
+	cat
+	i=0
+	while test $i -lt "$depth"; do
+		printf '%s\n' 'done'
+		i=$(( i + 1 ))
+	done
+}
+
+loop > "$dir/posix" <<'LOOP'
+	base=${path##*/}
+	dir=${path%/*}
+	ext=${base#*.}
+	stem=${base%%.*}
+LOOP
+
+loop > "$dir/extended" <<'LOOP'
+	r=${path//\//:}
+	p=${path/share/lib}
+	s=${path:5:10}
+	u=${path^^}
+	l=${u,,}
+LOOP
+
+now () {
+	date +%s%N
+}
+
+best () {
+	shell="$1"
+	script="$2"
+	min=
+	n=0
+	while test $n -lt "$repeat"; do
+		start=$(now)
+		"$shell" "$script" > /dev/null
+		end=$(now)
+		t=$(( (end - start) / 1000000 ))
+		if test -z "$min" || test $t -lt $min; then
+			min=$t
+		fi
+		n=$(( n + 1 ))
+	done
+	printf '%s' "$min"
+}
+
+printf '%-10s %10s %10s %10s\n' loop apsh bash dash
+for loop in posix extended; do
+	printf '%-10s' $loop
+	for shell in "$apsh" bash dash; do
+		if ! command -v "$shell" > /dev/null || { test $shell = dash && test $loop = extended; }; then
+			printf ' %10s' -
+		else
+			printf ' %10s' "$(best "$shell" "$dir/$loop")"
+		fi
+	done
+	printf '\n'
+done
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Times writes to the variable store that the shell's forks share:
+# COUNT assignments in the shell itself, and then pipelines of
+# each number of stages in WRITERS, every stage assigning COUNT times
+# both a variable of its own and one that all stages write
+# usage: [WRITERS="n ..."] [COUNT=n] variables.sh apsh
+
+set -e
+apsh="$1"
+writers="${WRITERS:-1 2 4 8 16}"
+count="${COUNT:-100000}"
+dir="$(mktemp -d)"
+trap 'rm -rf -- "$dir"' EXIT
+
+words=$(seq "$count" | tr '\n' ' ')
+
+{
+	printf '%s\n' 'date +%s%N'
+	printf '%s\n' "for i in $words; do own=\$i; x=\$i; done"
+	printf '%s\n' 'date +%s%N'
+	for n in $writers; do
+		stage=1
+		while test $stage -le $n; do
+			if test $stage -gt 1; then
+				printf ' | '
+			fi
+			printf '%s' "{ for i in $words; do own$stage=\$i; x=\$i; done; }"
+			stage=$(( stage + 1 ))
+		done
+		printf '\n%s\n' 'date +%s%N'
+	done
+} > "$dir/script"
+"$apsh" "$dir/script" > "$dir/output"
+
+{
+	read -r last
+	read -r now
+	printf '%-16s %10s\n' 'writers' 'ms'
+	printf '%-16s %10s\n' 'in the shell' $(( (now - last) / 1000000 ))
+	for n in $writers; do
+		last=$now
+		read -r now
+		printf '%-16s %10s\n' "$n stages" $(( (now - last) / 1000000 ))
+	done
+} < "$dir/output"
@@ -0,0 +1,1116 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+/* Increase whenever anything in struct argument, struct redirection,
+ * struct command, or struct interpreter_state, or any of the enums
+ * they use, is changed */
+#define COMPILED_CACHE_VERSION 3
+
+#define COMPILED_CACHE_MAGIC "apsh\0cc"
+
+#define ALIGN(N) (((N) + 7) & ~(size_t)7)
+
+
+/* The cache file is a header followed by one record per
+ * interpreted top-level command list, so that the cache
+ * can be written while the script is being parsed and be
+ * executed while it is being read.
+ *
+ * All nodes within a record use offsets relative to the
+ * beginning of the record, so records are relocatable,
+ * 0 is used as NULL as the record's header is at offset 0. */
+
+struct cached_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint64_t byte_order_mark;
+	uint64_t device;
+	uint64_t inode;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t size;
+	uint64_t content_hash;
+	uint64_t body_size;
+	uint64_t body_hash;
+};
+
+struct cached_record {
+	uint64_t size;
+	uint64_t ncommands;
+	uint64_t commands;
+};
+
+struct cached_argument {
+	uint32_t type;
+	uint32_t raw; /* uses .child rather than .command */
+	uint64_t line_number;
+	uint64_t next_part;
+	uint64_t length;
+	uint64_t data;
+};
+
+struct cached_redirection {
+	uint32_t type;
+	uint32_t padding;
+	uint64_t left_hand_side;
+	uint64_t right_hand_side;
+};
+
+struct cached_command {
+	uint32_t terminal;
+	uint32_t have_bang;
+	uint64_t terminal_line_number;
+	uint64_t narguments;
+	uint64_t arguments;
+	uint64_t nredirections;
+	uint64_t redirections;
+	uint64_t redirections_offset;
+};
+
+struct cached_state {
+	uint32_t dealing_with;
+	uint32_t requirement;
+	uint64_t ncommands;
+	uint64_t commands;
+	uint64_t narguments;
+	uint64_t arguments;
+};
+
+struct serialiser {
+	char *buffer;
+	size_t length;
+	size_t size;
+};
+
+struct compiled_cache {
+	int fd;
+	int script_fd;
+	char *path;
+	char *data;
+	size_t size;
+	size_t offset;
+	struct cached_header header;
+	struct serialiser serialiser;
+};
+
+
+PURE_FUNC
+static uint64_t
+hash_bytes(uint64_t hash, const char *data, size_t length)
+{
+	uint64_t word;
+
+	for (; length >= 8; data += 8, length -= 8) {
+		memcpy(&word, data, 8);
+		hash ^= word * UINT64_C(0x9E3779B97F4A7C15);
+		hash = ((hash << 31) | (hash >> 33)) * UINT64_C(0xC2B2AE3D27D4EB4F);
+	}
+	for (; length; data++, length--)
+		hash = (hash ^ (uint8_t)*data) * UINT64_C(0x100000001B3);
+
+	return hash ^ (hash >> 29);
+}
+
+
+static int
+hash_file(int fd, size_t size, uint64_t *hashp)
+{
+	char *data;
+
+	if (!size) {
+		*hashp = hash_bytes(0, NULL, 0);
+		return 0;
+	}
+	data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		return -1;
+	*hashp = hash_bytes(0, data, size);
+	munmap(data, size);
+	return 0;
+}
+
+
+static char *
+get_cache_path(const struct stat *st, const char *script_path, const char *cache_dir)
+{
+	const char *base;
+	char *path;
+	size_t dir_len;
+
+	if (cache_dir) {
+		path = emalloc(strlen(cache_dir) + 2 * 3 * sizeof(uintmax_t) + sizeof("/-.apshc"));
+		sprintf(path, "%s/%ju-%ju.apshc", cache_dir, (uintmax_t)st->st_dev, (uintmax_t)st->st_ino);
+	} else {
+		base = strrchr(script_path, '/');
+		base = base ? &base[1] : script_path;
+		dir_len = (size_t)(base - script_path);
+		path = emalloc(strlen(script_path) + sizeof("..apshc"));
+		memcpy(path, script_path, dir_len);
+		sprintf(&path[dir_len], ".%s.apshc", base);
+	}
+
+	return path;
+}
+
+
+static void
+set_key(struct cached_header *header, const struct stat *st)
+{
+	memcpy(header->magic, COMPILED_CACHE_MAGIC, sizeof(header->magic));
+	header->version = COMPILED_CACHE_VERSION;
+	header->flags = (uint32_t)posix_mode;
+	header->byte_order_mark = UINT64_C(0x0102030405060708);
+	header->device = (uint64_t)st->st_dev;
+	header->inode = (uint64_t)st->st_ino;
+	header->mtime_sec = (int64_t)st->st_mtim.tv_sec;
+	header->mtime_nsec = (int64_t)st->st_mtim.tv_nsec;
+	header->size = (uint64_t)st->st_size;
+}
+
+
+static uint64_t
+put(struct serialiser *s, const void *data, size_t size)
+{
+	size_t offset = s->length;
+
+	if (s->length + ALIGN(size) > s->size) {
+		s->size = s->size * 2 + ALIGN(size);
+		s->buffer = erealloc(s->buffer, s->size);
+	}
+	memcpy(&s->buffer[offset], data, size);
+	memset(&s->buffer[offset + size], 0, ALIGN(size) - size);
+	s->length += ALIGN(size);
+
+	return (uint64_t)offset;
+}
+
+
+static uint64_t serialise_commands(struct serialiser *s, struct command **commands, size_t ncommands, int raw);
+static uint64_t serialise_state(struct serialiser *s, struct interpreter_state *state);
+
+
+static uint64_t
+serialise_argument(struct serialiser *s, struct argument *argument, int raw)
+{
+	struct cached_argument node;
+
+	if (!argument)
+		return 0;
+
+	memset(&node, 0, sizeof(node));
+	node.type = (uint32_t)argument->type;
+	node.line_number = (uint64_t)argument->line_number;
+	node.next_part = serialise_argument(s, argument->next_part, raw);
+
+	switch (argument->type) {
+	case QUOTED:
+	case UNQUOTED:
+	case VARIABLE:
+	case OPERATOR:
+		node.length = (uint64_t)argument->length;
+		node.data = put(s, argument->text, argument->length + 1);
+		break;
+
+	case QUOTE_EXPRESSION:
+	case BACKQUOTE_EXPRESSION:
+	case ARITHMETIC_EXPRESSION:
+	case VARIABLE_SUBSTITUTION:
+	case SUBSHELL_SUBSTITUTION:
+	case PROCESS_SUBSTITUTION_INPUT:
+	case PROCESS_SUBSTITUTION_OUTPUT:
+	case PROCESS_SUBSTITUTION_INPUT_OUTPUT:
+	case SUBSHELL:
+	case ARITHMETIC_SUBSHELL:
+		if (raw) {
+			node.raw = 1;
+			node.length = (uint64_t)argument->child->ncommands;
+			node.data = serialise_commands(s, argument->child->commands, argument->child->ncommands, 1);
+			break;
+		}
+		/* fall through */
+	case COMMAND:
+		node.data = serialise_state(s, argument->command);
+		break;
+
+	case REDIRECTION:
+	case FUNCTION_MARK:
+		break;
+
+	default:
+		abort();
+	}
+
+	return put(s, &node, sizeof(node));
+}
+
+
+static uint64_t
+serialise_arguments(struct serialiser *s, struct argument **arguments, size_t narguments, int raw)
+{
+	uint64_t *offsets;
+	uint64_t ret;
+	size_t i;
+
+	if (!narguments)
+		return 0;
+
+	offsets = emalloc(narguments * sizeof(*offsets));
+	for (i = 0; i < narguments; i++)
+		offsets[i] = serialise_argument(s, arguments[i], raw);
+	ret = put(s, offsets, narguments * sizeof(*offsets));
+	free(offsets);
+	return ret;
+}
+
+
+static uint64_t
+serialise_state(struct serialiser *s, struct interpreter_state *state)
+{
+	struct cached_state node;
+	int raw = state->dealing_with == DEFERRED_FUNCTION_BODY;
+
+	memset(&node, 0, sizeof(node));
+	node.dealing_with = (uint32_t)state->dealing_with;
+	node.requirement = (uint32_t)state->requirement;
+	node.ncommands = (uint64_t)state->ncommands;
+	node.commands = serialise_commands(s, state->commands, state->ncommands, raw);
+	node.narguments = (uint64_t)state->narguments;
+	node.arguments = serialise_arguments(s, state->arguments, state->narguments, raw);
+
+	return put(s, &node, sizeof(node));
+}
+
+
+static uint64_t
+serialise_redirection(struct serialiser *s, struct redirection *redirection, int raw)
+{
+	struct cached_redirection node;
+
+	if (!redirection)
+		return 0;
+
+	memset(&node, 0, sizeof(node));
+	node.type = (uint32_t)redirection->type;
+	node.left_hand_side = serialise_argument(s, redirection->left_hand_side, raw);
+	node.right_hand_side = serialise_argument(s, redirection->right_hand_side, raw);
+
+	return put(s, &node, sizeof(node));
+}
+
+
+static uint64_t
+serialise_command(struct serialiser *s, struct command *command, int raw)
+{
+	struct cached_command node;
+	uint64_t *offsets;
+	size_t i;
+
+	if (!command)
+		return 0;
+
+	memset(&node, 0, sizeof(node));
+	node.terminal = (uint32_t)command->terminal;
+	node.have_bang = (uint32_t)command->have_bang;
+	node.terminal_line_number = (uint64_t)command->terminal_line_number;
+	node.narguments = (uint64_t)command->narguments;
+	node.arguments = serialise_arguments(s, command->arguments, command->narguments, raw);
+	node.nredirections = (uint64_t)command->nredirections;
+	node.redirections_offset = (uint64_t)command->redirections_offset;
+	if (command->nredirections) {
+		offsets = emalloc(command->nredirections * sizeof(*offsets));
+		for (i = 0; i < command->nredirections; i++)
+			offsets[i] = serialise_redirection(s, command->redirections[i], raw);
+		node.redirections = put(s, offsets, command->nredirections * sizeof(*offsets));
+		free(offsets);
+	}
+
+	return put(s, &node, sizeof(node));
+}
+
+
+static uint64_t
+serialise_commands(struct serialiser *s, struct command **commands, size_t ncommands, int raw)
+{
+	uint64_t *offsets;
+	uint64_t ret;
+	size_t i;
+
+	if (!ncommands)
+		return 0;
+
+	offsets = emalloc(ncommands * sizeof(*offsets));
+	for (i = 0; i < ncommands; i++)
+		offsets[i] = serialise_command(s, commands[i], raw);
+	ret = put(s, offsets, ncommands * sizeof(*offsets));
+	free(offsets);
+	return ret;
+}
+
+
+struct deserialiser {
+	const struct compiled_cache *cache;
+	const char *record;
+	uint64_t size;
+};
+
+
+static const void *
+get_node(const struct deserialiser *d, uint64_t offset, uint64_t size)
+{
+	if (!offset)
+		return NULL;
+	if (offset > d->size || size > d->size - offset || (offset & 7))
+		eprintf("%s: compiled cache is corrupt\n", d->cache->path);
+	return &d->record[offset];
+}
+
+
+static const uint64_t *
+get_offsets(const struct deserialiser *d, uint64_t offset, uint64_t count)
+{
+	if (count > d->size / sizeof(uint64_t))
+		eprintf("%s: compiled cache is corrupt\n", d->cache->path);
+	return get_node(d, offset, count * sizeof(uint64_t));
+}
+
+
+static struct command **deserialise_commands(const struct deserialiser *d, uint64_t offset, uint64_t ncommands);
+static struct interpreter_state *deserialise_state(const struct deserialiser *d, uint64_t offset);
+
+
+static struct argument *
+deserialise_argument(const struct deserialiser *d, uint64_t offset)
+{
+	const struct cached_argument *node;
+	struct argument *argument;
+	struct parser_state *child;
+
+	node = get_node(d, offset, sizeof(*node));
+	if (!node)
+		return NULL;
+
+	argument = ecalloc(1, sizeof(*argument));
+	argument->type = (enum argument_type)node->type;
+	argument->line_number = (size_t)node->line_number;
+	argument->next_part = deserialise_argument(d, node->next_part);
+
+	switch (argument->type) {
+	case QUOTED:
+	case UNQUOTED:
+	case VARIABLE:
+	case OPERATOR:
+		if (node->length == UINT64_MAX)
+			eprintf("%s: compiled cache is corrupt\n", d->cache->path);
+		argument->length = (size_t)node->length;
+		argument->text = emalloc(argument->length + 1);
+		memcpy(argument->text, get_node(d, node->data, node->length + 1), argument->length);
+		argument->text[argument->length] = '\0';
+		if (argument->type == VARIABLE)
+			argument->variable = get_variable_slot(argument->text, argument->length);
+		break;
+
+	case QUOTE_EXPRESSION:
+	case BACKQUOTE_EXPRESSION:
+	case ARITHMETIC_EXPRESSION:
+	case VARIABLE_SUBSTITUTION:
+	case SUBSHELL_SUBSTITUTION:
+	case PROCESS_SUBSTITUTION_INPUT:
+	case PROCESS_SUBSTITUTION_OUTPUT:
+	case PROCESS_SUBSTITUTION_INPUT_OUTPUT:
+	case SUBSHELL:
+	case ARITHMETIC_SUBSHELL:
+		if (node->raw) {
+			child = ecalloc(1, sizeof(*child));
+			child->ncommands = (size_t)node->length;
+			child->commands = deserialise_commands(d, node->data, node->length);
+			argument->child = child;
+			break;
+		}
+		/* fall through */
+	case COMMAND:
+		argument->command = deserialise_state(d, node->data);
+		/* compiled expressions are not stored, but recompiled from the text */
+		if (argument->type == ARITHMETIC_EXPRESSION || argument->type == ARITHMETIC_SUBSHELL)
+			compile_arithmetic_expression(argument);
+		break;
+
+	case REDIRECTION:
+	case FUNCTION_MARK:
+		break;
+
+	default:
+		eprintf("%s: compiled cache is corrupt\n", d->cache->path);
+	}
+
+	return argument;
+}
+
+
+static struct argument **
+deserialise_arguments(const struct deserialiser *d, uint64_t offset, uint64_t narguments)
+{
+	const uint64_t *offsets;
+	struct argument **arguments;
+	size_t i;
+
+	if (!narguments)
+		return NULL;
+
+	offsets = get_offsets(d, offset, narguments);
+	arguments = emalloc((size_t)narguments * sizeof(*arguments));
+	for (i = 0; i < narguments; i++)
+		arguments[i] = deserialise_argument(d, offsets[i]);
+	return arguments;
+}
+
+
+static struct interpreter_state *
+deserialise_state(const struct deserialiser *d, uint64_t offset)
+{
+	const struct cached_state *node;
+	struct interpreter_state *state;
+	size_t i;
+
+	node = get_node(d, offset, sizeof(*node));
+	if (!node)
+		eprintf("%s: compiled cache is corrupt\n", d->cache->path);
+
+	state = ecalloc(1, sizeof(*state));
+	state->dealing_with = (enum nesting_type)node->dealing_with;
+	state->requirement = (enum interpreter_requirement)node->requirement;
+	state->ncommands = (size_t)node->ncommands;
+	state->commands = deserialise_commands(d, node->commands, node->ncommands);
+	state->narguments = (size_t)node->narguments;
+	state->arguments = deserialise_arguments(d, node->arguments, node->narguments);
+	if (state->dealing_with != DEFERRED_FUNCTION_BODY)
+		for (i = 0; i < state->ncommands; i++)
+			prebuild_command_argv(state->commands[i]);
+	if (state->dealing_with == CASE_STATEMENT)
+		compile_case_statement(state);
+
+	return state;
+}
+
+
+static struct redirection *
+deserialise_redirection(const struct deserialiser *d, uint64_t offset)
+{
+	const struct cached_redirection *node;
+	struct redirection *redirection;
+
+	node = get_node(d, offset, sizeof(*node));
+	if (!node)
+		return NULL;
+
+	redirection = ecalloc(1, sizeof(*redirection));
+	redirection->type = (enum redirection_type)node->type;
+	redirection->left_hand_side = deserialise_argument(d, node->left_hand_side);
+	redirection->right_hand_side = deserialise_argument(d, node->right_hand_side);
+
+	return redirection;
+}
+
+
+static struct command *
+deserialise_command(const struct deserialiser *d, uint64_t offset)
+{
+	const struct cached_command *node;
+	const uint64_t *offsets;
+	struct command *command;
+	size_t i;
+
+	node = get_node(d, offset, sizeof(*node));
+	if (!node)
+		return NULL;
+
+	command = ecalloc(1, sizeof(*command));
+	command->terminal = (enum command_terminal)node->terminal;
+	command->have_bang = (char)node->have_bang;
+	command->terminal_line_number = (size_t)node->terminal_line_number;
+	command->narguments = (size_t)node->narguments;
+	command->arguments = deserialise_arguments(d, node->arguments, node->narguments);
+	command->nredirections = (size_t)node->nredirections;
+	command->redirections_offset = (size_t)node->redirections_offset;
+	if (node->nredirections) {
+		offsets = get_offsets(d, node->redirections, node->nredirections);
+		command->redirections = emalloc(command->nredirections * sizeof(*command->redirections));
+		for (i = 0; i < command->nredirections; i++)
+			command->redirections[i] = deserialise_redirection(d, offsets[i]);
+	}
+
+	return command;
+}
+
+
+static struct command **
+deserialise_commands(const struct deserialiser *d, uint64_t offset, uint64_t ncommands)
+{
+	const uint64_t *offsets;
+	struct command **commands;
+	size_t i;
+
+	if (!ncommands)
+		return NULL;
+
+	offsets = get_offsets(d, offset, ncommands);
+	commands = emalloc((size_t)ncommands * sizeof(*commands));
+	for (i = 0; i < ncommands; i++)
+		commands[i] = deserialise_command(d, offsets[i]);
+	return commands;
+}
+
+
+static int
+check_body(struct compiled_cache *cache)
+{
+	const struct cached_record *record;
+	uint64_t hash = 0;
+	size_t offset = sizeof(cache->header);
+
+	while (offset < cache->size) {
+		record = (const void *)&cache->data[offset];
+		if (cache->size - offset < sizeof(*record) ||
+		    record->size < sizeof(*record) ||
+		    record->size > cache->size - offset ||
+		    (record->size & 7))
+			return 0;
+		hash = hash_bytes(hash, &cache->data[offset], (size_t)record->size);
+		offset += (size_t)record->size;
+	}
+
+	return hash == cache->header.body_hash;
+}
+
+
+struct compiled_cache *
+load_compiled_cache(int script_fd, const char *script_path, const char *cache_dir, int verify)
+{
+	struct compiled_cache *cache;
+	struct cached_header key;
+	struct stat st, cst;
+	uint64_t content_hash;
+	int fd;
+
+	if (fstat(script_fd, &st) || !S_ISREG(st.st_mode))
+		return NULL;
+
+	cache = ecalloc(1, sizeof(*cache));
+	cache->fd = -1;
+	cache->script_fd = -1;
+	cache->path = get_cache_path(&st, script_path, cache_dir);
+
+	fd = open(cache->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		goto invalid;
+	if (fstat(fd, &cst) || (size_t)cst.st_size < sizeof(cache->header) || (uintmax_t)cst.st_size > SIZE_MAX)
+		goto invalid;
+	/* the key can be learnt by anyone who can stat(2) the script,
+	 * so a cache that someone else could have written is not used */
+	if (!S_ISREG(cst.st_mode) || cst.st_uid != geteuid() || (cst.st_mode & (S_IWGRP | S_IWOTH)))
+		goto invalid;
+	cache->size = (size_t)cst.st_size;
+	cache->data = mmap(NULL, cache->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	fd = -1;
+	if (cache->data == MAP_FAILED) {
+		cache->data = NULL;
+		goto invalid;
+	}
+
+	memcpy(&cache->header, cache->data, sizeof(cache->header));
+	memset(&key, 0, sizeof(key));
+	set_key(&key, &st);
+	key.content_hash = cache->header.content_hash;
+	key.body_size = cache->header.body_size;
+	key.body_hash = cache->header.body_hash;
+	if (memcmp(&key, &cache->header, sizeof(key)))
+		goto invalid;
+	if (cache->header.body_size != cache->size - sizeof(cache->header) || !check_body(cache))
+		goto invalid;
+	if (verify) {
+		if (hash_file(script_fd, (size_t)st.st_size, &content_hash) || content_hash != cache->header.content_hash)
+			goto invalid;
+	}
+
+	cache->offset = sizeof(cache->header);
+	return cache;
+
+invalid:
+	if (fd >= 0)
+		close(fd);
+	close_compiled_cache(cache, 0);
+	return NULL;
+}
+
+
+int
+read_compiled_commands(struct compiled_cache *cache, struct interpreter_state *state)
+{
+	const struct cached_record *record;
+	struct deserialiser d;
+	struct command **commands;
+	size_t i;
+
+	if (cache->offset >= cache->size)
+		return 0;
+
+	/* check_body() has already validated the record sizes */
+	record = (const void *)&cache->data[cache->offset];
+	d.cache = cache;
+	d.record = &cache->data[cache->offset];
+	d.size = record->size;
+	cache->offset += (size_t)record->size;
+
+	commands = deserialise_commands(&d, record->commands, record->ncommands);
+	state->commands = erealloc(state->commands, (state->ncommands + (size_t)record->ncommands) * sizeof(*state->commands));
+	for (i = 0; i < (size_t)record->ncommands; i++) {
+		prebuild_command_argv(commands[i]);
+		state->commands[state->ncommands++] = commands[i];
+	}
+	free(commands);
+
+	return 1;
+}
+
+
+struct compiled_cache *
+create_compiled_cache(int script_fd, const char *script_path, const char *cache_dir)
+{
+	struct compiled_cache *cache;
+	struct stat st;
+	char *dir, *p;
+
+	if (fstat(script_fd, &st) || !S_ISREG(st.st_mode))
+		return NULL;
+
+	cache = ecalloc(1, sizeof(*cache));
+	cache->fd = -1;
+	cache->script_fd = script_fd;
+	cache->path = get_cache_path(&st, script_path, cache_dir);
+	set_key(&cache->header, &st);
+	if (hash_file(script_fd, (size_t)st.st_size, &cache->header.content_hash)) {
+		weprintf("%s:", script_path);
+		goto fail;
+	}
+
+	/* the file is given a name only when completed, so
+	 * that no partial cache is left behind on failure */
+	dir = estrdup(cache->path);
+	p = strrchr(dir, '/');
+	if (!p)
+		strcpy(dir, ".");
+	else if (p == dir)
+		dir[1] = '\0';
+	else
+		*p = '\0';
+	/* the parsed script is as readable as the script, but
+	 * only its owner, the one who creates it, may write it */
+	cache->fd = open(dir, O_TMPFILE | O_WRONLY | O_CLOEXEC, (st.st_mode & (S_IRGRP | S_IROTH)) | S_IRUSR | S_IWUSR);
+	free(dir);
+	if (cache->fd < 0) {
+		weprintf("cannot create compiled cache %s:", cache->path);
+		goto fail;
+	}
+
+	if (write(cache->fd, &cache->header, sizeof(cache->header)) != (ssize_t)sizeof(cache->header)) {
+		weprintf("write %s:", cache->path);
+		goto fail;
+	}
+
+	return cache;
+
+fail:
+	close_compiled_cache(cache, 0);
+	return NULL;
+}
+
+
+void
+write_compiled_commands(struct compiled_cache *cache, struct command **commands, size_t ncommands)
+{
+	struct serialiser *s = &cache->serialiser;
+	struct cached_record record;
+	size_t off;
+	ssize_t r;
+
+	if (cache->fd < 0)
+		return;
+
+	memset(&record, 0, sizeof(record));
+	s->length = 0;
+	put(s, &record, sizeof(record));
+	record.ncommands = (uint64_t)ncommands;
+	record.commands = serialise_commands(s, commands, ncommands, 0);
+	record.size = (uint64_t)s->length;
+	memcpy(s->buffer, &record, sizeof(record));
+
+	cache->header.body_hash = hash_bytes(cache->header.body_hash, s->buffer, s->length);
+	cache->header.body_size += (uint64_t)s->length;
+
+	for (off = 0; off < s->length; off += (size_t)r) {
+		r = write(cache->fd, &s->buffer[off], s->length - off);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR) {
+				r = 0;
+				continue;
+			}
+			weprintf("write %s:", cache->path);
+			close(cache->fd);
+			cache->fd = -1;
+			return;
+		}
+	}
+}
+
+
+struct compiled_cache *
+create_compiled_cache_fragment(int fd)
+{
+	struct compiled_cache *cache;
+
+	/* only records are written to a fragment, it has no header
+	 * and is never committed, see append_compiled_cache_fragment() */
+	cache = ecalloc(1, sizeof(*cache));
+	cache->fd = fd;
+	cache->script_fd = -1;
+	cache->path = estrdup("<fragment>");
+	return cache;
+}
+
+
+void
+append_compiled_cache_fragment(struct compiled_cache *cache, int fragment_fd)
+{
+	const struct cached_record *record;
+	struct stat st;
+	char *data;
+	size_t size, offset, off;
+	ssize_t r;
+
+	if (cache->fd < 0)
+		return;
+
+	if (fstat(fragment_fd, &st))
+		eprintf("fstat <fragment>:");
+	size = (size_t)st.st_size;
+	if (!size)
+		return;
+	data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fragment_fd, 0);
+	if (data == MAP_FAILED)
+		eprintf("mmap <fragment>:");
+
+	/* the body hash is chained record by record, as in check_body() */
+	for (offset = 0; offset < size; offset += (size_t)record->size) {
+		record = (const void *)&data[offset];
+		cache->header.body_hash = hash_bytes(cache->header.body_hash, &data[offset], (size_t)record->size);
+	}
+	cache->header.body_size += (uint64_t)size;
+
+	for (off = 0; off < size; off += (size_t)r) {
+		r = write(cache->fd, &data[off], size - off);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR) {
+				r = 0;
+				continue;
+			}
+			weprintf("write %s:", cache->path);
+			close(cache->fd);
+			cache->fd = -1;
+			break;
+		}
+	}
+
+	munmap(data, size);
+}
+
+
+void
+close_compiled_cache(struct compiled_cache *cache, int commit)
+{
+	char fd_path[sizeof("/proc/self/fd/") + 3 * sizeof(int)];
+	char *temp_path;
+	struct cached_header key;
+	struct stat st;
+
+	if (!cache)
+		return;
+
+	if (commit && cache->fd >= 0 && cache->script_fd >= 0) {
+		/* discard if the script was modified while it was parsed */
+		memset(&key, 0, sizeof(key));
+		if (fstat(cache->script_fd, &st))
+			goto out;
+		set_key(&key, &st);
+		if (key.device != cache->header.device || key.inode != cache->header.inode ||
+		    key.mtime_sec != cache->header.mtime_sec || key.mtime_nsec != cache->header.mtime_nsec ||
+		    key.size != cache->header.size)
+			goto out;
+
+		if (pwrite(cache->fd, &cache->header, sizeof(cache->header), 0) != (ssize_t)sizeof(cache->header)) {
+			weprintf("write %s:", cache->path);
+			goto out;
+		}
+
+		sprintf(fd_path, "/proc/self/fd/%i", cache->fd);
+		temp_path = emalloc(strlen(cache->path) + sizeof(".new"));
+		stpcpy(stpcpy(temp_path, cache->path), ".new");
+		unlink(temp_path);
+		if (linkat(AT_FDCWD, fd_path, AT_FDCWD, temp_path, AT_SYMLINK_FOLLOW))
+			weprintf("linkat %s %s:", fd_path, temp_path);
+		else if (rename(temp_path, cache->path))
+			weprintf("rename %s %s:", temp_path, cache->path);
+		free(temp_path);
+	}
+
+out:
+	if (cache->fd >= 0)
+		close(cache->fd);
+	if (cache->data)
+		munmap(cache->data, cache->size);
+	free(cache->serialiser.buffer);
+	free(cache->path);
+	free(cache);
+}
+
+
+struct sourced_script {
+	dev_t device;
+	ino_t inode;
+	struct timespec mtime;
+	off_t size;
+	struct interpreter_state *tree;
+	size_t alias_generation; /* 0 unless the tree depends on aliases */
+	size_t memory;
+	size_t users;
+	char evicted;
+	struct sourced_script *newer;
+	struct sourced_script *older;
+};
+
+static struct sourced_script *newest_sourced_script;
+static struct sourced_script *oldest_sourced_script;
+static struct source_cache_statistics source_cache_statistics;
+
+
+static size_t measure_commands(struct command **commands, size_t ncommands, int raw);
+static size_t measure_state(struct interpreter_state *state);
+
+
+static size_t
+measure_argument(struct argument *argument, int raw)
+{
+	size_t size = 0;
+
+	for (; argument; argument = argument->next_part) {
+		size += sizeof(*argument);
+		switch (argument->type) {
+		case QUOTED:
+		case UNQUOTED:
+		case VARIABLE:
+		case OPERATOR:
+			size += argument->length + 1;
+			break;
+
+		case QUOTE_EXPRESSION:
+		case BACKQUOTE_EXPRESSION:
+		case ARITHMETIC_EXPRESSION:
+		case VARIABLE_SUBSTITUTION:
+		case SUBSHELL_SUBSTITUTION:
+		case PROCESS_SUBSTITUTION_INPUT:
+		case PROCESS_SUBSTITUTION_OUTPUT:
+		case PROCESS_SUBSTITUTION_INPUT_OUTPUT:
+		case SUBSHELL:
+		case ARITHMETIC_SUBSHELL:
+			if (raw) {
+				size += sizeof(*argument->child);
+				size += measure_commands(argument->child->commands, argument->child->ncommands, 1);
+				break;
+			}
+			/* fall through */
+		case COMMAND:
+			size += measure_state(argument->command);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	return size;
+}
+
+
+static size_t
+measure_commands(struct command **commands, size_t ncommands, int raw)
+{
+	size_t size = ncommands * sizeof(*commands);
+	size_t i, j;
+
+	for (i = 0; i < ncommands; i++) {
+		size += sizeof(*commands[i]);
+		size += commands[i]->narguments * sizeof(*commands[i]->arguments);
+		size += commands[i]->nredirections * sizeof(*commands[i]->redirections);
+		size += measure_command_argv(commands[i]);
+		for (j = 0; j < commands[i]->narguments; j++)
+			size += measure_argument(commands[i]->arguments[j], raw);
+		for (j = 0; j < commands[i]->nredirections; j++) {
+			if (commands[i]->redirections[j]) {
+				size += sizeof(*commands[i]->redirections[j]);
+				size += measure_argument(commands[i]->redirections[j]->left_hand_side, raw);
+				size += measure_argument(commands[i]->redirections[j]->right_hand_side, raw);
+			}
+		}
+	}
+
+	return size;
+}
+
+
+static size_t
+measure_state(struct interpreter_state *state)
+{
+	int raw = state->dealing_with == DEFERRED_FUNCTION_BODY;
+	size_t size = sizeof(*state);
+	size_t i;
+
+	size += measure_commands(state->commands, state->ncommands, raw);
+	size += measure_arithmetic_program(state->arithmetic);
+	size += measure_pattern(state->pattern);
+	size += measure_case_table(state->case_table);
+	size += state->narguments * sizeof(*state->arguments);
+	for (i = 0; i < state->narguments; i++)
+		size += measure_argument(state->arguments[i], raw);
+
+	return size;
+}
+
+
+static void
+unlink_sourced_script(struct sourced_script *script)
+{
+	*(script->newer ? &script->newer->older : &newest_sourced_script) = script->older;
+	*(script->older ? &script->older->newer : &oldest_sourced_script) = script->newer;
+	script->newer = script->older = NULL;
+	script->evicted = 1;
+	source_cache_statistics.entries -= 1;
+	source_cache_statistics.memory -= script->memory;
+	if (!script->users) {
+		destroy_interpreter_state(script->tree);
+		free(script);
+	}
+}
+
+
+static void
+evict_sourced_scripts(void)
+{
+	struct sourced_script *script, *newer;
+
+	for (script = oldest_sourced_script; script; script = newer) {
+		if (source_cache_statistics.memory <= SOURCE_CACHE_MEMORY_BUDGET)
+			break;
+		newer = script->newer;
+		if (!script->users) {
+			unlink_sourced_script(script);
+			source_cache_statistics.evictions += 1;
+		}
+	}
+}
+
+
+struct sourced_script *
+acquire_sourced_script(int fd, const char *path)
+{
+	struct sourced_script *script;
+	struct parser_context ctx;
+	struct stat st;
+
+	if (fstat(fd, &st))
+		eprintf("fstat %s:", path);
+
+	for (script = newest_sourced_script; script; script = script->older)
+		if (script->device == st.st_dev && script->inode == st.st_ino)
+			break;
+
+	if (script) {
+		if (script->mtime.tv_sec == st.st_mtim.tv_sec &&
+		    script->mtime.tv_nsec == st.st_mtim.tv_nsec &&
+		    script->size == st.st_size &&
+		    (!script->alias_generation || script->alias_generation == get_alias_generation())) {
+			source_cache_statistics.hits += 1;
+			if (script != newest_sourced_script) {
+				script->newer->older = script->older;
+				*(script->older ? &script->older->newer : &oldest_sourced_script) = script->newer;
+				script->newer = NULL;
+				script->older = newest_sourced_script;
+				newest_sourced_script->newer = script;
+				newest_sourced_script = script;
+			}
+			script->users += 1;
+			return script;
+		}
+		unlink_sourced_script(script);
+	}
+
+	source_cache_statistics.misses += 1;
+
+	initialise_parser_context(&ctx, 1, 1);
+	parse_file(&ctx, fd, path);
+	free(ctx.parser_state->commands);
+	free(ctx.parser_state->arguments);
+	free(ctx.parser_state->redirections);
+	free(ctx.parser_state);
+	free(ctx.here_document_stack);
+	free(ctx.mode_stack);
+
+	script = ecalloc(1, sizeof(*script));
+	script->device = st.st_dev;
+	script->inode = st.st_ino;
+	script->mtime = st.st_mtim;
+	script->size = st.st_size;
+	script->tree = ctx.interpreter_state;
+	script->alias_generation = ctx.aliases_substituted ? get_alias_generation() : 0;
+	script->memory = sizeof(*script) + measure_state(script->tree);
+	script->users = 1;
+
+	if (S_ISREG(st.st_mode) && script->memory <= SOURCE_CACHE_MEMORY_BUDGET) {
+		script->older = newest_sourced_script;
+		*(newest_sourced_script ? &newest_sourced_script->newer : &oldest_sourced_script) = script;
+		newest_sourced_script = script;
+		source_cache_statistics.entries += 1;
+		source_cache_statistics.memory += script->memory;
+		evict_sourced_scripts();
+	} else {
+		script->evicted = 1;
+	}
+
+	return script;
+}
+
+
+void
+release_sourced_script(struct sourced_script *script)
+{
+	script->users -= 1;
+	if (script->evicted && !script->users) {
+		destroy_interpreter_state(script->tree);
+		free(script);
+	} else {
+		evict_sourced_scripts();
+	}
+}
+
+
+struct interpreter_state *
+get_sourced_script_tree(struct sourced_script *script)
+{
+	return script->tree;
+}
+
+
+void
+get_source_cache_statistics(struct source_cache_statistics *statistics)
+{
+	*statistics = source_cache_statistics;
+}
@@ -0,0 +1,301 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+
+/* Patterns are tried in order, so consecutive literal patterns,
+ * which cannot have side-effects, are gathered into one hash table,
+ * and only patterns with globbing or substitutions are tried one by
+ * one; a match in a hash table is always the first match among the
+ * patterns in it, as only the first occurrence of a literal is kept */
+
+enum case_matcher_type {
+	LITERAL_SET,
+	STATIC_PATTERN, /* compiled when the statement is compiled */
+	DYNAMIC_PATTERN /* compiled when evaluated, cached until the expansion changes */
+};
+
+struct case_literal {
+	char *text;
+	size_t length;
+	size_t hash;
+	struct interpreter_state *clause; /* NULL if the slot is empty */
+};
+
+struct case_matcher {
+	enum case_matcher_type type;
+	struct interpreter_state *clause; /* for STATIC_PATTERN and DYNAMIC_PATTERN */
+	struct pattern *pattern; /* for STATIC_PATTERN and DYNAMIC_PATTERN */
+	struct argument *argument; /* for DYNAMIC_PATTERN */
+	struct case_literal *literals; /* for LITERAL_SET, open addressing */
+	size_t literals_size; /* power of two */
+	size_t nliterals;
+	size_t min_length;
+	size_t max_length;
+};
+
+struct case_table {
+	struct case_matcher *matchers;
+	size_t nmatchers;
+};
+
+
+PURE_FUNC
+static size_t
+hash_literal(const char *text, size_t length)
+{
+	size_t hash = 5381;
+	while (length--)
+		hash = (hash << 5) + hash + (unsigned char)*text++;
+	return hash;
+}
+
+
+static struct case_literal *
+find_literal_slot(struct case_matcher *matcher, const char *text, size_t length, size_t hash)
+{
+	size_t mask = matcher->literals_size - 1, i;
+	struct case_literal *slot;
+
+	for (i = hash & mask;; i = (i + 1) & mask) {
+		slot = &matcher->literals[i];
+		if (!slot->clause)
+			return slot;
+		if (slot->hash == hash && slot->length == length && !memcmp(slot->text, text, length))
+			return slot;
+	}
+}
+
+
+static void
+grow_literal_set(struct case_matcher *matcher)
+{
+	struct case_literal *old_literals = matcher->literals, *slot;
+	size_t old_size = matcher->literals_size, i;
+
+	matcher->literals_size = old_size ? old_size * 2 : 8;
+	matcher->literals = ecalloc(matcher->literals_size, sizeof(*matcher->literals));
+
+	for (i = 0; i < old_size; i++) {
+		if (old_literals[i].clause) {
+			slot = find_literal_slot(matcher, old_literals[i].text, old_literals[i].length, old_literals[i].hash);
+			*slot = old_literals[i];
+		}
+	}
+
+	free(old_literals);
+}
+
+
+static void
+add_literal(struct case_matcher *matcher, const char *text, size_t length, struct interpreter_state *clause)
+{
+	struct case_literal *slot;
+	size_t hash = hash_literal(text, length);
+
+	if (matcher->nliterals >= matcher->literals_size / 2)
+		grow_literal_set(matcher);
+
+	slot = find_literal_slot(matcher, text, length, hash);
+	if (slot->clause)
+		return; /* the earlier arm takes precedence */
+
+	slot->text = emalloc(length + 1);
+	memcpy(slot->text, text, length);
+	slot->text[length] = '\0';
+	slot->length = length;
+	slot->hash = hash;
+	slot->clause = clause;
+
+	if (!matcher->nliterals++) {
+		matcher->min_length = matcher->max_length = length;
+	} else {
+		matcher->min_length = MIN(matcher->min_length, length);
+		matcher->max_length = MAX(matcher->max_length, length);
+	}
+}
+
+
+PURE_FUNC
+static int
+is_static_argument(const struct argument *argument)
+{
+	size_t i;
+
+	for (; argument; argument = argument->next_part) {
+		if (argument->type == QUOTE_EXPRESSION) {
+			for (i = 0; i < argument->command->narguments; i++)
+				if (!is_static_argument(argument->command->arguments[i]))
+					return 0;
+		} else if (argument->type != QUOTED && argument->type != UNQUOTED) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+
+static void
+add_pattern(struct case_table *table, struct argument *argument, struct interpreter_state *clause)
+{
+	struct case_matcher *matcher;
+	struct text_buffer source = {NULL, 0, 0};
+	struct pattern *pattern;
+	const char *literal;
+	size_t length;
+
+	if (!is_static_argument(argument)) {
+		matcher = &table->matchers[table->nmatchers++];
+		matcher->type = DYNAMIC_PATTERN;
+		matcher->clause = clause;
+		matcher->argument = argument;
+		return;
+	}
+
+	expand_text_argument(argument, &source, EXPAND_PATTERN);
+	pattern = compile_pattern(source.text, source.length);
+	free(source.text);
+
+	if (!is_literal_pattern(pattern)) {
+		matcher = &table->matchers[table->nmatchers++];
+		matcher->type = STATIC_PATTERN;
+		matcher->clause = clause;
+		matcher->pattern = pattern;
+		return;
+	}
+
+	matcher = table->nmatchers ? &table->matchers[table->nmatchers - 1] : NULL;
+	if (!matcher || matcher->type != LITERAL_SET) {
+		matcher = &table->matchers[table->nmatchers++];
+		matcher->type = LITERAL_SET;
+	}
+	literal = get_literal_pattern_text(pattern, &length);
+	add_literal(matcher, literal, length, clause);
+	free_pattern(pattern);
+}
+
+
+void
+compile_case_statement(struct interpreter_state *statement)
+{
+	struct interpreter_state *patterns, *clause;
+	struct case_table *table;
+	size_t i, j, npatterns = 0;
+
+	free_case_table(statement->case_table);
+	statement->case_table = NULL;
+
+	/* .arguments[0] is the subject, followed by pairs of CASE_PATTERNS and CASE_CLAUSE */
+	for (i = 1; i + 1 < statement->narguments; i += 2)
+		npatterns += statement->arguments[i]->command->narguments;
+	if (!npatterns)
+		return;
+
+	table = ecalloc(1, sizeof(*table));
+	table->matchers = ecalloc(npatterns, sizeof(*table->matchers));
+	for (i = 1; i + 1 < statement->narguments; i += 2) {
+		patterns = statement->arguments[i]->command;
+		clause = statement->arguments[i + 1]->command;
+		for (j = 0; j < patterns->narguments; j++)
+			add_pattern(table, patterns->arguments[j], clause);
+	}
+
+	statement->case_table = table;
+}
+
+
+static int
+match_dynamic_pattern(struct case_matcher *matcher, const char *subject, size_t length)
+{
+	struct text_buffer source = {NULL, 0, 0};
+
+	expand_text_argument(matcher->argument, &source, EXPAND_PATTERN);
+	if (!pattern_compiled_from(matcher->pattern, source.text, source.length)) {
+		free_pattern(matcher->pattern);
+		matcher->pattern = compile_pattern(source.text, source.length);
+	}
+	free(source.text);
+
+	return match_pattern(matcher->pattern, subject, length);
+}
+
+
+struct interpreter_state *
+select_case_clause(struct interpreter_state *statement, const char *subject, size_t length)
+{
+	struct case_table *table = statement->case_table;
+	struct case_matcher *matcher;
+	struct case_literal *slot;
+	size_t i;
+
+	if (!table)
+		return NULL;
+
+	for (i = 0; i < table->nmatchers; i++) {
+		matcher = &table->matchers[i];
+		switch (matcher->type) {
+		case LITERAL_SET:
+			if (length < matcher->min_length || length > matcher->max_length)
+				break;
+			slot = find_literal_slot(matcher, subject, length, hash_literal(subject, length));
+			if (slot->clause)
+				return slot->clause;
+			break;
+
+		case STATIC_PATTERN:
+			if (match_pattern(matcher->pattern, subject, length))
+				return matcher->clause;
+			break;
+
+		case DYNAMIC_PATTERN:
+			if (match_dynamic_pattern(matcher, subject, length))
+				return matcher->clause;
+			break;
+
+		default:
+			abort();
+		}
+	}
+
+	return NULL;
+}
+
+
+void
+free_case_table(struct case_table *table)
+{
+	size_t i, j;
+
+	if (!table)
+		return;
+
+	for (i = 0; i < table->nmatchers; i++) {
+		for (j = 0; j < table->matchers[i].literals_size; j++)
+			free(table->matchers[i].literals[j].text);
+		free(table->matchers[i].literals);
+		free_pattern(table->matchers[i].pattern);
+	}
+	free(table->matchers);
+	free(table);
+}
+
+
+size_t
+measure_case_table(const struct case_table *table)
+{
+	size_t size, i, j;
+
+	if (!table)
+		return 0;
+
+	size = sizeof(*table) + table->nmatchers * sizeof(*table->matchers);
+	for (i = 0; i < table->nmatchers; i++) {
+		size += table->matchers[i].literals_size * sizeof(*table->matchers[i].literals);
+		for (j = 0; j < table->matchers[i].literals_size; j++)
+			if (table->matchers[i].literals[j].clause)
+				size += table->matchers[i].literals[j].length + 1;
+		size += measure_pattern(table->matchers[i].pattern);
+	}
+
+	return size;
+}
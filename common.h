@@ -1,6 +1,7 @@
 /* See LICENSE file for copyright and license details. */
 #include <libsimple.h>
 #include <libsimple-arg.h>
+#include <stdatomic.h>
 #include "config.h"
 
 
@@ -16,13 +17,15 @@
 #define BUILTIN_USAGE(FUNCTION_NAME, SYNOPSIS)\
 	BUILTIN_NUSAGE(1, FUNCTION_NAME, SYNOPSIS)
 
+/* builtins are run in the shell process, so the usage function
+ * returns the exit status rather than exiting: use "return usage();" */
 #define BUILTIN_NUSAGE(STATUS, FUNCTION_NAME, SYNOPSIS)\
-	static void\
+	static int\
 	FUNCTION_NAME(void)\
 	{\
 		const char *syn = SYNOPSIS ? SYNOPSIS : "";\
 		fprintf(stderr, "usage: %s%s%s\n", argv0, *syn ? " " : "", syn);\
-		exit(STATUS);\
+		return STATUS;\
 	}
 
 
@@ -64,7 +67,11 @@ enum nesting_type {
 	WHILE_STATEMENT,
 	REPEAT_CONDITIONAL,
 	DO_CLAUSE,
-	FOR_STATEMENT
+	FOR_STATEMENT,
+	CASE_STATEMENT, /* .arguments: subject, then alternating CASE_PATTERNS and CASE_CLAUSE */
+	CASE_PATTERNS,
+	CASE_CLAUSE,
+	DEFERRED_FUNCTION_BODY /* .commands are uninterpreted, see compile_function_body() */
 };
 
 enum redirection_type {
@@ -81,8 +88,8 @@ enum redirection_type {
 	REDIRECT_INPUT_OUTPUT,
 	REDIRECT_INPUT_OUTPUT_TO_FD, /* ditto */
 	HERE_STRING,
-	HERE_DOCUMENT, /* eliminated during parse */
-	HERE_DOCUMENT_INDENTED /* eliminated during parse */
+	HERE_DOCUMENT, /* right-hand side is the body when parsed */
+	HERE_DOCUMENT_INDENTED /* changed to HERE_DOCUMENT during parse */
 };
 
 enum tokeniser_mode {
@@ -100,6 +107,7 @@ enum tokeniser_mode {
 
 enum command_terminal {
 	DOUBLE_SEMICOLON,
+	CLOSE_PARENTHESIS, /* only after case patterns */
 	SEMICOLON,
 	NEWLINE,
 	AMPERSAND,
@@ -111,6 +119,41 @@ enum command_terminal {
 	OR
 };
 
+#define LIST_RESERVED_WORDS(_)\
+	_("!",     BANG)\
+	_("{",     OPEN_CURLY)\
+	_("}",     CLOSE_CURLY)\
+	_("case",  CASE)\
+	_("do",    DO)\
+	_("done",  DONE)\
+	_("elif",  ELIF)\
+	_("else",  ELSE)\
+	_("esac",  ESAC)\
+	_("fi",    FI)\
+	_("for",   FOR)\
+	_("if",    IF)\
+	_("in",    IN)\
+	_("then",  THEN)\
+	_("until", UNTIL)\
+	_("while", WHILE)
+
+#define X(S, C) ,C
+enum reserved_word {
+	NOT_A_RESERVED_WORD = 0
+	LIST_RESERVED_WORDS(X)
+};
+#undef X
+
+enum case_position { /* tracked by the parser, as ')' and '|' have another meaning in patterns */
+	NOT_IN_CASE = 0,
+	CASE_NEED_WORD,
+	CASE_NEED_IN,
+	CASE_NEED_PATTERN, /* or esac */
+	CASE_NEED_ALTERNATIVE, /* after '|' */
+	CASE_AFTER_PATTERN, /* need '|' or ')' */
+	CASE_IN_CLAUSE
+};
+
 enum interpreter_requirement {
 	NEED_COMMAND = 0,
 	NEED_COMMAND_END,
@@ -119,6 +162,9 @@ enum interpreter_requirement {
 	NEED_VARIABLE_NAME,
 	NEED_IN_OR_DO,
 	NEED_DO,
+	NEED_WORD,
+	NEED_IN,
+	NEED_PATTERN_OR_ESAC,
 	NEED_VALUE,
 	NEED_PREFIX_OR_VARIABLE_NAME,
 	NEED_INDEX_OR_OPERATOR_OR_END,
@@ -133,6 +179,28 @@ enum interpreter_requirement {
 
 struct parser_state;
 struct interpreter_state;
+struct compiled_cache;
+struct sourced_script;
+struct arithmetic_program;
+struct pattern;
+struct case_table;
+struct arena_chunk;
+
+struct source_cache_statistics {
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+	size_t entries;
+	size_t memory;
+};
+
+struct command_hash_statistics {
+	size_t hits;
+	size_t negative_hits;
+	size_t misses;
+	size_t invalidations;
+	size_t entries;
+};
 
 struct argument {
 	enum argument_type type;
@@ -140,6 +208,7 @@ struct argument {
 		struct {
 			char *text;
 			size_t length;
+			struct variable *variable; /* for VARIABLE, resolved by the interpreter */
 		};
 		struct parser_state *child;
 		struct interpreter_state *command;
@@ -157,6 +226,7 @@ struct redirection {
 	enum redirection_type type;
 	struct argument *left_hand_side;
 	struct argument *right_hand_side; /* set by interpreter, not parser */
+	int here_document_fd; /* set by executor for literal here-documents, 0 if none (it is at least 10) */
 };
 
 struct command {
@@ -168,6 +238,7 @@ struct command {
 	struct redirection **redirections;
 	size_t nredirections;
 	size_t redirections_offset; /* used by interpreter */
+	char **argv; /* set by interpreter if all arguments are literal, see prebuild_command_argv() */
 };
 
 struct parser_state {
@@ -181,6 +252,11 @@ struct parser_state {
 	struct argument *current_argument;
 	struct argument *current_argument_end;
 	char need_right_hand_side;
+	char not_command_position; /* inverted so that default value is 0 */
+	char for_position; /* words left until 'do' may follow 'for' */
+	enum case_position case_position; /* of the innermost case statement */
+	size_t case_depth; /* all but the innermost are CASE_IN_CLAUSE */
+	char alias_blank; /* last alias substitution ended with a blank */
 };
 
 struct here_document {
@@ -220,9 +296,71 @@ struct interpreter_state {
 	size_t narguments;
 	struct redirection **redirections;
 	size_t nredirections;
+	size_t deferred_curly_depth; /* for DEFERRED_FUNCTION_BODY */
+	struct arithmetic_program *arithmetic; /* for TEXT_ROOT of $((…)) and ((…)), see compile_arithmetic_expression() */
+	struct pattern *pattern; /* for VARIABLE_SUBSTITUTION_BRACKET, compiled pattern cached per site */
+	struct case_table *case_table; /* for CASE_STATEMENT, see compile_case_statement() */
 	struct interpreter_state *parent;
 };
 
+struct variable {
+	char *name;
+	size_t name_length;
+	size_t hash;
+	char *value; /* NULL if unset, read with get_variable_value() */
+	size_t value_length;
+	size_t value_size;
+	int64_t integer; /* .value as an integer, if .have_integer */
+	char have_integer;
+	char shared; /* in the variable store that the shell's forks share */
+	char exported;
+	char imported; /* from environ(7), which may still have an entry for it */
+	size_t environment_index; /* hint, see find_environment_entry() */
+	atomic_uint sequence; /* odd while a shared variable is being changed */
+};
+
+struct alias {
+	char *name;
+	size_t name_length;
+	size_t hash;
+	char *value; /* as defined, for printing */
+	struct parser_state *expansion; /* tokenised when defined, see define_alias() */
+	char trailing_blank;
+	char expanding; /* set while substituted, to stop recursion */
+	struct alias *next; /* in hash bucket */
+};
+
+struct arena {
+	struct arena_chunk *chunk;
+	size_t size;
+};
+
+struct field_segment {
+	size_t start;
+	size_t end;
+	char splittable; /* result of an unquoted expansion */
+	char quoted; /* makes a field even if empty */
+	char separator; /* one byte that ends the field, between the fields of "$@" */
+};
+
+struct field_list {
+	char **fields;
+	size_t nfields;
+	size_t size;
+};
+
+struct text_buffer {
+	char *text;
+	size_t length;
+	size_t size;
+};
+
+enum expansion_mode {
+	EXPAND_TEXT,
+	EXPAND_PATTERN, /* quoted text is escaped */
+	EXPAND_ARITHMETIC /* nested $((…)) are inlined as (…) */
+};
+
 struct parser_context {
 	char tty_input;
 	char end_of_file_reached;
@@ -237,13 +375,23 @@ struct parser_context {
 	struct parser_state *parser_state;
 	struct here_document_stack *here_document_stack;
 	struct interpreter_state *interpreter_state;
+	struct compiled_cache *compiled_cache;
+	char no_alias_substitution;
+	char aliases_substituted;
+	char run_commands; /* execute each complete top-level command, and then release it */
+	char queue_commands; /* hand each complete top-level command over to the executor thread */
+	size_t ncommands_completed; /* top-level commands already written to the compiled cache */
 };
 
 
 /* apsh.c */
 extern int login_shell;
 extern int posix_mode;
+extern int check_syntax_only;
 void initialise_parser_context(struct parser_context *ctx, int need_tokeniser, int need_parser);
+void parse_input(struct parser_context *ctx, ssize_t (*read_input)(void *source, char *buffer, size_t size),
+                 void *source, const char *name);
+void parse_file(struct parser_context *ctx, int fd, const char *name);
 
 /* preparser.c */
 size_t parse(struct parser_context *ctx, char *code, size_t code_len, size_t *nremovedp);
@@ -259,29 +407,173 @@ PURE_FUNC const char *get_redirection_token(enum redirection_type type);
 void push_end_of_file(struct parser_context *ctx);
 void push_whitespace(struct parser_context *ctx, int strict);
 void push_semicolon(struct parser_context *ctx, int actually_newline);
+int push_case_pattern_symbol(struct parser_context *ctx, char symbol);
 size_t push_symbol(struct parser_context *ctx, char *token, size_t token_len);
 void push_quoted(struct parser_context *ctx, char *text, size_t text_len);
+size_t decode_escapes(char *text, size_t text_len, size_t line_number);
 void push_escaped(struct parser_context *ctx, char *text, size_t text_len);
 void push_unquoted(struct parser_context *ctx, char *text, size_t text_len);
 void push_enter(struct parser_context *ctx, enum argument_type type);
 void push_leave(struct parser_context *ctx);
 
 /* interpreter.c */
+PURE_FUNC enum reserved_word get_reserved_word(const struct argument *argument);
 void interpret_and_eliminate(struct parser_context *ctx);
+void compile_function_body(struct argument *body);
+void destroy_command(struct command *command);
+void destroy_interpreter_state(struct interpreter_state *state);
+void destroy_parser_state(struct parser_state *state);
+
+/* executor.c */
+extern int last_exit_status;
+void execute_and_release(struct command **commands, size_t ncommands);
+int execute_and_release_script(struct sourced_script *script);
+size_t get_positional_parameters(char ***parametersp);
+void create_pipe(int fds[2], int socket);
+int try_create_pipe(int fds[2], int socket); /* prints the error and returns -1 instead of exiting */
+int start_process_substitution(struct argument *argument);
+void expand_command_substitution(struct argument *argument, struct text_buffer *out);
+
+/* threads.c */
+void queue_commands(struct command **commands, size_t ncommands);
+extern char parsing_ahead;
+void parse_file_threaded(struct parser_context *ctx, int fd, const char *name);
+
+/* parallel.c */
+int parse_file_in_parallel(struct parser_context *ctx, int fd, const char *name, size_t jobs);
+
+/* cache.c */
+struct compiled_cache *load_compiled_cache(int script_fd, const char *script_path, const char *cache_dir, int verify);
+int read_compiled_commands(struct compiled_cache *cache, struct interpreter_state *state);
+struct compiled_cache *create_compiled_cache(int script_fd, const char *script_path, const char *cache_dir);
+void write_compiled_commands(struct compiled_cache *cache, struct command **commands, size_t ncommands);
+struct compiled_cache *create_compiled_cache_fragment(int fd);
+void append_compiled_cache_fragment(struct compiled_cache *cache, int fragment_fd);
+void close_compiled_cache(struct compiled_cache *cache, int commit);
+struct sourced_script *acquire_sourced_script(int fd, const char *path);
+void release_sourced_script(struct sourced_script *script);
+struct interpreter_state *get_sourced_script_tree(struct sourced_script *script);
+void get_source_cache_statistics(struct source_cache_statistics *statistics);
+
+/* arithmetic.c */
+void compile_arithmetic_expression(struct argument *argument);
+int64_t evaluate_arithmetic_expression(struct interpreter_state *expression, const char *expanded_text, size_t line_number);
+/* expanded_text is only used if the expression could not be compiled at parse-time */
+PURE_FUNC int is_arithmetic_expression_compiled(const struct interpreter_state *expression);
+int64_t evaluate_arithmetic_text(const char *text, size_t line_number);
+void free_arithmetic_program(struct arithmetic_program *program);
+size_t measure_arithmetic_program(const struct arithmetic_program *program);
+
+/* variables.c */
+extern char variable_table_shared;
+void create_variable_store(void);
+void unshare_variables(void);
+struct variable *get_variable_slot(const char *name, size_t length);
+const char *get_variable_value(struct variable *variable, size_t *lengthp, struct text_buffer *copy);
+int get_variable_integer(struct variable *variable, int64_t *valuep);
+void cache_variable_integer(struct variable *variable, const char *value, size_t length, int64_t integer);
+void set_variable(struct variable *variable, const char *value, size_t length);
+void set_variable_integer(struct variable *variable, int64_t value);
+void unset_variable(struct variable *variable);
+void export_variable(struct variable *variable, int exported);
+char **get_environment(char **assignments);
+void restore_environment(void);
+size_t get_exported_variables(struct variable ***variablesp);
+
+/* pattern.c */
+struct pattern *compile_pattern(const char *source, size_t length);
+void free_pattern(struct pattern *pattern);
+PURE_FUNC size_t measure_pattern(const struct pattern *pattern);
+PURE_FUNC int pattern_compiled_from(const struct pattern *pattern, const char *source, size_t length);
+PURE_FUNC int is_literal_pattern(const struct pattern *pattern);
+const char *get_literal_pattern_text(const struct pattern *pattern, size_t *lengthp);
+int match_pattern(const struct pattern *pattern, const char *s, size_t length);
+int find_pattern_prefix(const struct pattern *pattern, const char *s, size_t length, int longest, size_t *endp);
+int find_pattern_suffix(const struct pattern *pattern, const char *s, size_t length, int longest, size_t *startp);
+int find_pattern(const struct pattern *pattern, const char *s, size_t length, size_t *startp, size_t *endp);
+
+/* case.c */
+void compile_case_statement(struct interpreter_state *statement);
+struct interpreter_state *select_case_clause(struct interpreter_state *statement, const char *subject, size_t length);
+void free_case_table(struct case_table *table);
+PURE_FUNC size_t measure_case_table(const struct case_table *table);
+
+/* expansion.c */
+char *reserve_text(struct text_buffer *buffer, size_t length);
+void expand_text_argument(struct argument *argument, struct text_buffer *out, enum expansion_mode mode);
+void expand_variable_substitution(struct interpreter_state *bracket, struct text_buffer *out, size_t line_number);
+int64_t evaluate_arithmetic_argument(struct argument *argument);
+PURE_FUNC int is_assignment(const struct argument *argument);
+void prebuild_command_argv(struct command *command);
+char **build_command_argv(struct command *command, struct arena *arena, size_t *argcp);
+PURE_FUNC size_t measure_command_argv(const struct command *command);
+
+/* fields.c */
+void push_field(struct field_list *fields, char *field);
+void split_fields(char *text, const struct field_segment *segments, size_t nsegments, struct field_list *fields);
+
+/* glob.c */
+void expand_pathname_fields(char *text, const struct field_segment *segments, size_t nsegments,
+                            struct field_list *fields, size_t first, struct arena *arena);
+void flush_directory_cache(void);
+
+/* arena.c */
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strndup(struct arena *arena, const char *text, size_t length);
+void arena_reset(struct arena *arena);
+void arena_destroy(struct arena *arena);
+
+/* alias.c */
+struct alias *get_alias(const char *name, size_t length);
+struct argument *copy_raw_argument(const struct argument *argument, size_t line_number);
+struct redirection *copy_raw_redirection(const struct redirection *redirection, size_t line_number);
+int define_alias(const char *name, size_t name_length, const char *value);
+int undefine_alias(const char *name, size_t name_length);
+void undefine_all_aliases(void);
+size_t get_aliases(struct alias ***aliasesp);
+PURE_FUNC size_t get_alias_generation(void);
 
 /* special_builtins.c */
 #define LIST_SPECIAL_BUILTINS(_)\
-	_(":", colon_main, CONST_FUNC)
+	_(":", colon_main, CONST_FUNC)\
+	_(".", dot_main,)\
+	_("export", export_main,)\
+	_("unset", unset_main,)
+/* "export -n", which removes the export attribute, is an extension,
+ * as in bash(1). "unset" only supports -v, as functions cannot be
+ * removed. */
 
 /* regular_builtins.c */
 #define LIST_REGULAR_BUILTINS(_)\
 	_("true", true_main, CONST_FUNC)\
 	_("false", false_main, CONST_FUNC)\
-	_("pwd", pwd_main,)
+	_("pwd", pwd_main,)\
+	_("sourcestat", sourcestat_main,)\
+	_("hash", hash_main,)\
+	_("alias", alias_main,)\
+	_("unalias", unalias_main,)\
+	_("mkpipe", mkpipe_main,)\
+	_("rmpipe", rmpipe_main,)
 /* "true" and "false" are defined as regular built-in shell utilities
  * (that must be searched before PATH), not as stand-alone utilities,
  * in POSIX (but vice verse in LSB). "pwd" is defined both as regular
- * built-in shell utility and as a stand-alone utility. */
+ * built-in shell utility and as a stand-alone utility. "sourcestat"
+ * is an extension that reports on the cache of sourced scripts.
+ * "hash" is a regular built-in shell utility; its -s option, which
+ * reports on the cache of command locations, is an extension.
+ * "alias" and "unalias" are regular built-in shell utilities that
+ * must be run in the shell process to have any effect. "mkpipe" and
+ * "rmpipe" are extensions, defined in plumbing.c, that likewise
+ * change the shell's state. */
+
+/* path.c */
+const char *find_command(const char *name);
+void forget_commands(void);
+size_t get_remembered_commands(const char ***pathsp);
+void get_command_hash_statistics(struct command_hash_statistics *statistics);
+
+/* plumbing.c */
+int get_plumbing_fd(const char *name, int output);
 
 #define X(SH_NAME, C_FUNCTION, C_ATTRIBUTES)\
 	C_ATTRIBUTES int C_FUNCTION(int argc, char **argv);
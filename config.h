@@ -11,3 +11,87 @@
 #if PARSE_RINGBUFFER_INCREASE_SIZE < PARSE_RINGBUFFER_MIN_AVAILABLE
 # error PARSE_RINGBUFFER_INCREASE_SIZE may noy be less than PARSE_RINGBUFFER_MIN_AVAILABLE
 #endif
+
+#ifndef SOURCE_CACHE_MEMORY_BUDGET
+# define SOURCE_CACHE_MEMORY_BUDGET (16UL << 20) /* bytes of interpreted trees kept for sourced scripts */
+#endif
+
+#ifndef VARIABLE_TABLE_INITIAL_SIZE
+# define VARIABLE_TABLE_INITIAL_SIZE 64 /* must be a power of 2 */
+#endif
+
+#ifndef VARIABLE_STORE_RESERVE
+# define VARIABLE_STORE_RESERVE (1UL << 30) /* bytes of address space for the variables shared by the shell's forks */
+#endif
+
+#ifndef VARIABLE_STORE_INITIAL_SIZE
+# define VARIABLE_STORE_INITIAL_SIZE (64UL << 10) /* bytes, doubled as needed up to VARIABLE_STORE_RESERVE */
+#endif
+
+#ifndef VARIABLE_STORE_LOCK_TIMEOUT
+# define VARIABLE_STORE_LOCK_TIMEOUT 10000000L /* nanoseconds waited for a variable before checking that its writer is alive */
+#endif
+
+#ifndef ALIAS_TABLE_INITIAL_SIZE
+# define ALIAS_TABLE_INITIAL_SIZE 16 /* must be a power of 2 */
+#endif
+
+#ifndef FUNCTION_TABLE_INITIAL_SIZE
+# define FUNCTION_TABLE_INITIAL_SIZE 16 /* must be a power of 2 */
+#endif
+
+#ifndef COMMAND_HASH_TABLE_INITIAL_SIZE
+# define COMMAND_HASH_TABLE_INITIAL_SIZE 64 /* must be a power of 2 */
+#endif
+
+#ifndef ARENA_INITIAL_SIZE
+# define ARENA_INITIAL_SIZE 4096 /* bytes, for argv of commands with expansions */
+#endif
+
+#ifndef GLOB_GETDENTS_BUFFER_SIZE
+# define GLOB_GETDENTS_BUFFER_SIZE (256UL << 10) /* bytes read from a directory per system call */
+#endif
+
+#ifndef ARITHMETIC_RECURSION_LIMIT
+# define ARITHMETIC_RECURSION_LIMIT 1024 /* for variables whose values are expressions */
+#endif
+
+#ifndef INPUT_SEGMENT_SIZE
+# define INPUT_SEGMENT_SIZE (64UL << 10) /* bytes read at a time by the reader thread, see -T */
+#endif
+
+#ifndef INPUT_QUEUE_CAPACITY
+# define INPUT_QUEUE_CAPACITY 16 /* input segments read ahead, must be a power of 2 */
+#endif
+
+#ifndef COMMAND_QUEUE_CAPACITY
+# define COMMAND_QUEUE_CAPACITY 256 /* top-level commands parsed ahead of execution, must be a power of 2 */
+#endif
+
+#ifndef QUEUE_SPIN_COUNT
+# define QUEUE_SPIN_COUNT 1024 /* polls of an empty or full queue before the thread sleeps */
+#endif
+
+#ifndef PIPE_BUFFER_SIZE
+# define PIPE_BUFFER_SIZE (1UL << 20) /* bytes, capacity of pipes in pipelines unless $APSH_PIPE_SIZE is set, 0 to keep the kernel's */
+#endif
+
+#ifndef COMMAND_SUBSTITUTION_READ_SIZE
+# define COMMAND_SUBSTITUTION_READ_SIZE (64 << 10) /* bytes, smallest read of a command substitution's output */
+#endif
+
+#ifndef SOCKET_PIPE_TYPE
+# define SOCKET_PIPE_TYPE SOCK_STREAM /* or SOCK_SEQPACKET, for '<>|' unless $APSH_SOCKET_TYPE is set */
+#endif
+
+#ifndef SOCKET_BUFFER_SIZE
+# define SOCKET_BUFFER_SIZE 0 /* bytes, SO_SNDBUF and SO_RCVBUF for '<>|' unless $APSH_SOCKET_SIZE is set, 0 to keep the kernel's */
+#endif
+
+#ifndef PARALLEL_PARSE_MIN_CHUNK_SIZE
+# define PARALLEL_PARSE_MIN_CHUNK_SIZE (1UL << 20) /* bytes, smaller scripts are checked with fewer jobs, see -n */
+#endif
+
+#ifndef PARALLEL_PARSE_BOUNDARY_SEARCH
+# define PARALLEL_PARSE_BOUNDARY_SEARCH (64UL << 10) /* bytes searched for a likely top-level line to split at */
+#endif
@@ -0,0 +1,1584 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <spawn.h>
+
+
+/* A function body is not copied out of the command that defined it;
+ * instead the top-level commands it was defined by are kept until no
+ * function defined by them remains and no call into them is running */
+struct command_owner {
+	struct command **commands;
+	size_t ncommands;
+	size_t references;
+	struct sourced_script *script; /* if set, .commands belong to it, and are not destroyed */
+};
+
+struct function {
+	char *name;
+	size_t name_length;
+	size_t hash;
+	struct command *definition; /* .arguments[2] is the body, .redirections apply to each call */
+	struct command_owner *owner;
+	struct function *next; /* in hash bucket */
+};
+
+struct saved_fd {
+	int fd;
+	int copy; /* -1 if .fd was not open */
+};
+
+struct saved_fds {
+	struct saved_fd *fds;
+	size_t nfds;
+};
+
+struct builtin {
+	const char *name;
+	int (*main)(int argc, char **argv);
+};
+
+
+int last_exit_status;
+
+#define X(SH_NAME, C_FUNCTION, C_ATTRIBUTES) {SH_NAME, C_FUNCTION},
+static const struct builtin special_builtins[] = {LIST_SPECIAL_BUILTINS(X)};
+static const struct builtin regular_builtins[] = {LIST_REGULAR_BUILTINS(X)};
+#undef X
+
+static struct function **function_table;
+static size_t function_table_size;
+static size_t nfunctions;
+
+static struct command **top_level_commands;
+static size_t ntop_level_commands;
+static struct command_owner *current_owner;
+
+static char **positional_parameters; /* $1 and onwards */
+static size_t npositional_parameters;
+
+/* argv of simple commands; reset as soon as the argv is no longer
+ * needed, which is before any nested command is run, so there is
+ * never more than one argv in it */
+static struct arena argv_arena;
+
+/* the shell's ends of the pipes of process substitutions, which
+ * are kept open until the command they were expanded for is done */
+static int *substitution_fds;
+static size_t nsubstitution_fds;
+
+static struct variable *status_variable;
+static struct variable *pipe_size_variable;
+static struct variable *socket_type_variable;
+static struct variable *socket_size_variable;
+static struct text_buffer variable_copy; /* for the values of the variables above */
+static size_t nbackground_jobs;
+
+/* the status of the last command substitution in the simple
+ * command being expanded, which is its status if it has no words */
+static int substitution_status;
+
+
+static int execute_list(struct command **commands, size_t ncommands);
+static int execute_compound_command(struct interpreter_state *state);
+
+
+static pid_t
+fork_process(void)
+{
+	pid_t pid = fork();
+	if (pid < 0)
+		eprintf("fork:");
+	return pid;
+}
+
+
+static int
+wait_for_process(pid_t pid)
+{
+	int status;
+
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR)
+			eprintf("waitpid:");
+
+	if (WIFEXITED(status))
+		return WEXITSTATUS(status);
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return 1;
+}
+
+
+static void
+reap_background_jobs(void)
+{
+	/* only called when no foreground process is running */
+	while (nbackground_jobs && waitpid(-1, NULL, WNOHANG) > 0)
+		nbackground_jobs -= 1;
+}
+
+
+static void
+set_exit_status(int status)
+{
+	last_exit_status = status;
+	if (!status_variable)
+		status_variable = get_variable_slot("?", 1);
+	set_variable_integer(status_variable, status);
+}
+
+
+static char *
+expand_to_text(struct argument *argument, size_t *lengthp)
+{
+	/* valid until the next call */
+	static struct text_buffer buffer = {NULL, 0, 0};
+
+	buffer.length = 0;
+	expand_text_argument(argument, &buffer, EXPAND_TEXT);
+	*lengthp = buffer.length;
+	return buffer.text;
+}
+
+
+static void
+release_owner(struct command_owner *owner)
+{
+	size_t i;
+
+	if (--owner->references)
+		return;
+	if (owner->script)
+		release_sourced_script(owner->script);
+	else
+		for (i = 0; i < owner->ncommands; i++)
+			destroy_command(owner->commands[i]);
+	free(owner->commands);
+	free(owner);
+}
+
+
+PURE_FUNC
+static size_t
+hash_function_name(const char *name, size_t length)
+{
+	size_t hash = 5381;
+	while (length--)
+		hash = (hash << 5) + hash + (unsigned char)*name++;
+	return hash;
+}
+
+
+static struct function **
+find_function(const char *name, size_t length, size_t hash)
+{
+	struct function **functionp;
+
+	functionp = &function_table[hash & (function_table_size - 1)];
+	for (; *functionp; functionp = &(*functionp)->next)
+		if ((*functionp)->hash == hash && (*functionp)->name_length == length && !memcmp((*functionp)->name, name, length))
+			break;
+	return functionp;
+}
+
+
+static void
+grow_function_table(void)
+{
+	struct function **old_table = function_table, *function, *next;
+	size_t old_size = function_table_size, i, bucket;
+
+	function_table_size = old_size ? old_size * 2 : FUNCTION_TABLE_INITIAL_SIZE;
+	function_table = ecalloc(function_table_size, sizeof(*function_table));
+
+	for (i = 0; i < old_size; i++) {
+		for (function = old_table[i]; function; function = next) {
+			next = function->next;
+			bucket = function->hash & (function_table_size - 1);
+			function->next = function_table[bucket];
+			function_table[bucket] = function;
+		}
+	}
+
+	free(old_table);
+}
+
+
+static struct function *
+get_function(const char *name, size_t length)
+{
+	if (!nfunctions)
+		return NULL;
+	return *find_function(name, length, hash_function_name(name, length));
+}
+
+
+static void
+define_function(struct command *definition)
+{
+	struct function **functionp, *function;
+	struct command_owner *old_owner = NULL;
+	const char *name;
+	size_t length, hash;
+
+	if (!current_owner) {
+		current_owner = emalloc(sizeof(*current_owner));
+		current_owner->ncommands = ntop_level_commands;
+		current_owner->commands = emalloc(ntop_level_commands * sizeof(*current_owner->commands));
+		memcpy(current_owner->commands, top_level_commands, ntop_level_commands * sizeof(*current_owner->commands));
+		current_owner->references = 1; /* released by execute_and_release() */
+		current_owner->script = NULL;
+	}
+
+	if (nfunctions >= function_table_size / 4 * 3)
+		grow_function_table();
+
+	name = expand_to_text(definition->arguments[1], &length);
+	hash = hash_function_name(name, length);
+	functionp = find_function(name, length, hash);
+	function = *functionp;
+	if (function) {
+		old_owner = function->owner;
+	} else {
+		function = *functionp = ecalloc(1, sizeof(*function));
+		function->name = emalloc(length + 1);
+		memcpy(function->name, name, length + 1);
+		function->name_length = length;
+		function->hash = hash;
+		nfunctions += 1;
+	}
+
+	function->definition = definition;
+	function->owner = current_owner;
+	current_owner->references += 1;
+	if (old_owner)
+		release_owner(old_owner);
+}
+
+
+static void
+set_positional_parameters(char **values, size_t count)
+{
+	static struct variable *count_variable = NULL, *all_variable = NULL, *joined_variable = NULL;
+	char name[3 * sizeof(size_t) + 1], *joined, *p;
+	size_t i, length = 0, old_count = npositional_parameters;
+
+	positional_parameters = values;
+	npositional_parameters = count;
+
+	for (i = 0; i < MAX(count, old_count); i++) {
+		sprintf(name, "%zu", i + 1);
+		if (i < count)
+			set_variable(get_variable_slot(name, strlen(name)), values[i], strlen(values[i]));
+		else
+			unset_variable(get_variable_slot(name, strlen(name)));
+		length += i < count ? strlen(values[i]) + 1 : 0;
+	}
+
+	if (!count_variable) {
+		count_variable = get_variable_slot("#", 1);
+		all_variable = get_variable_slot("@", 1);
+		joined_variable = get_variable_slot("*", 1);
+	}
+	set_variable_integer(count_variable, (int64_t)count);
+
+	p = joined = emalloc(length + 1);
+	for (i = 0; i < count; i++) {
+		if (i)
+			*p++ = ' ';
+		p = stpcpy(p, values[i]);
+	}
+	set_variable(all_variable, joined, (size_t)(p - joined));
+	set_variable(joined_variable, joined, (size_t)(p - joined));
+	free(joined);
+}
+
+
+size_t
+get_positional_parameters(char ***parametersp)
+{
+	*parametersp = positional_parameters;
+	return npositional_parameters;
+}
+
+
+static char **
+copy_strings(char **strings, size_t n)
+{
+	size_t size = (n + 1) * sizeof(*strings), i;
+	char **copy, *text;
+
+	for (i = 0; i < n; i++)
+		size += strlen(strings[i]) + 1;
+
+	copy = emalloc(size);
+	text = (char *)&copy[n + 1];
+	for (i = 0; i < n; i++) {
+		copy[i] = text;
+		text = stpcpy(text, strings[i]) + 1;
+	}
+	copy[n] = NULL;
+	return copy;
+}
+
+
+static void
+save_fd(struct saved_fds *saved, int fd)
+{
+	size_t i;
+
+	if (!saved)
+		return;
+	for (i = 0; i < saved->nfds; i++)
+		if (saved->fds[i].fd == fd)
+			return;
+
+	saved->fds = erealloc(saved->fds, (saved->nfds + 1) * sizeof(*saved->fds));
+	saved->fds[saved->nfds].fd = fd;
+	saved->fds[saved->nfds].copy = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+	if (saved->fds[saved->nfds].copy < 0 && errno != EBADF)
+		eprintf("fcntl %i F_DUPFD_CLOEXEC:", fd);
+	saved->nfds += 1;
+}
+
+
+static void
+restore_fds(struct saved_fds *saved)
+{
+	struct saved_fd *fd;
+
+	while (saved->nfds--) {
+		fd = &saved->fds[saved->nfds];
+		if (fd->copy < 0) {
+			close(fd->fd);
+		} else {
+			if (dup2(fd->copy, fd->fd) < 0)
+				eprintf("dup2 %i %i:", fd->copy, fd->fd);
+			close(fd->copy);
+		}
+	}
+	free(saved->fds);
+	saved->fds = NULL;
+	saved->nfds = 0;
+}
+
+
+PURE_FUNC
+static int
+is_literal_text(const struct argument *argument)
+{
+	size_t i;
+
+	for (; argument; argument = argument->next_part) {
+		if (argument->type == QUOTE_EXPRESSION) {
+			for (i = 0; i < argument->command->narguments; i++)
+				if (!is_literal_text(argument->command->arguments[i]))
+					return 0;
+		} else if (argument->type != QUOTED && argument->type != UNQUOTED) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+static int
+create_here_document(const char *text, size_t length, int append_newline)
+{
+	size_t off;
+	ssize_t r;
+	int fd;
+
+	/* the file is sealed once written, so the command cannot
+	 * change it, and it can be read again by later commands */
+	fd = memfd_create("apsh-here-document", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		weprintf("memfd_create <here-document>:");
+		return -1;
+	}
+
+	for (off = 0; off < length + (size_t)append_newline; off += (size_t)r) {
+		if (off < length)
+			r = write(fd, &text[off], length - off);
+		else
+			r = write(fd, "\n", 1);
+		if (r < 0) {
+			if (errno == EINTR) {
+				r = 0;
+				continue;
+			}
+			weprintf("write <here-document>:");
+			close(fd);
+			return -1;
+		}
+	}
+
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL))
+		weprintf("fcntl <here-document> F_ADD_SEALS:");
+	if (lseek(fd, 0, SEEK_SET)) {
+		weprintf("lseek <here-document>:");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+static int
+open_here_document(struct redirection *redirection)
+{
+	char path[sizeof("/proc/self/fd/") + 3 * sizeof(int)];
+	int append_newline = redirection->type == HERE_STRING;
+	size_t length;
+	char *text;
+	int fd;
+
+	/* Literal bodies, such as those with a quoted terminator, are
+	 * the same every time, so the file is kept with the redirection
+	 * for when it is run again in a loop or function, and reopened
+	 * rather than duplicated, so that a command that is still
+	 * reading it, in the background, has an offset of its own */
+	if (redirection->here_document_fd) {
+		sprintf(path, "/proc/self/fd/%i", redirection->here_document_fd);
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd >= 0)
+			return fd;
+	}
+
+	text = expand_to_text(redirection->right_hand_side, &length);
+	fd = create_here_document(text, length, append_newline);
+	if (fd < 0 || redirection->here_document_fd || !is_literal_text(redirection->right_hand_side))
+		return fd;
+	redirection->here_document_fd = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+	if (redirection->here_document_fd < 0)
+		redirection->here_document_fd = 0;
+	return fd;
+}
+
+
+static int
+parse_fd_number(const char *text, size_t line_number)
+{
+	const char *s = text;
+	int fd = 0;
+
+	if (!*s)
+		goto invalid;
+	for (; *s; s++) {
+		if (!isdigit(*s) || fd > (INT_MAX - 9) / 10)
+			goto invalid;
+		fd = fd * 10 + (*s - '0');
+	}
+	return fd;
+
+invalid:
+	weprintf("invalid file descriptor number '%s' at line %zu\n", text, line_number);
+	return -1;
+}
+
+
+static int
+apply_redirection(struct redirection *redirection, struct saved_fds *saved)
+{
+	size_t line_number = redirection->right_hand_side->line_number, length;
+	int target, fd, flags = 0, duplicate = 0, also_stderr = 0, here = 0;
+	char *text;
+
+	switch (redirection->type) {
+	case REDIRECT_INPUT:
+		target = STDIN_FILENO;
+		flags = O_RDONLY;
+		break;
+	case REDIRECT_INPUT_TO_FD:
+		target = STDIN_FILENO;
+		duplicate = 1;
+		break;
+	case REDIRECT_OUTPUT_AND_STDERR:
+	case REDIRECT_OUTPUT_AND_STDERR_CLOBBER:
+		also_stderr = 1;
+		/* fall through */
+	case REDIRECT_OUTPUT:
+	case REDIRECT_OUTPUT_CLOBBER:
+		target = STDOUT_FILENO;
+		flags = O_WRONLY | O_CREAT | O_TRUNC;
+		break;
+	case REDIRECT_OUTPUT_AND_STDERR_APPEND:
+		also_stderr = 1;
+		/* fall through */
+	case REDIRECT_OUTPUT_APPEND:
+		target = STDOUT_FILENO;
+		flags = O_WRONLY | O_CREAT | O_APPEND;
+		break;
+	case REDIRECT_OUTPUT_AND_STDERR_TO_FD:
+		also_stderr = 1;
+		/* fall through */
+	case REDIRECT_OUTPUT_TO_FD:
+		target = STDOUT_FILENO;
+		flags = O_WRONLY; /* selects the end of a pipe created with mkpipe */
+		duplicate = 1;
+		break;
+	case REDIRECT_INPUT_OUTPUT:
+		target = STDIN_FILENO;
+		flags = O_RDWR | O_CREAT;
+		break;
+	case REDIRECT_INPUT_OUTPUT_TO_FD:
+		target = STDIN_FILENO;
+		duplicate = 1;
+		break;
+	case HERE_STRING:
+	case HERE_DOCUMENT:
+	case HERE_DOCUMENT_INDENTED:
+		target = STDIN_FILENO;
+		here = 1;
+		break;
+	default:
+		abort();
+	}
+
+	if (redirection->left_hand_side) {
+		text = expand_to_text(redirection->left_hand_side, &length);
+		if ((target = parse_fd_number(text, line_number)) < 0)
+			return -1;
+	}
+
+	if (here) {
+		fd = open_here_document(redirection);
+		if (fd < 0)
+			return -1;
+	} else if (duplicate) {
+		text = expand_to_text(redirection->right_hand_side, &length);
+		if (!strcmp(text, "-")) {
+			fd = -1;
+		} else if (!isdigit(*text) && (fd = get_plumbing_fd(text, flags == O_WRONLY)) >= 0) {
+			/* a pipe or socket created with mkpipe */
+		} else if ((fd = parse_fd_number(text, line_number)) < 0) {
+			return -1;
+		} else if (fcntl(fd, F_GETFD) < 0) {
+			weprintf("%i: bad file descriptor at line %zu\n", fd, line_number);
+			return -1;
+		}
+	} else {
+		text = expand_to_text(redirection->right_hand_side, &length);
+		fd = open(text, flags | O_CLOEXEC, 0666);
+		if (fd < 0) {
+			weprintf("%s:", text);
+			return -1;
+		}
+	}
+
+	save_fd(saved, target);
+	if (also_stderr)
+		save_fd(saved, STDERR_FILENO);
+
+	if (fd < 0) {
+		close(target);
+	} else if (fd != target) {
+		if (dup2(fd, target) < 0)
+			eprintf("dup2 %i %i:", fd, target);
+		if (!duplicate)
+			close(fd);
+	} else if (!duplicate) {
+		fcntl(fd, F_SETFD, 0);
+	}
+
+	if (also_stderr && dup2(target, STDERR_FILENO) < 0)
+		eprintf("dup2 %i %i:", target, STDERR_FILENO);
+
+	return 0;
+}
+
+
+static int
+apply_redirections(struct command *command, struct saved_fds *saved)
+{
+	size_t i;
+
+	/* if saved is NULL, the process will not need the original file descriptors */
+	for (i = 0; i < command->nredirections; i++)
+		if (apply_redirection(command->redirections[i], saved))
+			return -1;
+	return 0;
+}
+
+
+static char **
+expand_assignments(struct command *command, size_t nassignments)
+{
+	char **assignments, *text;
+	size_t i, length;
+
+	assignments = arena_alloc(&argv_arena, (nassignments + 1) * sizeof(*assignments));
+	for (i = 0; i < nassignments; i++) {
+		text = expand_to_text(command->arguments[i], &length);
+		assignments[i] = arena_strndup(&argv_arena, text, length);
+	}
+	assignments[nassignments] = NULL;
+	return assignments;
+}
+
+
+static void
+assign_variables(char **assignments)
+{
+	char *value;
+
+	for (; *assignments; assignments++) {
+		value = strchr(*assignments, '=');
+		set_variable(get_variable_slot(*assignments, (size_t)(value - *assignments)), &value[1], strlen(&value[1]));
+	}
+}
+
+
+static int
+spawn_command(struct command *command, char **argv, char **assignments)
+{
+	struct saved_fds saved = {NULL, 0};
+	const char *path;
+	pid_t pid;
+	int err, status;
+
+	/* posix_spawn(3) uses clone(2) with CLONE_VM and CLONE_VFORK,
+	 * so the shell's page tables are not copied however large it
+	 * is; the redirections are applied around the call, as for
+	 * compound commands, rather than translated to file actions,
+	 * so that they are opened and reported as when forking */
+	if (apply_redirections(command, &saved)) {
+		restore_fds(&saved);
+		return 1;
+	}
+	path = find_command(argv[0]);
+	err = path ? posix_spawn(&pid, path, NULL, NULL, argv, get_environment(assignments)) : ENOENT;
+	restore_environment();
+
+	/* errors are written through the command's redirections */
+	if (!err) {
+		status = 0;
+	} else if (err == ENOEXEC) {
+		status = -1; /* execvp(3) runs it with sh(1) */
+	} else if (err == ENOENT) {
+		weprintf("%s: command not found\n", argv[0]);
+		status = 127;
+	} else {
+		errno = err;
+		weprintf("exec %s:", argv[0]);
+		status = 126;
+	}
+	restore_fds(&saved);
+
+	return err ? status : wait_for_process(pid);
+}
+
+
+static const struct builtin *
+find_builtin(const struct builtin *builtins, size_t nbuiltins, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < nbuiltins; i++)
+		if (!strcmp(builtins[i].name, name))
+			return &builtins[i];
+	return NULL;
+}
+
+
+static int
+execute_subshell(struct interpreter_state *state, struct command *command, int forked)
+{
+	pid_t pid;
+
+	if (!forked) {
+		pid = fork_process();
+		if (pid)
+			return wait_for_process(pid);
+	}
+
+	/* the only fork whose variables are not shared with the shell */
+	unshare_variables();
+	if (command && apply_redirections(command, NULL))
+		exit(1);
+	exit(execute_list(state->commands, state->ncommands));
+}
+
+
+static int
+call_builtin(const struct builtin *builtin, struct command *command, size_t argc, char **argv)
+{
+	struct saved_fds saved = {NULL, 0};
+	char *saved_argv0 = argv0;
+	int status;
+
+	/* builtins are run without forking: ARGBEGIN only keeps state
+	 * in argv0, which is restored, errors are returned rather than
+	 * exited on, and stdout is flushed before the redirections that
+	 * it is written through are undone */
+	if (apply_redirections(command, &saved)) {
+		status = 1;
+	} else {
+		status = builtin->main((int)argc, argv);
+		fflush(stdout);
+		clearerr(stdout);
+	}
+	argv0 = saved_argv0;
+	restore_fds(&saved);
+	return status;
+}
+
+
+static int
+call_function(struct function *function, size_t argc, char **argv)
+{
+	struct command_owner *owner = function->owner, *saved_owner = current_owner;
+	struct command *definition = function->definition;
+	struct argument *body = definition->arguments[2];
+	struct saved_fds saved = {NULL, 0};
+	char **saved_parameters = positional_parameters, **parameters;
+	size_t saved_nparameters = npositional_parameters;
+	int status;
+
+	/* the function may be redefined while it is running */
+	owner->references += 1;
+	current_owner = owner;
+
+	parameters = copy_strings(&argv[1], argc - 1);
+	arena_reset(&argv_arena);
+	set_positional_parameters(parameters, argc - 1);
+
+	compile_function_body(body);
+	if (body->type == SUBSHELL)
+		status = execute_subshell(body->command, definition, 0);
+	else if (apply_redirections(definition, &saved))
+		status = 1;
+	else
+		status = execute_compound_command(body->command);
+	restore_fds(&saved);
+
+	set_positional_parameters(saved_parameters, saved_nparameters);
+	free(parameters);
+
+	current_owner = saved_owner;
+	release_owner(owner);
+	return status;
+}
+
+
+static int
+execute_simple_command(struct command *command, int forked)
+{
+	const struct builtin *builtin = NULL;
+	struct function *function = NULL;
+	struct saved_fds saved = {NULL, 0};
+	struct command words;
+	char **argv, **assignments;
+	const char *path;
+	size_t nassignments, argc;
+	int status = 0;
+	pid_t pid;
+
+	for (nassignments = 0; nassignments < command->narguments; nassignments++)
+		if (!is_assignment(command->arguments[nassignments]))
+			break;
+
+	words = *command;
+	words.arguments = &command->arguments[nassignments];
+	words.narguments -= nassignments;
+	substitution_status = 0;
+	argv = build_command_argv(&words, &argv_arena, &argc);
+	assignments = expand_assignments(command, nassignments);
+
+	if (!argc) {
+		assign_variables(assignments);
+		arena_reset(&argv_arena);
+		status = substitution_status;
+		if (apply_redirections(command, forked ? NULL : &saved))
+			status = 1;
+		if (!forked)
+			restore_fds(&saved);
+		return status;
+	}
+
+	builtin = find_builtin(special_builtins, ELEMSOF(special_builtins), argv[0]);
+	if (!builtin && (function = get_function(argv[0], strlen(argv[0])))) {
+		assign_variables(assignments);
+		return call_function(function, argc, argv);
+	}
+	if (builtin && !forked) {
+		/* assignments before special builtins persist */
+		assign_variables(assignments);
+		status = call_builtin(builtin, command, argc, argv);
+		arena_reset(&argv_arena);
+		return status;
+	}
+	if (!builtin) {
+		builtin = find_builtin(regular_builtins, ELEMSOF(regular_builtins), argv[0]);
+		/* but before regular builtins they are only in the
+		 * builtin's environment, which is easier to do in a fork */
+		if (builtin && !forked && !*assignments) {
+			status = call_builtin(builtin, command, argc, argv);
+			arena_reset(&argv_arena);
+			return status;
+		}
+	}
+
+	if (!forked && !builtin) {
+		status = spawn_command(command, argv, assignments);
+		if (status >= 0) {
+			arena_reset(&argv_arena);
+			return status;
+		}
+	}
+
+	/* subshells, and commands that run in a process of their own
+	 * anyway, such as in pipelines, are run in a fork of the shell */
+	if (!forked) {
+		pid = fork_process();
+		if (pid) {
+			arena_reset(&argv_arena);
+			return wait_for_process(pid);
+		}
+	}
+
+	if (builtin && *assignments) {
+		/* the fork may share the variables with the shell */
+		unshare_variables();
+		assign_variables(assignments);
+	}
+	if (apply_redirections(command, NULL))
+		exit(1);
+	if (builtin)
+		exit(builtin->main((int)argc, argv));
+	path = find_command(argv[0]);
+	if (path)
+		execvpe(path, argv, get_environment(assignments)); /* rather than execve(2), to run scripts without #! with sh(1) */
+	else
+		errno = ENOENT;
+	if (errno == ENOENT) {
+		weprintf("%s: command not found\n", argv[0]);
+		exit(127);
+	}
+	weprintf("exec %s:", argv[0]);
+	exit(126);
+}
+
+
+static int
+execute_command(struct command *command, int forked)
+{
+	struct saved_fds saved = {NULL, 0};
+	struct argument *first;
+	int status;
+
+	/* forked is set if the command runs in a process of its own,
+	 * which it may replace, and which exits when it is completed */
+	first = command->narguments ? command->arguments[0] : NULL;
+	if (!first)
+		return execute_simple_command(command, forked);
+
+	switch (first->type) {
+	case FUNCTION_MARK:
+		define_function(command);
+		return 0;
+
+	case COMMAND:
+		if (apply_redirections(command, forked ? NULL : &saved))
+			status = 1;
+		else
+			status = execute_compound_command(first->command);
+		if (!forked)
+			restore_fds(&saved);
+		return status;
+
+	case SUBSHELL:
+		return execute_subshell(first->command, command, forked);
+
+	case ARITHMETIC_SUBSHELL:
+		if (apply_redirections(command, forked ? NULL : &saved))
+			status = 1;
+		else
+			status = !evaluate_arithmetic_argument(first);
+		if (!forked)
+			restore_fds(&saved);
+		return status;
+
+	default:
+		return execute_simple_command(command, forked);
+	}
+}
+
+
+PURE_FUNC
+static int
+continues_pipeline(enum command_terminal terminal)
+{
+	return terminal == PIPE || terminal == PIPE_AMPERSAND || terminal == AMPERSAND_PIPE || terminal == SOCKET_PIPE;
+}
+
+
+static size_t
+get_size_variable(struct variable **variablep, const char *name, size_t default_size)
+{
+	const char *value;
+	char *end;
+	unsigned long int size;
+	size_t length;
+
+	/* read whenever a pipe is created, so that it can be
+	 * changed for the pipelines that need larger buffers */
+	if (!*variablep)
+		*variablep = get_variable_slot(name, strlen(name));
+	value = get_variable_value(*variablep, &length, &variable_copy);
+	if (!value || !*value)
+		return default_size;
+	errno = 0;
+	size = strtoul(value, &end, 10);
+	if (errno || *end || size > INT_MAX) {
+		weprintf("invalid value of %s: %s\n", name, value);
+		return default_size;
+	}
+	return (size_t)size;
+}
+
+
+static int
+get_socket_type(void)
+{
+	const char *value;
+	size_t length;
+
+	if (!socket_type_variable)
+		socket_type_variable = get_variable_slot("APSH_SOCKET_TYPE", sizeof("APSH_SOCKET_TYPE") - 1);
+	value = get_variable_value(socket_type_variable, &length, &variable_copy);
+	if (!value || !*value)
+		return SOCKET_PIPE_TYPE;
+	if (!strcmp(value, "stream"))
+		return SOCK_STREAM;
+	if (!strcmp(value, "seqpacket"))
+		return SOCK_SEQPACKET;
+	weprintf("invalid value of APSH_SOCKET_TYPE: %s\n", value);
+	return SOCKET_PIPE_TYPE;
+}
+
+
+int
+try_create_pipe(int fds[2], int socket)
+{
+	size_t size;
+	int value, i;
+
+	/* like a pipe, fds[0] is the next stage's input and fds[1]
+	 * is the previous stage's output, but both ends of a socket
+	 * can be read and written, so replies need no second pipe */
+	if (socket) {
+		size = get_size_variable(&socket_size_variable, "APSH_SOCKET_SIZE", SOCKET_BUFFER_SIZE);
+		if (socketpair(AF_UNIX, get_socket_type() | SOCK_CLOEXEC, 0, fds)) {
+			weprintf("socketpair:");
+			return -1;
+		}
+		if (size) {
+			value = (int)size;
+			for (i = 0; i < 2; i++) {
+				setsockopt(fds[i], SOL_SOCKET, SO_SNDBUF, &value, sizeof(value));
+				setsockopt(fds[i], SOL_SOCKET, SO_RCVBUF, &value, sizeof(value));
+			}
+		}
+	} else {
+		/* a larger capacity means fewer context switches between
+		 * the stages when the data is produced at a high rate */
+		size = get_size_variable(&pipe_size_variable, "APSH_PIPE_SIZE", PIPE_BUFFER_SIZE);
+		if (pipe2(fds, O_CLOEXEC)) {
+			weprintf("pipe2:");
+			return -1;
+		}
+		if (size)
+			fcntl(fds[1], F_SETPIPE_SZ, (int)size); /* fails if over the user's limit; not an error */
+	}
+	return 0;
+}
+
+
+void
+create_pipe(int fds[2], int socket)
+{
+	if (try_create_pipe(fds, socket))
+		exit(1);
+}
+
+
+static int *
+create_pipes(struct command **commands, size_t npipes)
+{
+	int *fds = emalloc(npipes * 2 * sizeof(*fds));
+	size_t i;
+
+	/* all pipes are created before any stage is started, so no
+	 * stage waits for the next pipe to be set up; they are close
+	 * on exec, so spawned stages only keep the ends they are given */
+	for (i = 0; i < npipes; i++)
+		create_pipe(&fds[i * 2], commands[i]->terminal == SOCKET_PIPE);
+	return fds;
+}
+
+
+static void
+close_pipes(int *fds, size_t npipes)
+{
+	size_t i;
+
+	for (i = 0; i < npipes * 2; i++)
+		close(fds[i]);
+}
+
+
+PURE_FUNC
+static int
+is_builtin_name(const char *name)
+{
+	return find_builtin(special_builtins, ELEMSOF(special_builtins), name) ||
+	       find_builtin(regular_builtins, ELEMSOF(regular_builtins), name);
+}
+
+
+static int
+is_spawnable_stage(struct command *command)
+{
+	const char *name;
+
+	/* a stage of only literal words, that does not name a builtin
+	 * or function, can be started without forking the shell */
+	if (!command->argv || command->nredirections)
+		return 0;
+	name = command->argv[0];
+	if (is_builtin_name(name))
+		return 0;
+	return !get_function(name, strlen(name));
+}
+
+
+/* returns the negated exit status if the command could not be
+ * started, or 0 if it must be run in a fork of the shell instead */
+static pid_t
+spawn_stage(struct command *command, int input, int output, int redirect_stderr)
+{
+	posix_spawn_file_actions_t actions;
+	const char *path;
+	pid_t pid;
+	int err;
+
+	if ((err = posix_spawn_file_actions_init(&actions))) {
+		errno = err;
+		eprintf("posix_spawn_file_actions_init:");
+	}
+	if (input >= 0)
+		posix_spawn_file_actions_adddup2(&actions, input, STDIN_FILENO);
+	if (output >= 0) {
+		posix_spawn_file_actions_adddup2(&actions, output, STDOUT_FILENO);
+		if (redirect_stderr)
+			posix_spawn_file_actions_adddup2(&actions, output, STDERR_FILENO);
+	}
+
+	path = find_command(command->argv[0]);
+	err = path ? posix_spawn(&pid, path, &actions, NULL, command->argv, get_environment(NULL)) : ENOENT;
+	posix_spawn_file_actions_destroy(&actions);
+
+	if (!err)
+		return pid;
+	if (err == ENOEXEC)
+		return 0; /* execvp(3) runs it with sh(1) */
+	if (err == ENOENT) {
+		weprintf("%s: command not found\n", command->argv[0]);
+		return -127;
+	}
+	errno = err;
+	weprintf("exec %s:", command->argv[0]);
+	return -126;
+}
+
+
+static pid_t
+fork_stage(struct command *command, int input, int output, int redirect_stderr, int *fds, size_t npipes)
+{
+	pid_t pid = fork_process();
+	if (pid)
+		return pid;
+
+	if (input >= 0 && dup2(input, STDIN_FILENO) < 0)
+		eprintf("dup2 %i %i:", input, STDIN_FILENO);
+	if (output >= 0) {
+		if (dup2(output, STDOUT_FILENO) < 0)
+			eprintf("dup2 %i %i:", output, STDOUT_FILENO);
+		if (redirect_stderr && dup2(output, STDERR_FILENO) < 0)
+			eprintf("dup2 %i %i:", output, STDERR_FILENO);
+	}
+	/* the stage may be a builtin or compound command, that would
+	 * otherwise keep the other ends open for as long as it runs */
+	close_pipes(fds, npipes);
+	exit(execute_command(command, 1));
+}
+
+
+static void
+execute_substituted_commands(struct interpreter_state *state)
+{
+	/* usually a single command, that can replace this process */
+	if (state->ncommands == 1 && !continues_pipeline(state->commands[0]->terminal) &&
+	    state->commands[0]->terminal != AMPERSAND)
+		exit(execute_command(state->commands[0], 1));
+	exit(execute_list(state->commands, state->ncommands));
+}
+
+
+int
+start_process_substitution(struct argument *argument)
+{
+	int fds[2], child_end, shell_end;
+	size_t i;
+	pid_t pid;
+
+	/* the command is given the path of the shell's end in /dev/fd,
+	 * so there is nothing to create or remove in the file system;
+	 * '>(…)' reads what the command writes, '<(…)' writes what the
+	 * command reads, and '<>(…)' is connected to it by a socket */
+	create_pipe(fds, argument->type == PROCESS_SUBSTITUTION_INPUT_OUTPUT);
+	child_end = argument->type == PROCESS_SUBSTITUTION_INPUT ? fds[0] : fds[1];
+	shell_end = argument->type == PROCESS_SUBSTITUTION_INPUT ? fds[1] : fds[0];
+
+	pid = fork_process();
+	if (!pid) {
+		/* other substitutions' ends would hold their pipes open */
+		for (i = 0; i < nsubstitution_fds; i++)
+			close(substitution_fds[i]);
+		close(shell_end);
+		if (argument->type != PROCESS_SUBSTITUTION_OUTPUT && dup2(child_end, STDIN_FILENO) < 0)
+			eprintf("dup2 %i %i:", child_end, STDIN_FILENO);
+		if (argument->type != PROCESS_SUBSTITUTION_INPUT && dup2(child_end, STDOUT_FILENO) < 0)
+			eprintf("dup2 %i %i:", child_end, STDOUT_FILENO);
+		close(child_end);
+		execute_substituted_commands(argument->command);
+	}
+
+	/* reaped with the background jobs, so that the command
+	 * never waits for its substituted processes */
+	nbackground_jobs += 1;
+	close(child_end);
+	if (fcntl(shell_end, F_SETFD, 0))
+		eprintf("fcntl %i F_SETFD:", shell_end);
+	substitution_fds = erealloc(substitution_fds, (nsubstitution_fds + 1) * sizeof(*substitution_fds));
+	substitution_fds[nsubstitution_fds++] = shell_end;
+	return shell_end;
+}
+
+
+static const struct builtin *
+find_substitutable_builtin(const struct command *command)
+{
+	/* builtins that do not change the shell's state, so that
+	 * running them in the shell process is not observable */
+	static int (*const mains[])(int argc, char **argv) = {colon_main, true_main, false_main, pwd_main};
+	const struct builtin *builtin;
+	size_t i;
+
+	if (!command->argv || command->nredirections || get_function(command->argv[0], strlen(command->argv[0])))
+		return NULL;
+	if (command->terminal != SEMICOLON && command->terminal != NEWLINE)
+		return NULL;
+	builtin = find_builtin(regular_builtins, ELEMSOF(regular_builtins), command->argv[0]);
+	if (!builtin)
+		builtin = find_builtin(special_builtins, ELEMSOF(special_builtins), command->argv[0]);
+	for (i = 0; builtin && i < ELEMSOF(mains); i++)
+		if (builtin->main == mains[i])
+			return builtin;
+	return NULL;
+}
+
+
+static ssize_t
+write_to_buffer(void *cookie, const char *data, size_t size)
+{
+	struct text_buffer *buffer = cookie;
+
+	memcpy(reserve_text(buffer, size), data, size);
+	buffer->length += size;
+	return (ssize_t)size;
+}
+
+
+static int
+substitute_builtins(struct interpreter_state *state, struct text_buffer *out)
+{
+	static const cookie_io_functions_t functions = {.write = write_to_buffer};
+	const struct builtin *builtin;
+	FILE *saved_stdout = stdout;
+	size_t i;
+	int status = 0;
+
+	/* commands of literal words that only name such builtins are
+	 * run without forking, with stdout writing into the buffer */
+	for (i = 0; i < state->ncommands; i++)
+		if (!find_substitutable_builtin(state->commands[i]))
+			return -1;
+
+	fflush(stdout);
+	stdout = fopencookie(out, "w", functions);
+	if (!stdout) {
+		stdout = saved_stdout;
+		return -1;
+	}
+	for (i = 0; i < state->ncommands; i++) {
+		builtin = find_substitutable_builtin(state->commands[i]);
+		status = call_builtin(builtin, state->commands[i], state->commands[i]->narguments, state->commands[i]->argv);
+		if (state->commands[i]->have_bang)
+			status = !status;
+	}
+	fclose(stdout);
+	stdout = saved_stdout;
+	return status;
+}
+
+
+static void
+read_substitution(int fd, struct text_buffer *out)
+{
+	ssize_t r;
+	int available;
+
+	/* reads are sized by what is already in the pipe, so
+	 * large outputs are read in few calls; the buffer is
+	 * grown by doubling, which for large buffers realloc(3)
+	 * does with mremap(2) rather than by copying */
+	for (;;) {
+		if (ioctl(fd, FIONREAD, &available) || available < COMMAND_SUBSTITUTION_READ_SIZE)
+			available = COMMAND_SUBSTITUTION_READ_SIZE;
+		r = read(fd, reserve_text(out, (size_t)available), (size_t)available);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r < 0)
+				weprintf("read <command substitution>:");
+			break;
+		}
+		out->length += (size_t)r;
+	}
+}
+
+
+void
+expand_command_substitution(struct argument *argument, struct text_buffer *out)
+{
+	size_t start = out->length, i;
+	int fds[2], status;
+	pid_t pid;
+
+	status = substitute_builtins(argument->command, out);
+	if (status >= 0) {
+		substitution_status = status;
+		goto out;
+	}
+
+	/* not create_pipe(), as the pipe is read as fast as it
+	 * is written, so its capacity need not be changed */
+	if (pipe2(fds, O_CLOEXEC))
+		eprintf("pipe2:");
+	fflush(stdout);
+	pid = fork_process();
+	if (!pid) {
+		for (i = 0; i < nsubstitution_fds; i++)
+			close(substitution_fds[i]);
+		close(fds[0]);
+		if (dup2(fds[1], STDOUT_FILENO) < 0)
+			eprintf("dup2 %i %i:", fds[1], STDOUT_FILENO);
+		close(fds[1]);
+		/* it is a subshell, like '(…)' */
+		unshare_variables();
+		execute_substituted_commands(argument->command);
+	}
+
+	close(fds[1]);
+	read_substitution(fds[0], out);
+	close(fds[0]);
+	substitution_status = wait_for_process(pid);
+
+out:
+	/* trailing newlines are removed by shortening the text */
+	while (out->length > start && out->text[out->length - 1] == '\n')
+		out->length -= 1;
+	reserve_text(out, 0)[0] = '\0';
+}
+
+
+static void
+close_process_substitutions(size_t keep)
+{
+	while (nsubstitution_fds > keep)
+		close(substitution_fds[--nsubstitution_fds]);
+}
+
+
+static int
+execute_pipeline(struct command **commands, size_t ncommands)
+{
+	struct saved_fds saved = {NULL, 0};
+	int status = 0, last_status = 0, input, output, redirect_stderr, last_in_shell, *fds;
+	pid_t *pids;
+	size_t i, npipes, nsubstitutions;
+
+	if (ncommands == 1) {
+		nsubstitutions = nsubstitution_fds;
+		status = execute_command(commands[0], 0);
+		close_process_substitutions(nsubstitutions);
+		goto out;
+	}
+
+	npipes = ncommands - 1;
+	fds = create_pipes(commands, npipes);
+	pids = emalloc(ncommands * sizeof(*pids));
+
+	/* a builtin in the last stage is run in the shell process,
+	 * with the last pipe as its stdin, rather than in a fork */
+	last_in_shell = commands[npipes]->argv && is_builtin_name(commands[npipes]->argv[0]) &&
+	                !get_function(commands[npipes]->argv[0], strlen(commands[npipes]->argv[0]));
+
+	for (i = 0; i < ncommands - last_in_shell; i++) {
+		input = i ? fds[(i - 1) * 2] : -1;
+		output = i < npipes ? fds[i * 2 + 1] : -1;
+		redirect_stderr = commands[i]->terminal == PIPE_AMPERSAND || commands[i]->terminal == AMPERSAND_PIPE;
+		pids[i] = is_spawnable_stage(commands[i]) ? spawn_stage(commands[i], input, output, redirect_stderr) : 0;
+		if (!pids[i])
+			pids[i] = fork_stage(commands[i], input, output, redirect_stderr, fds, npipes);
+	}
+
+	if (last_in_shell) {
+		save_fd(&saved, STDIN_FILENO);
+		if (dup2(fds[(npipes - 1) * 2], STDIN_FILENO) < 0)
+			eprintf("dup2 %i %i:", fds[(npipes - 1) * 2], STDIN_FILENO);
+	}
+	close_pipes(fds, npipes);
+	free(fds);
+	if (last_in_shell) {
+		last_status = execute_command(commands[npipes], 0);
+		restore_fds(&saved);
+	}
+
+	/* each wait blocks until the stage has exited; the status
+	 * of the pipeline is that of the last stage */
+	for (i = 0; i < ncommands - last_in_shell; i++)
+		status = pids[i] < 0 ? (int)-pids[i] : wait_for_process(pids[i]);
+	if (last_in_shell)
+		status = last_status;
+	free(pids);
+
+out:
+	if (commands[0]->have_bang)
+		status = !status;
+	set_exit_status(status);
+	return status;
+}
+
+
+static int
+execute_and_or_list(struct command **commands, size_t ncommands)
+{
+	enum command_terminal operator;
+	size_t i = 0, end;
+	int status;
+
+	for (;;) {
+		for (end = i; end + 1 < ncommands && continues_pipeline(commands[end]->terminal); end++);
+		status = execute_pipeline(&commands[i], end + 1 - i);
+
+		/* skip pipelines until the operator before one selects it */
+		for (;;) {
+			if (end + 1 >= ncommands)
+				return status;
+			operator = commands[end]->terminal;
+			i = end + 1;
+			if ((operator == AND) == !status)
+				break;
+			for (end = i; end + 1 < ncommands && continues_pipeline(commands[end]->terminal); end++);
+		}
+	}
+}
+
+
+static int
+execute_list(struct command **commands, size_t ncommands)
+{
+	size_t i, end;
+	int status = 0, fd;
+	pid_t pid;
+
+	for (i = 0; i < ncommands; i = end + 1) {
+		reap_background_jobs();
+
+		for (end = i; end + 1 < ncommands; end++)
+			if (!continues_pipeline(commands[end]->terminal) && commands[end]->terminal != AND &&
+			    commands[end]->terminal != OR)
+				break;
+
+		if (commands[end]->terminal != AMPERSAND) {
+			status = execute_and_or_list(&commands[i], end + 1 - i);
+			continue;
+		}
+
+		pid = fork_process();
+		if (!pid) {
+			/* asynchronous lists in non-interactive shells do not read the shell's input */
+			fd = open("/dev/null", O_RDONLY);
+			if (fd >= 0 && fd != STDIN_FILENO) {
+				dup2(fd, STDIN_FILENO);
+				close(fd);
+			}
+			exit(execute_and_or_list(&commands[i], end + 1 - i));
+		}
+		nbackground_jobs += 1;
+		set_variable_integer(get_variable_slot("!", 1), (int64_t)pid);
+		status = 0;
+		set_exit_status(status);
+	}
+
+	return status;
+}
+
+
+static int
+execute_for_statement(struct interpreter_state *state)
+{
+	struct command *header = state->commands[0], words;
+	struct interpreter_state *body = state->arguments[0]->command;
+	struct arena arena = {NULL, 0};
+	struct variable *variable;
+	char **values;
+	size_t nvalues, i;
+	int status = 0;
+
+	/* .commands[0] is the variable name followed by the words, if any */
+	variable = header->arguments[0]->variable;
+	if (header->narguments == 1) {
+		values = copy_strings(positional_parameters, npositional_parameters);
+		nvalues = npositional_parameters;
+	} else {
+		words = *header;
+		words.arguments = &header->arguments[1];
+		words.narguments -= 1;
+		words.argv = NULL;
+		/* the body resets argv_arena */
+		values = build_command_argv(&words, &arena, &nvalues);
+	}
+
+	for (i = 0; i < nvalues; i++) {
+		set_variable(variable, values[i], strlen(values[i]));
+		status = execute_list(body->commands, body->ncommands);
+	}
+
+	if (header->narguments == 1)
+		free(values);
+	arena_destroy(&arena);
+	return status;
+}
+
+
+static int
+execute_compound_command(struct interpreter_state *state)
+{
+	struct interpreter_state *condition, *clause;
+	const char *subject;
+	size_t i, length;
+	int status = 0;
+
+	switch (state->dealing_with) {
+	case IF_STATEMENT:
+		/* .arguments alternate IF_CONDITIONAL and IF_CLAUSE, optionally followed by ELSE_CLAUSE */
+		for (i = 0; i < state->narguments; i += 2) {
+			condition = state->arguments[i]->command;
+			if (condition->dealing_with == ELSE_CLAUSE)
+				return execute_list(condition->commands, condition->ncommands);
+			if (!execute_list(condition->commands, condition->ncommands)) {
+				clause = state->arguments[i + 1]->command;
+				return execute_list(clause->commands, clause->ncommands);
+			}
+		}
+		return 0;
+
+	case WHILE_STATEMENT:
+	case UNTIL_STATEMENT:
+		condition = state->arguments[0]->command;
+		clause = state->arguments[1]->command;
+		for (;;) {
+			if (!execute_list(condition->commands, condition->ncommands) != (state->dealing_with == WHILE_STATEMENT))
+				break;
+			status = execute_list(clause->commands, clause->ncommands);
+		}
+		return status;
+
+	case FOR_STATEMENT:
+		return execute_for_statement(state);
+
+	case CASE_STATEMENT:
+		subject = expand_to_text(state->arguments[0], &length);
+		clause = select_case_clause(state, subject, length);
+		return clause ? execute_list(clause->commands, clause->ncommands) : 0;
+
+	default:
+		return execute_list(state->commands, state->ncommands);
+	}
+}
+
+
+void
+execute_and_release(struct command **commands, size_t ncommands)
+{
+	struct command_owner *owner;
+	size_t i;
+
+	if (!check_syntax_only) {
+		top_level_commands = commands;
+		ntop_level_commands = ncommands;
+		execute_list(commands, ncommands);
+		flush_directory_cache();
+		top_level_commands = NULL;
+		ntop_level_commands = 0;
+
+		/* kept if a function was defined by it */
+		owner = current_owner;
+		current_owner = NULL;
+		if (owner) {
+			release_owner(owner);
+			return;
+		}
+	}
+
+	for (i = 0; i < ncommands; i++)
+		destroy_command(commands[i]);
+}
+
+
+int
+execute_and_release_script(struct sourced_script *script)
+{
+	struct interpreter_state *tree = get_sourced_script_tree(script);
+	struct command **saved_commands = top_level_commands;
+	struct command_owner *owner, *saved_owner = current_owner;
+	size_t saved_ncommands = ntop_level_commands;
+	int status;
+
+	top_level_commands = tree->commands;
+	ntop_level_commands = tree->ncommands;
+	current_owner = NULL;
+	status = execute_list(tree->commands, tree->ncommands);
+	owner = current_owner;
+	top_level_commands = saved_commands;
+	ntop_level_commands = saved_ncommands;
+	current_owner = saved_owner;
+
+	/* the tree may be cached and used again, so it is never
+	 * destroyed here; if functions were defined by it, their
+	 * owner holds on to the script instead of the commands */
+	if (owner) {
+		owner->script = script;
+		release_owner(owner);
+	} else {
+		release_sourced_script(script);
+	}
+	return status;
+}
@@ -0,0 +1,787 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+
+#define IS_PATTERN_SPECIAL(C) ((C) == '*' || (C) == '?' || (C) == '[' || (C) == ']' || (C) == '\\')
+
+
+static void expand_parts(struct argument *argument, struct text_buffer *out, enum expansion_mode mode, int quoted);
+
+/* values of shared variables are copied before they are appended */
+static struct text_buffer variable_copy;
+
+
+char *
+reserve_text(struct text_buffer *buffer, size_t length)
+{
+	if (buffer->length + length + 1 > buffer->size) {
+		buffer->size = MAX(buffer->size * 2, buffer->length + length + 1);
+		buffer->text = erealloc(buffer->text, buffer->size);
+	}
+	return &buffer->text[buffer->length];
+}
+
+
+static void
+append_text(struct text_buffer *buffer, const char *text, size_t length)
+{
+	memcpy(reserve_text(buffer, length), text, length);
+	buffer->length += length;
+	buffer->text[buffer->length] = '\0';
+}
+
+
+static void
+append_pattern_literal(struct text_buffer *buffer, const char *text, size_t length)
+{
+	char *out = reserve_text(buffer, 2 * length);
+	size_t i;
+
+	for (i = 0; i < length; i++) {
+		if (IS_PATTERN_SPECIAL(text[i]))
+			*out++ = '\\';
+		*out++ = text[i];
+	}
+	buffer->length = (size_t)(out - buffer->text);
+	buffer->text[buffer->length] = '\0';
+}
+
+
+static void
+append_integer(struct text_buffer *buffer, int64_t value)
+{
+	int length = sprintf(reserve_text(buffer, sizeof("-9223372036854775808") - 1), "%ji", (intmax_t)value);
+	buffer->length += (size_t)length;
+}
+
+
+static void
+append_quoted(struct text_buffer *buffer, const char *text, size_t length)
+{
+	const char *end = &text[length], *quote;
+
+	/* 'text' with ' written as '\'' */
+	append_text(buffer, "'", 1);
+	while ((quote = memchr(text, '\'', (size_t)(end - text)))) {
+		append_text(buffer, text, (size_t)(quote - text));
+		append_text(buffer, "'\\''", 4);
+		text = &quote[1];
+	}
+	append_text(buffer, text, (size_t)(end - text));
+	append_text(buffer, "'", 1);
+}
+
+
+int64_t
+evaluate_arithmetic_argument(struct argument *argument)
+{
+	struct interpreter_state *expression = argument->command;
+	struct text_buffer text = {NULL, 0, 0};
+	int64_t value;
+	size_t i;
+
+	if (is_arithmetic_expression_compiled(expression))
+		return evaluate_arithmetic_expression(expression, NULL, argument->line_number);
+
+	for (i = 0; i < expression->narguments; i++)
+		expand_parts(expression->arguments[i], &text, EXPAND_ARITHMETIC, 0);
+	append_text(&text, "", 0);
+	value = evaluate_arithmetic_expression(expression, text.text, argument->line_number);
+	free(text.text);
+	return value;
+}
+
+
+static void
+expand_arithmetic_expression(struct argument *argument, struct text_buffer *out)
+{
+	append_integer(out, evaluate_arithmetic_argument(argument));
+}
+
+
+static void
+expand_part(struct argument *argument, struct text_buffer *out, enum expansion_mode mode, int quoted)
+{
+	struct text_buffer temporary = {NULL, 0, 0};
+	const char *value;
+	size_t i, length;
+
+	switch (argument->type) {
+	case QUOTED:
+		if (mode == EXPAND_PATTERN)
+			append_pattern_literal(out, argument->text, argument->length);
+		else
+			append_text(out, argument->text, argument->length);
+		break;
+
+	case UNQUOTED:
+		if (mode == EXPAND_PATTERN && quoted)
+			append_pattern_literal(out, argument->text, argument->length);
+		else
+			append_text(out, argument->text, argument->length);
+		break;
+
+	case VARIABLE:
+		value = get_variable_value(argument->variable, &length, &variable_copy);
+		if (!value)
+			break;
+		if (mode == EXPAND_PATTERN && quoted)
+			append_pattern_literal(out, value, length);
+		else
+			append_text(out, value, length);
+		break;
+
+	case QUOTE_EXPRESSION:
+		for (i = 0; i < argument->command->narguments; i++)
+			expand_parts(argument->command->arguments[i], out, mode, 1);
+		break;
+
+	case VARIABLE_SUBSTITUTION:
+		if (mode == EXPAND_PATTERN && quoted) {
+			temporary.length = 0;
+			expand_variable_substitution(argument->command, &temporary, argument->line_number);
+			append_pattern_literal(out, temporary.text, temporary.length);
+		} else {
+			expand_variable_substitution(argument->command, out, argument->line_number);
+		}
+		break;
+
+	case ARITHMETIC_EXPRESSION:
+		if (mode == EXPAND_ARITHMETIC) {
+			/* parenthesised sub-expression, see compile_arithmetic_expression() */
+			append_text(out, "(", 1);
+			for (i = 0; i < argument->command->narguments; i++)
+				expand_parts(argument->command->arguments[i], out, mode, quoted);
+			append_text(out, ")", 1);
+		} else {
+			expand_arithmetic_expression(argument, out);
+		}
+		break;
+
+	case PROCESS_SUBSTITUTION_INPUT:
+	case PROCESS_SUBSTITUTION_OUTPUT:
+	case PROCESS_SUBSTITUTION_INPUT_OUTPUT:
+		append_text(out, "/dev/fd/", sizeof("/dev/fd/") - 1);
+		append_integer(out, start_process_substitution(argument));
+		break;
+
+	case BACKQUOTE_EXPRESSION:
+	case SUBSHELL_SUBSTITUTION:
+		if (mode == EXPAND_PATTERN && quoted) {
+			temporary.length = 0;
+			expand_command_substitution(argument, &temporary);
+			append_pattern_literal(out, temporary.text, temporary.length);
+		} else {
+			expand_command_substitution(argument, out);
+		}
+		break;
+
+	default:
+		abort();
+	}
+
+	free(temporary.text);
+}
+
+
+static void
+expand_parts(struct argument *argument, struct text_buffer *out, enum expansion_mode mode, int quoted)
+{
+	for (; argument; argument = argument->next_part)
+		expand_part(argument, out, mode, quoted);
+}
+
+
+void
+expand_text_argument(struct argument *argument, struct text_buffer *out, enum expansion_mode mode)
+{
+	expand_parts(argument, out, mode, 0);
+	append_text(out, "", 0);
+}
+
+
+static void
+expand_operand(struct argument **arguments, size_t narguments, struct text_buffer *out, enum expansion_mode mode)
+{
+	size_t i;
+
+	for (i = 0; i < narguments; i++)
+		expand_parts(arguments[i], out, mode, 0);
+	append_text(out, "", 0);
+}
+
+
+static const struct pattern *
+get_pattern(struct interpreter_state *bracket, struct argument **arguments, size_t narguments)
+{
+	struct text_buffer text = {NULL, 0, 0};
+
+	/* the pattern is compiled once per site, and only
+	 * recompiled if a substitution in it changed value */
+	expand_operand(arguments, narguments, &text, EXPAND_PATTERN);
+	if (!pattern_compiled_from(bracket->pattern, text.text, text.length)) {
+		free_pattern(bracket->pattern);
+		bracket->pattern = compile_pattern(text.text, text.length);
+	}
+	free(text.text);
+	return bracket->pattern;
+}
+
+
+static void
+replace_pattern(struct interpreter_state *bracket, const char *op, const char *value, size_t length,
+                struct argument **pattern_operand, size_t pattern_length,
+                struct argument **replacement_operand, size_t replacement_length, struct text_buffer *out)
+{
+	struct text_buffer replacement = {NULL, 0, 0};
+	const struct pattern *pattern;
+	size_t offset = 0, start, end;
+	int found;
+
+	pattern = get_pattern(bracket, pattern_operand, pattern_length);
+
+	do {
+		if (op[1] == '#') {
+			found = !offset && find_pattern_prefix(pattern, value, length, 1, &end);
+			start = 0;
+		} else if (op[1] == '%') {
+			found = !offset && find_pattern_suffix(pattern, value, length, 1, &start);
+			end = length;
+		} else {
+			found = find_pattern(pattern, &value[offset], length - offset, &start, &end);
+			start += offset;
+			end += offset;
+		}
+		if (!found)
+			break;
+
+		if (!replacement.text)
+			expand_operand(replacement_operand, replacement_length, &replacement, EXPAND_TEXT);
+		append_text(out, &value[offset], start - offset);
+		append_text(out, replacement.text, replacement.length);
+		offset = end;
+		if (start == end) {
+			/* an empty match must not stop progress */
+			if (offset == length)
+				break;
+			append_text(out, &value[offset++], 1);
+		}
+	} while (op[1] == '/');
+
+	append_text(out, &value[offset], length - offset);
+	free(replacement.text);
+}
+
+
+static void
+get_substring(const char *value, size_t length, struct argument **offset_operand, size_t offset_length,
+              struct argument **length_operand, size_t length_length, int have_length,
+              size_t line_number, struct text_buffer *out)
+{
+	struct text_buffer text = {NULL, 0, 0};
+	int64_t offset, count;
+
+	expand_operand(offset_operand, offset_length, &text, EXPAND_ARITHMETIC);
+	offset = evaluate_arithmetic_text(text.text, line_number);
+	if (offset < 0)
+		offset = (int64_t)length + offset < 0 ? (int64_t)length : (int64_t)length + offset;
+	if (offset > (int64_t)length)
+		offset = (int64_t)length;
+
+	count = (int64_t)length - offset;
+	if (have_length) {
+		text.length = 0;
+		expand_operand(length_operand, length_length, &text, EXPAND_ARITHMETIC);
+		count = evaluate_arithmetic_text(text.text, line_number);
+		if (count < 0) {
+			count = (int64_t)length + count - offset;
+			if (count < 0)
+				eprintf("substring expression < 0 at line %zu\n", line_number);
+		}
+		count = MIN(count, (int64_t)length - offset);
+	}
+
+	free(text.text);
+	append_text(out, &value[offset], (size_t)count);
+}
+
+
+static void
+convert_case(struct interpreter_state *bracket, const char *op, const char *value, size_t length,
+             struct argument **pattern_operand, size_t pattern_length, struct text_buffer *out)
+{
+	const struct pattern *pattern = NULL;
+	size_t i, n;
+	char *text;
+	int c;
+
+	if (pattern_length)
+		pattern = get_pattern(bracket, pattern_operand, pattern_length);
+
+	text = reserve_text(out, length);
+	memcpy(text, value, length);
+	out->length += length;
+	out->text[out->length] = '\0';
+
+	/* ^ and , only convert the first character */
+	n = op[1] ? length : MIN(length, 1);
+	for (i = 0; i < n; i++) {
+		if (pattern && !match_pattern(pattern, &text[i], 1))
+			continue;
+		c = (unsigned char)text[i];
+		text[i] = (char)(op[0] == '^' ? toupper(c) : tolower(c));
+	}
+}
+
+
+static void
+transform_value(const char *name, const char *op, const char *value, size_t length, size_t line_number, struct text_buffer *out)
+{
+	size_t i, start = out->length;
+
+	switch (op[0]) {
+	case 'U':
+	case 'L':
+		append_text(out, value, length);
+		for (i = start; i < out->length; i++)
+			out->text[i] = (char)(op[0] == 'U' ? toupper((unsigned char)out->text[i]) : tolower((unsigned char)out->text[i]));
+		break;
+
+	case 'u':
+		append_text(out, value, length);
+		if (length)
+			out->text[start] = (char)toupper((unsigned char)out->text[start]);
+		break;
+
+	case 'Q':
+	case 'K':
+		append_quoted(out, value, length);
+		break;
+
+	case 'E':
+		append_text(out, value, length);
+		out->length = start + decode_escapes(&out->text[start], length, line_number);
+		out->text[out->length] = '\0';
+		break;
+
+	case 'A':
+		append_text(out, name, strlen(name));
+		append_text(out, "=", 1);
+		append_quoted(out, value, length);
+		break;
+
+	case 'a':
+		/* no variable attributes are implemented */
+		break;
+
+	case 'P':
+		/* prompt expansion is not implemented, the value is used as is */
+		append_text(out, value, length);
+		break;
+
+	default:
+		abort();
+	}
+}
+
+
+void
+expand_variable_substitution(struct interpreter_state *bracket, struct text_buffer *out, size_t line_number)
+{
+	struct argument **arguments = bracket->arguments, **operand, **second_operand = NULL;
+	size_t narguments = bracket->narguments, i = 0, noperand, nsecond_operand = 0;
+	const char *prefix = "", *op = "", *name, *value;
+	struct text_buffer text = {NULL, 0, 0}, copy = {NULL, 0, 0}, indirect = {NULL, 0, 0};
+	struct variable *variable;
+	size_t length, start, end;
+	int condition;
+
+	if (arguments[i]->type == OPERATOR)
+		prefix = arguments[i++]->text;
+	name = arguments[i]->text;
+	variable = arguments[i]->variable;
+	i++;
+	if (i < narguments && arguments[i]->type == OPERATOR)
+		op = arguments[i++]->text;
+
+	operand = &arguments[i];
+	for (; i < narguments; i++) {
+		if (arguments[i]->type == OPERATOR) {
+			second_operand = &arguments[i + 1];
+			nsecond_operand = narguments - (i + 1);
+			break;
+		}
+	}
+	noperand = (size_t)(&arguments[i] - operand);
+
+	if (prefix[0] == '!') {
+		if (op[0] == '*' || op[0] == '@')
+			eprintf("${!prefix%s} (at line %zu) has not been implemented yet\n", op, line_number);
+		/* indirection */
+		value = get_variable_value(variable, &length, &indirect);
+		if (value) {
+			name = value;
+			variable = get_variable_slot(name, length);
+		}
+	}
+
+	value = get_variable_value(variable, &length, &copy);
+	condition = !!value;
+	if (!value)
+		value = "";
+
+	if (prefix[0] == '#') {
+		append_integer(out, (int64_t)length);
+		goto out;
+	}
+
+	switch (op[0]) {
+	case '\0':
+		append_text(out, value, length);
+		break;
+
+	case ':':
+		if (!op[1]) {
+			get_substring(value, length, operand, noperand, second_operand, nsecond_operand,
+			              !!second_operand, line_number, out);
+			break;
+		}
+		/* fall through */
+	case '-':
+	case '=':
+	case '?':
+	case '+':
+		condition = condition && (op[0] != ':' || length);
+		op = &op[op[0] == ':'];
+		if (op[0] == '+') {
+			if (condition)
+				expand_operand(operand, noperand, out, EXPAND_TEXT);
+		} else if (condition) {
+			append_text(out, value, length);
+		} else if (op[0] == '-') {
+			expand_operand(operand, noperand, out, EXPAND_TEXT);
+		} else if (op[0] == '=') {
+			start = out->length;
+			expand_operand(operand, noperand, out, EXPAND_TEXT);
+			set_variable(variable, &out->text[start], out->length - start);
+		} else {
+			expand_operand(operand, noperand, &text, EXPAND_TEXT);
+			eprintf("%s: %s\n", name, text.length ? text.text : "parameter null or not set");
+		}
+		break;
+
+	case '#':
+		if (!find_pattern_prefix(get_pattern(bracket, operand, noperand), value, length, !!op[1], &start))
+			start = 0;
+		append_text(out, &value[start], length - start);
+		break;
+
+	case '%':
+		if (!find_pattern_suffix(get_pattern(bracket, operand, noperand), value, length, !!op[1], &end))
+			end = length;
+		append_text(out, value, end);
+		break;
+
+	case '/':
+		if (!noperand && !second_operand) {
+			append_text(out, value, length);
+			break;
+		}
+		replace_pattern(bracket, op, value, length, operand, noperand, second_operand, nsecond_operand, out);
+		break;
+
+	case '^':
+	case ',':
+		convert_case(bracket, op, value, length, operand, noperand, out);
+		break;
+
+	case '@':
+		transform_value(name, operand[0]->text, value, length, line_number, out);
+		break;
+
+	default:
+		abort();
+	}
+
+out:
+	free(text.text);
+	free(copy.text);
+	free(indirect.text);
+}
+
+
+int
+is_assignment(const struct argument *argument)
+{
+	const char *s = argument->text;
+
+	if (argument->type != UNQUOTED || (!isalpha(*s) && *s != '_'))
+		return 0;
+	while (isalnum(*s) || *s == '_')
+		s++;
+	return *s == '=';
+}
+
+
+PURE_FUNC
+static size_t
+measure_literal_word(const struct argument *argument)
+{
+	const struct argument *part;
+	size_t length = 0, i;
+
+	/* returns SIZE_MAX unless the word expands to itself,
+	 * without field splitting, pathname or tilde expansion */
+	for (part = argument; part; part = part->next_part) {
+		switch (part->type) {
+		case UNQUOTED:
+			if (strpbrk(part->text, "*?[") || (part == argument && part->text[0] == '~'))
+				return SIZE_MAX;
+			/* fall through */
+		case QUOTED:
+			length += part->length;
+			break;
+
+		case QUOTE_EXPRESSION:
+			for (i = 0; i < part->command->narguments; i++) {
+				if ((part->command->arguments[i]->type != QUOTED &&
+				     part->command->arguments[i]->type != UNQUOTED) ||
+				    part->command->arguments[i]->next_part)
+					return SIZE_MAX;
+				length += part->command->arguments[i]->length;
+			}
+			break;
+
+		default:
+			return SIZE_MAX;
+		}
+	}
+
+	return length;
+}
+
+
+static char *
+copy_literal_word(char *out, const struct argument *argument)
+{
+	size_t i;
+
+	for (; argument; argument = argument->next_part) {
+		if (argument->type == QUOTE_EXPRESSION) {
+			for (i = 0; i < argument->command->narguments; i++) {
+				memcpy(out, argument->command->arguments[i]->text, argument->command->arguments[i]->length);
+				out += argument->command->arguments[i]->length;
+			}
+		} else {
+			memcpy(out, argument->text, argument->length);
+			out += argument->length;
+		}
+	}
+
+	*out++ = '\0';
+	return out;
+}
+
+
+void
+prebuild_command_argv(struct command *command)
+{
+	size_t size, length, i;
+	char *text;
+
+	/* Most commands in loops are fully literal, so their argv
+	 * is built once, in a single allocation, rather than each
+	 * time the command is run, see build_command_argv() */
+	if (!command || !command->narguments || is_assignment(command->arguments[0]))
+		return;
+
+	size = (command->narguments + 1) * sizeof(*command->argv);
+	for (i = 0; i < command->narguments; i++) {
+		length = measure_literal_word(command->arguments[i]);
+		if (length == SIZE_MAX)
+			return;
+		size += length + 1;
+	}
+
+	command->argv = emalloc(size);
+	text = (char *)&command->argv[command->narguments + 1];
+	for (i = 0; i < command->narguments; i++) {
+		command->argv[i] = text;
+		text = copy_literal_word(text, command->arguments[i]);
+	}
+	command->argv[command->narguments] = NULL;
+}
+
+
+static struct field_segment *
+push_segment(struct field_segment **segmentsp, size_t *sizep, size_t *nsegmentsp)
+{
+	if (*nsegmentsp == *sizep)
+		*segmentsp = erealloc(*segmentsp, (*sizep = *sizep ? *sizep * 2 : 8) * sizeof(**segmentsp));
+	return memset(&(*segmentsp)[(*nsegmentsp)++], 0, sizeof(**segmentsp));
+}
+
+
+PURE_FUNC
+static int
+is_all_parameters(const struct argument *argument)
+{
+	return argument->type == VARIABLE && argument->variable->name_length == 1 && argument->variable->name[0] == '@';
+}
+
+
+PURE_FUNC
+static int
+have_all_parameters(const struct argument *argument)
+{
+	const struct argument *part;
+	size_t i;
+
+	for (i = 0; i < argument->command->narguments; i++)
+		for (part = argument->command->arguments[i]; part; part = part->next_part)
+			if (is_all_parameters(part))
+				return 1;
+	return 0;
+}
+
+
+static void
+expand_all_parameters(struct argument *argument, struct text_buffer *out,
+                      struct field_segment **segmentsp, size_t *sizep, size_t *nsegmentsp)
+{
+	struct field_segment *segment;
+	struct argument *part;
+	char **parameters;
+	size_t nparameters, i, j;
+
+	/* "$@" is a field per positional parameter, not $@ (which is
+	 * the parameters joined with spaces, as $*), and no field at all
+	 * if there are none; the fields are separated by a byte in a
+	 * segment of its own, which split_fields() terminates them at */
+	nparameters = get_positional_parameters(&parameters);
+	for (i = 0; i < argument->command->narguments; i++) {
+		for (part = argument->command->arguments[i]; part; part = part->next_part) {
+			if (!is_all_parameters(part)) {
+				segment = push_segment(segmentsp, sizep, nsegmentsp);
+				segment->start = out->length;
+				expand_part(part, out, EXPAND_TEXT, 1);
+				segment->end = out->length;
+				segment->quoted = !!nparameters;
+				continue;
+			}
+			for (j = 0; j < nparameters; j++) {
+				if (j) {
+					segment = push_segment(segmentsp, sizep, nsegmentsp);
+					segment->start = out->length;
+					append_text(out, " ", 1);
+					segment->end = out->length;
+					segment->separator = 1;
+				}
+				segment = push_segment(segmentsp, sizep, nsegmentsp);
+				segment->start = out->length;
+				append_text(out, parameters[j], strlen(parameters[j]));
+				segment->end = out->length;
+				segment->quoted = 1;
+			}
+		}
+	}
+}
+
+
+static size_t
+expand_word(struct argument *argument, struct text_buffer *out, struct field_segment **segmentsp, size_t *sizep)
+{
+	struct field_segment *segment;
+	size_t nsegments = 0;
+
+	/* records which parts of the expansion are subject to field splitting */
+	for (; argument; argument = argument->next_part) {
+		if (argument->type == QUOTE_EXPRESSION && have_all_parameters(argument)) {
+			expand_all_parameters(argument, out, segmentsp, sizep, &nsegments);
+			continue;
+		}
+		segment = push_segment(segmentsp, sizep, &nsegments);
+		segment->start = out->length;
+		expand_part(argument, out, EXPAND_TEXT, 0);
+		segment->end = out->length;
+		segment->quoted = (argument->type == QUOTED || argument->type == QUOTE_EXPRESSION);
+		segment->splittable = (argument->type == VARIABLE ||
+		                       argument->type == VARIABLE_SUBSTITUTION ||
+		                       argument->type == ARITHMETIC_EXPRESSION ||
+		                       argument->type == BACKQUOTE_EXPRESSION ||
+		                       argument->type == SUBSHELL_SUBSTITUTION);
+	}
+
+	append_text(out, "", 0);
+	return nsegments;
+}
+
+
+PURE_FUNC
+static int
+have_unquoted_pattern(const char *text, const struct field_segment *segments, size_t nsegments)
+{
+	size_t i, j;
+
+	for (i = 0; i < nsegments; i++)
+		if (!segments[i].quoted)
+			for (j = segments[i].start; j < segments[i].end; j++)
+				if (text[j] == '*' || text[j] == '?' || text[j] == '[')
+					return 1;
+	return 0;
+}
+
+
+char **
+build_command_argv(struct command *command, struct arena *arena, size_t *argcp)
+{
+	/* reused for every word */
+	static struct text_buffer word = {NULL, 0, 0};
+	static struct field_segment *segments = NULL;
+	static size_t segments_size = 0;
+	static struct field_list fields = {NULL, 0, 0};
+	char **argv, *text;
+	size_t i, nsegments, first;
+
+	if (command->argv) {
+		*argcp = command->narguments;
+		return command->argv;
+	}
+
+	/* the words are expanded into the scratch buffer, and then
+	 * copied into the arena, where they are split in place, and
+	 * which the caller resets when the command has been spawned,
+	 * so nothing is allocated or freed per word or field */
+	fields.nfields = 0;
+	for (i = 0; i < command->narguments; i++) {
+		word.length = 0;
+		nsegments = expand_word(command->arguments[i], &word, &segments, &segments_size);
+		text = arena_strndup(arena, word.text, word.length);
+		first = fields.nfields;
+		split_fields(text, segments, nsegments, &fields);
+		if (have_unquoted_pattern(text, segments, nsegments))
+			expand_pathname_fields(text, segments, nsegments, &fields, first, arena);
+	}
+
+	argv = arena_alloc(arena, (fields.nfields + 1) * sizeof(*argv));
+	memcpy(argv, fields.fields, fields.nfields * sizeof(*argv));
+	argv[fields.nfields] = NULL;
+	*argcp = fields.nfields;
+
+	return argv;
+}
+
+
+size_t
+measure_command_argv(const struct command *command)
+{
+	size_t size, i;
+
+	if (!command->argv)
+		return 0;
+
+	size = (command->narguments + 1) * sizeof(*command->argv);
+	for (i = 0; i < command->narguments; i++)
+		size += strlen(command->argv[i]) + 1;
+	return size;
+}
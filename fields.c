@@ -0,0 +1,182 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+#if defined(__SSE2__) && defined(__GNUC__)
+# include <emmintrin.h>
+#endif
+
+
+#define IN_BYTE_SET(SET, C) ((SET)[(unsigned char)(C) >> 6] >> ((unsigned char)(C) & 63) & 1)
+#define ADD_TO_BYTE_SET(SET, C) ((SET)[(unsigned char)(C) >> 6] |= (uint64_t)1 << ((unsigned char)(C) & 63))
+
+
+struct ifs_table {
+	uint64_t delimiters[4]; /* every byte in IFS */
+	uint64_t whitespace[4]; /* bytes in IFS that are IFS white space */
+	char is_default; /* exactly space, tab, and newline */
+	char *source; /* the value the table was built from */
+	size_t length;
+};
+
+static struct ifs_table ifs_table;
+static struct variable *ifs_variable;
+
+
+static const struct ifs_table *
+get_ifs_table(void)
+{
+	static struct text_buffer copy;
+	const char *value = " \t\n", *ifs; /* unset IFS behaves as the default */
+	size_t length = 3, ifs_length, i;
+	uint64_t default_set[4] = {0, 0, 0, 0};
+
+	/* variable slots are never freed, so it is only looked up once,
+	 * and the table is only rebuilt when the value of IFS changes */
+	if (!ifs_variable)
+		ifs_variable = get_variable_slot("IFS", 3);
+	ifs = get_variable_value(ifs_variable, &ifs_length, &copy);
+	if (ifs) {
+		value = ifs;
+		length = ifs_length;
+	}
+	if (ifs_table.source && ifs_table.length == length && !memcmp(ifs_table.source, value, length))
+		return &ifs_table;
+
+	free(ifs_table.source);
+	memset(&ifs_table, 0, sizeof(ifs_table));
+	ifs_table.source = emalloc(length + 1);
+	memcpy(ifs_table.source, value, length);
+	ifs_table.source[length] = '\0';
+	ifs_table.length = length;
+
+	for (i = 0; i < length; i++) {
+		ADD_TO_BYTE_SET(ifs_table.delimiters, value[i]);
+		if (value[i] == ' ' || value[i] == '\t' || value[i] == '\n')
+			ADD_TO_BYTE_SET(ifs_table.whitespace, value[i]);
+	}
+
+	ADD_TO_BYTE_SET(default_set, ' ');
+	ADD_TO_BYTE_SET(default_set, '\t');
+	ADD_TO_BYTE_SET(default_set, '\n');
+	ifs_table.is_default = !memcmp(ifs_table.delimiters, default_set, sizeof(default_set));
+
+	return &ifs_table;
+}
+
+
+static char *
+find_delimiter(const struct ifs_table *table, char *s, char *end)
+{
+#if defined(__SSE2__) && defined(__GNUC__)
+	__m128i space, tab, newline, block;
+	int mask;
+
+	/* the default IFS is by far the most common, and command
+	 * output can be large, so it is searched 16 bytes at a time */
+	if (table->is_default) {
+		space = _mm_set1_epi8(' ');
+		tab = _mm_set1_epi8('\t');
+		newline = _mm_set1_epi8('\n');
+		for (; end - s >= 16; s += 16) {
+			block = _mm_loadu_si128((const void *)s);
+			mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, space),
+			                                                   _mm_cmpeq_epi8(block, tab)),
+			                                      _mm_cmpeq_epi8(block, newline)));
+			if (mask)
+				return &s[__builtin_ctz((unsigned int)mask)];
+		}
+	}
+#endif
+
+	for (; s != end; s++)
+		if (IN_BYTE_SET(table->delimiters, *s))
+			break;
+	return s;
+}
+
+
+void
+push_field(struct field_list *fields, char *field)
+{
+	if (fields->nfields == fields->size)
+		fields->fields = erealloc(fields->fields, (fields->size = fields->size ? fields->size * 2 : 16) *
+		                                          sizeof(*fields->fields));
+	fields->fields[fields->nfields++] = field;
+}
+
+
+void
+split_fields(char *text, const struct field_segment *segments, size_t nsegments, struct field_list *fields)
+{
+	const struct ifs_table *table = NULL;
+	char *field = NULL, *s, *end;
+	int after_whitespace = 0;
+	size_t i;
+
+	/* The fields are left in place in text, which is modified
+	 * to terminate each field by overwriting the delimiter that
+	 * ends it, so no field is copied; a field can only end at a
+	 * delimiter, at a separator, or at the end of text, all of
+	 * which are writable */
+	for (i = 0; i < nsegments; i++) {
+		s = &text[segments[i].start];
+		end = &text[segments[i].end];
+
+		if (segments[i].separator) {
+			*s = '\0';
+			push_field(fields, field ? field : s);
+			field = NULL;
+			after_whitespace = 0;
+			continue;
+		}
+
+		if (!segments[i].splittable) {
+			if (segments[i].quoted || s != end) {
+				if (!field)
+					field = s;
+				after_whitespace = 0;
+			}
+			continue;
+		}
+
+		if (!table)
+			table = get_ifs_table();
+
+		while (s != end) {
+			if (!IN_BYTE_SET(table->delimiters, *s)) {
+				if (!field)
+					field = s;
+				after_whitespace = 0;
+				s = find_delimiter(table, s, end);
+				if (s == end)
+					break;
+			}
+
+			if (IN_BYTE_SET(table->whitespace, *s)) {
+				/* a run of IFS white space is one delimiter, and
+				 * is ignored at the beginning and end of text */
+				if (field) {
+					*s = '\0';
+					push_field(fields, field);
+					field = NULL;
+					after_whitespace = 1;
+				}
+			} else {
+				/* other IFS bytes delimit a field even if it is empty,
+				 * but absorb IFS white space adjacent to them */
+				if (field) {
+					*s = '\0';
+					push_field(fields, field);
+					field = NULL;
+				} else if (!after_whitespace) {
+					*s = '\0';
+					push_field(fields, s);
+				}
+				after_whitespace = 0;
+			}
+			s++;
+		}
+	}
+
+	if (field)
+		push_field(fields, field);
+}
@@ -0,0 +1,429 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+#include <sys/syscall.h>
+#include <dirent.h>
+
+
+#define IS_PATTERN_SPECIAL(C) ((C) == '*' || (C) == '?' || (C) == '[' || (C) == ']' || (C) == '\\')
+
+
+/* Directory listings are cached until flush_directory_cache() is
+ * called at the end of a command list, so that a loop that globs
+ * the same directory over and over only lists it once; a listing
+ * is discarded if the directory has been modified since it was read */
+
+struct directory_entry {
+	const char *name;
+	size_t length;
+	unsigned char type; /* DT_*, DT_UNKNOWN if not provided */
+	char *collation_key; /* from strxfrm(3), computed when first needed */
+};
+
+struct directory_listing {
+	char *path;
+	size_t path_length;
+	size_t hash;
+	dev_t device;
+	ino_t inode;
+	struct timespec mtime;
+	char *names;
+	struct directory_entry *entries;
+	size_t nentries;
+	struct directory_listing *next; /* in hash bucket */
+};
+
+struct glob_state {
+	struct text_buffer path; /* unescaped, the directory being searched */
+	struct field_list *results;
+	struct arena *arena;
+};
+
+#if defined(SYS_getdents64)
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short int d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+#endif
+
+static struct directory_listing **listing_table;
+static size_t listing_table_size;
+static size_t nlistings;
+
+
+PURE_FUNC
+static size_t
+hash_path(const char *path, size_t length)
+{
+	size_t hash = 5381;
+	while (length--)
+		hash = (hash << 5) + hash + (unsigned char)*path++;
+	return hash;
+}
+
+
+static void
+free_listing(struct directory_listing *listing)
+{
+	size_t i;
+
+	for (i = 0; i < listing->nentries; i++)
+		free(listing->entries[i].collation_key);
+	free(listing->entries);
+	free(listing->names);
+	free(listing->path);
+	free(listing);
+}
+
+
+void
+flush_directory_cache(void)
+{
+	struct directory_listing *listing, *next;
+	size_t i;
+
+	if (!nlistings)
+		return;
+
+	for (i = 0; i < listing_table_size; i++) {
+		for (listing = listing_table[i]; listing; listing = next) {
+			next = listing->next;
+			free_listing(listing);
+		}
+		listing_table[i] = NULL;
+	}
+	nlistings = 0;
+}
+
+
+static void
+grow_listing_table(void)
+{
+	struct directory_listing **old_table = listing_table, *listing, *next;
+	size_t old_size = listing_table_size, i, bucket;
+
+	listing_table_size = old_size ? old_size * 2 : 16;
+	listing_table = ecalloc(listing_table_size, sizeof(*listing_table));
+
+	for (i = 0; i < old_size; i++) {
+		for (listing = old_table[i]; listing; listing = next) {
+			next = listing->next;
+			bucket = listing->hash & (listing_table_size - 1);
+			listing->next = listing_table[bucket];
+			listing_table[bucket] = listing;
+		}
+	}
+
+	free(old_table);
+}
+
+
+struct listing_builder {
+	size_t names_size;
+	size_t names_length;
+	size_t entries_size;
+};
+
+
+static void
+add_directory_entry(struct directory_listing *listing, struct listing_builder *b, const char *name, unsigned char type)
+{
+	size_t length;
+
+	if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+		return;
+	length = strlen(name);
+
+	if (b->names_length + length + 1 > b->names_size) {
+		b->names_size = MAX(b->names_size * 2, b->names_length + length + 1);
+		listing->names = erealloc(listing->names, b->names_size);
+	}
+	memcpy(&listing->names[b->names_length], name, length + 1);
+
+	if (listing->nentries == b->entries_size) {
+		b->entries_size = b->entries_size ? b->entries_size * 2 : 64;
+		listing->entries = erealloc(listing->entries, b->entries_size * sizeof(*listing->entries));
+	}
+	/* .name is an offset until .names stops moving */
+	listing->entries[listing->nentries].name = (const char *)(uintptr_t)b->names_length;
+	listing->entries[listing->nentries].length = length;
+	listing->entries[listing->nentries].type = type;
+	listing->entries[listing->nentries].collation_key = NULL;
+	listing->nentries += 1;
+	b->names_length += length + 1;
+}
+
+
+static void
+read_directory(struct directory_listing *listing, int fd)
+{
+	struct listing_builder b = {0, 0, 0};
+	size_t i;
+#if defined(SYS_getdents64)
+	static char *buffer = NULL;
+	struct linux_dirent64 *dirent;
+	long int r, offset;
+
+	/* large batches, to keep the number of system calls
+	 * low for directories with hundreds of thousands of files */
+	if (!buffer)
+		buffer = emalloc(GLOB_GETDENTS_BUFFER_SIZE);
+	while ((r = syscall(SYS_getdents64, fd, buffer, GLOB_GETDENTS_BUFFER_SIZE)) > 0) {
+		for (offset = 0; offset < r; offset += dirent->d_reclen) {
+			dirent = (void *)&buffer[offset];
+			add_directory_entry(listing, &b, dirent->d_name, dirent->d_type);
+		}
+	}
+#else
+	struct dirent *dirent;
+	DIR *dir;
+
+	dir = fdopendir(dup(fd));
+	if (!dir)
+		return;
+	while ((dirent = readdir(dir)))
+		add_directory_entry(listing, &b, dirent->d_name, dirent->d_type);
+	closedir(dir);
+#endif
+
+	for (i = 0; i < listing->nentries; i++)
+		listing->entries[i].name = &listing->names[(uintptr_t)listing->entries[i].name];
+}
+
+
+static struct directory_listing *
+get_directory_listing(const char *path, size_t path_length)
+{
+	struct directory_listing **listingp, *listing;
+	struct stat st;
+	size_t hash;
+	int fd;
+
+	fd = open(path_length ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return NULL;
+	}
+
+	if (nlistings >= listing_table_size / 4 * 3)
+		grow_listing_table();
+
+	hash = hash_path(path, path_length);
+	listingp = &listing_table[hash & (listing_table_size - 1)];
+	for (; *listingp; listingp = &(*listingp)->next)
+		if ((*listingp)->hash == hash && (*listingp)->path_length == path_length &&
+		    !memcmp((*listingp)->path, path, path_length))
+			break;
+
+	listing = *listingp;
+	if (listing) {
+		if (listing->device == st.st_dev && listing->inode == st.st_ino &&
+		    listing->mtime.tv_sec == st.st_mtim.tv_sec && listing->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+			close(fd);
+			return listing;
+		}
+		*listingp = listing->next;
+		free_listing(listing);
+		nlistings -= 1;
+	}
+
+	listing = ecalloc(1, sizeof(*listing));
+	listing->path = emalloc(path_length + 1);
+	memcpy(listing->path, path, path_length);
+	listing->path[path_length] = '\0';
+	listing->path_length = path_length;
+	listing->hash = hash;
+	listing->device = st.st_dev;
+	listing->inode = st.st_ino;
+	listing->mtime = st.st_mtim;
+	read_directory(listing, fd);
+	close(fd);
+
+	listing->next = listing_table[hash & (listing_table_size - 1)];
+	listing_table[hash & (listing_table_size - 1)] = listing;
+	nlistings += 1;
+	return listing;
+}
+
+
+static const char *
+get_collation_key(struct directory_entry *entry)
+{
+	size_t size;
+
+	if (!entry->collation_key) {
+		size = strxfrm(NULL, entry->name, 0) + 1;
+		entry->collation_key = emalloc(size);
+		strxfrm(entry->collation_key, entry->name, size);
+	}
+	return entry->collation_key;
+}
+
+
+static int
+collation_key_cmp(const void *a, const void *b)
+{
+	return strcmp((*(struct directory_entry *const *)a)->collation_key,
+	              (*(struct directory_entry *const *)b)->collation_key);
+}
+
+
+static int
+is_directory(struct glob_state *g, const struct directory_entry *entry)
+{
+	struct stat st;
+
+	if (entry->type == DT_DIR)
+		return 1;
+	if (entry->type != DT_UNKNOWN && entry->type != DT_LNK)
+		return 0;
+	return !stat(g->path.text, &st) && S_ISDIR(st.st_mode);
+}
+
+
+static void
+append_path(struct text_buffer *path, const char *text, size_t length)
+{
+	if (path->length + length + 1 > path->size)
+		path->text = erealloc(path->text, path->size = MAX(path->size * 2, path->length + length + 1));
+	memcpy(&path->text[path->length], text, length);
+	path->length += length;
+	path->text[path->length] = '\0';
+}
+
+
+static void
+glob_components(struct glob_state *g, const char *pattern_text)
+{
+	struct directory_listing *listing;
+	struct directory_entry **matches;
+	struct pattern *pattern;
+	size_t length, path_length, nmatches = 0, i;
+	const char *end, *literal;
+	struct stat st;
+	int last;
+
+	while (*pattern_text == '/')
+		append_path(&g->path, pattern_text++, 1);
+
+	if (!*pattern_text) {
+		push_field(g->results, arena_strndup(g->arena, g->path.text, g->path.length));
+		return;
+	}
+
+	for (end = pattern_text; *end && *end != '/'; end++)
+		if (*end == '\\' && end[1])
+			end++;
+	last = !*end;
+
+	pattern = compile_pattern(pattern_text, (size_t)(end - pattern_text));
+	path_length = g->path.length;
+
+	if (is_literal_pattern(pattern)) {
+		/* only directories with globbing in their name are listed */
+		literal = get_literal_pattern_text(pattern, &length);
+		append_path(&g->path, literal, length);
+		free_pattern(pattern);
+		if (!last)
+			glob_components(g, end);
+		else if (!lstat(g->path.text, &st))
+			push_field(g->results, arena_strndup(g->arena, g->path.text, g->path.length));
+		g->path.length = path_length;
+		return;
+	}
+
+	listing = get_directory_listing(g->path.length ? g->path.text : "", g->path.length);
+	if (!listing) {
+		free_pattern(pattern);
+		return;
+	}
+
+	matches = emalloc(listing->nentries * sizeof(*matches) + 1);
+	for (i = 0; i < listing->nentries; i++) {
+		/* a leading period must be matched explicitly */
+		if (listing->entries[i].name[0] == '.' && *pattern_text != '.' &&
+		    !(pattern_text[0] == '\\' && pattern_text[1] == '.'))
+			continue;
+		if (match_pattern(pattern, listing->entries[i].name, listing->entries[i].length)) {
+			get_collation_key(&listing->entries[i]);
+			matches[nmatches++] = &listing->entries[i];
+		}
+	}
+	free_pattern(pattern);
+
+	/* Each level is sorted separately, with the keys cached with the
+	 * listing, which sorts the result component by component */
+	qsort(matches, nmatches, sizeof(*matches), collation_key_cmp);
+
+	for (i = 0; i < nmatches; i++) {
+		append_path(&g->path, matches[i]->name, matches[i]->length);
+		if (last)
+			push_field(g->results, arena_strndup(g->arena, g->path.text, g->path.length));
+		else if (is_directory(g, matches[i]))
+			glob_components(g, end);
+		g->path.length = path_length;
+		g->path.text[path_length] = '\0';
+	}
+
+	free(matches);
+}
+
+
+static int
+build_field_pattern(char *field, const char *text, const struct field_segment *segments, size_t nsegments,
+                    struct text_buffer *pattern)
+{
+	size_t offset = (size_t)(field - text), end = offset + strlen(field), i = 0;
+	int have_special = 0;
+
+	/* quoted bytes are escaped, so they are matched literally */
+	pattern->length = 0;
+	for (; offset < end; offset++) {
+		while (i + 1 < nsegments && segments[i].end <= offset)
+			i++;
+		if (segments[i].quoted && IS_PATTERN_SPECIAL(text[offset])) {
+			append_path(pattern, "\\", 1);
+		} else if (!segments[i].quoted && (text[offset] == '*' || text[offset] == '?' || text[offset] == '[')) {
+			have_special = 1;
+		}
+		append_path(pattern, &text[offset], 1);
+	}
+
+	return have_special;
+}
+
+
+void
+expand_pathname_fields(char *text, const struct field_segment *segments, size_t nsegments,
+                       struct field_list *fields, size_t first, struct arena *arena)
+{
+	/* reused for every word */
+	static struct text_buffer pattern = {NULL, 0, 0};
+	static struct field_list results = {NULL, 0, 0};
+	static struct glob_state g = {{NULL, 0, 0}, NULL, NULL};
+	size_t i, nresults;
+
+	/* a field can expand to many pathnames, so the results are
+	 * gathered separately, and then replace the word's fields */
+	results.nfields = 0;
+	g.results = &results;
+	g.arena = arena;
+	for (i = first; i < fields->nfields; i++) {
+		nresults = results.nfields;
+		if (build_field_pattern(fields->fields[i], text, segments, nsegments, &pattern)) {
+			g.path.length = 0;
+			append_path(&g.path, "", 0);
+			glob_components(&g, pattern.text);
+		}
+		if (results.nfields == nresults)
+			push_field(&results, fields->fields[i]); /* kept as is if nothing matched */
+	}
+
+	fields->nfields = first;
+	for (i = 0; i < results.nfields; i++)
+		push_field(fields, results.fields[i]);
+}
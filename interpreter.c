@@ -2,35 +2,8 @@
 #include "common.h"
 
 
-#define LIST_RESERVED_WORDS(_)\
-	_("!",     BANG)\
-	_("{",     OPEN_CURLY)\
-	_("}",     CLOSE_CURLY)\
-	_("case",  CASE) /* (TODO) case patterns requires update to tokeniser */\
-	_("do",    DO)\
-	_("done",  DONE)\
-	_("elif",  ELIF)\
-	_("else",  ELSE)\
-	_("esac",  ESAC)\
-	_("fi",    FI)\
-	_("for",   FOR)\
-	_("if",    IF)\
-	_("in",    IN)\
-	_("then",  THEN)\
-	_("until", UNTIL)\
-	_("while", WHILE)
-
-#define X(S, C) ,C
-enum reserved_word {
-	NOT_A_RESERVED_WORD = 0
-	LIST_RESERVED_WORDS(X)
-};
-#undef X
-
-
-PURE_FUNC
-static enum reserved_word
-get_reserved_word(struct argument *argument)
+enum reserved_word
+get_reserved_word(const struct argument *argument)
 {
 	if (argument->type != UNQUOTED || argument->next_part)
 		return NOT_A_RESERVED_WORD;
@@ -48,6 +21,7 @@ stray_command_terminal(struct command *command)
 {
 	switch (command->terminal) {
 	case DOUBLE_SEMICOLON: eprintf("stray ';;' at line %zu\n",      command->terminal_line_number); return;
+	case CLOSE_PARENTHESIS: eprintf("stray ')' at line %zu\n",      command->terminal_line_number); return;
 	case SEMICOLON:        eprintf("stray ';' at line %zu\n",       command->terminal_line_number); return;
 	case NEWLINE:          eprintf("stray <newline> at line %zu\n", command->terminal_line_number); return;
 	case AMPERSAND:        eprintf("stray '&' at line %zu\n",       command->terminal_line_number); return;
@@ -88,6 +62,145 @@ free_text_argument(struct argument **argumentp)
 }
 
 
+static void free_commands(struct command **commands, size_t ncommands, int raw);
+static void free_parser_state(struct parser_state *state);
+
+
+static void
+free_argument(struct argument *argument, int raw)
+{
+	struct argument *next_part;
+
+	for (; argument; argument = next_part) {
+		next_part = argument->next_part;
+		switch (argument->type) {
+		case QUOTED:
+		case UNQUOTED:
+		case VARIABLE:
+		case OPERATOR:
+			free(argument->text);
+			break;
+
+		case QUOTE_EXPRESSION:
+		case BACKQUOTE_EXPRESSION:
+		case ARITHMETIC_EXPRESSION:
+		case VARIABLE_SUBSTITUTION:
+		case SUBSHELL_SUBSTITUTION:
+		case PROCESS_SUBSTITUTION_INPUT:
+		case PROCESS_SUBSTITUTION_OUTPUT:
+		case PROCESS_SUBSTITUTION_INPUT_OUTPUT:
+		case SUBSHELL:
+		case ARITHMETIC_SUBSHELL:
+			if (raw) {
+				free_parser_state(argument->child);
+				break;
+			}
+			/* fall through */
+		case COMMAND:
+			destroy_interpreter_state(argument->command);
+			break;
+
+		default:
+			break;
+		}
+		free(argument);
+	}
+}
+
+
+static void
+free_redirection(struct redirection *redirection, int raw)
+{
+	if (redirection) {
+		free_argument(redirection->left_hand_side, raw);
+		free_argument(redirection->right_hand_side, raw);
+		if (redirection->here_document_fd)
+			close(redirection->here_document_fd);
+		free(redirection);
+	}
+}
+
+
+static void
+free_command(struct command *command, int raw)
+{
+	size_t i;
+
+	if (!command)
+		return;
+	for (i = 0; i < command->narguments; i++)
+		free_argument(command->arguments[i], raw);
+	for (i = 0; i < command->nredirections; i++)
+		free_redirection(command->redirections[i], raw);
+	free(command->arguments);
+	free(command->redirections);
+	free(command->argv);
+	free(command);
+}
+
+
+static void
+free_commands(struct command **commands, size_t ncommands, int raw)
+{
+	size_t i;
+
+	for (i = 0; i < ncommands; i++)
+		free_command(commands[i], raw);
+	free(commands);
+}
+
+
+static void
+free_parser_state(struct parser_state *state)
+{
+	size_t i;
+
+	free_commands(state->commands, state->ncommands, 1);
+	for (i = 0; i < state->narguments; i++)
+		free_argument(state->arguments[i], 1);
+	for (i = 0; i < state->nredirections; i++)
+		free_redirection(state->redirections[i], 1);
+	free_argument(state->current_argument, 1);
+	free(state->arguments);
+	free(state->redirections);
+	free(state);
+}
+
+
+void
+destroy_command(struct command *command)
+{
+	free_command(command, 0);
+}
+
+
+void
+destroy_parser_state(struct parser_state *state)
+{
+	free_parser_state(state);
+}
+
+
+void
+destroy_interpreter_state(struct interpreter_state *state)
+{
+	int raw = state->dealing_with == DEFERRED_FUNCTION_BODY;
+	size_t i;
+
+	free_commands(state->commands, state->ncommands, raw);
+	for (i = 0; i < state->narguments; i++)
+		free_argument(state->arguments[i], raw);
+	for (i = 0; i < state->nredirections; i++)
+		free_redirection(state->redirections[i], raw);
+	free_arithmetic_program(state->arithmetic);
+	free_pattern(state->pattern);
+	free_case_table(state->case_table);
+	free(state->arguments);
+	free(state->redirections);
+	free(state);
+}
+
+
 static void
 push_interpreted_argument(struct parser_context *ctx, struct argument *argument)
 {
@@ -107,7 +220,7 @@ push_state(struct parser_context *ctx, enum nesting_type dealing_with, size_t li
 	new_state = ecalloc(1, sizeof(*new_state));
 	new_state->parent = ctx->interpreter_state;
 	new_state->dealing_with = dealing_with;
-	new_argument = calloc(1, sizeof(*new_argument));
+	new_argument = ecalloc(1, sizeof(*new_argument));
 	new_argument->type = COMMAND;
 	new_argument->command = new_state;
 	new_argument->line_number = line_number;
@@ -139,6 +252,7 @@ push_command(struct parser_context *ctx, struct command *command)
 	ctx->interpreter_state->narguments = 0;
 	ctx->interpreter_state->have_bang = 0;
 	ctx->parser_state->commands[ctx->interpreter_offset] = NULL;
+	prebuild_command_argv(command);
 
 	ctx->interpreter_state->commands = erealloc(ctx->interpreter_state->commands,
 	                                            (ctx->interpreter_state->ncommands + 1) * 
@@ -148,10 +262,10 @@ push_command(struct parser_context *ctx, struct command *command)
 }
 
 
-static void
-interpret_nested_code(struct argument *argument, enum nesting_type dealing_with, enum interpreter_requirement requirement)
+static struct interpreter_state *
+interpret_code(struct parser_state *code, enum nesting_type dealing_with,
+               enum interpreter_requirement requirement, const char *what, size_t line_number)
 {
-	struct parser_state *code = argument->child;
 	struct parser_context ctx;
 
 	initialise_parser_context(&ctx, 0, 0);
@@ -161,15 +275,62 @@ interpret_nested_code(struct argument *argument, enum nesting_type dealing_with,
 
 	interpret_and_eliminate(&ctx);
 
-	if (ctx.parser_state->ncommands)
-		eprintf("premature end of subexpression at line %zu\n", argument->line_number);
+	/* every command is consumed, but a nested construct may be left open */
+	if (ctx.interpreter_state->parent)
+		eprintf("premature end of %s at line %zu\n", what, line_number);
 
 	free(ctx.parser_state->commands);
 	free(ctx.parser_state->arguments);
 	free(ctx.parser_state->redirections);
 
-	argument->command = ctx.interpreter_state;
+	return ctx.interpreter_state;
+}
+
+
+static void
+interpret_nested_code(struct argument *argument, enum nesting_type dealing_with, enum interpreter_requirement requirement)
+{
+	struct parser_state *code = argument->child;
+
+	argument->command = interpret_code(code, dealing_with, requirement, "subexpression", argument->line_number);
+	free(code);
+}
+
+
+static void
+defer_nested_code(struct argument *argument)
+{
+	struct parser_state *code = argument->child;
+	struct interpreter_state *deferred;
+
+	deferred = ecalloc(1, sizeof(*deferred));
+	deferred->dealing_with = DEFERRED_FUNCTION_BODY;
+	deferred->commands = code->commands;
+	deferred->ncommands = code->ncommands;
+
+	free(code->arguments);
+	free(code->redirections);
 	free(code);
+	argument->command = deferred;
+}
+
+
+void
+compile_function_body(struct argument *body)
+{
+	struct interpreter_state *deferred = body->command;
+	struct parser_state code;
+
+	if (deferred->dealing_with != DEFERRED_FUNCTION_BODY)
+		return;
+
+	memset(&code, 0, sizeof(code));
+	code.commands = deferred->commands;
+	code.ncommands = deferred->ncommands;
+
+	body->command = interpret_code(&code, body->type == SUBSHELL ? CODE_ROOT : CURLY_NESTING,
+	                               NEED_COMMAND, "function body", body->line_number);
+	free(deferred);
 }
 
 
@@ -209,12 +370,11 @@ interpret_unquoted_text(struct argument **argumentp)
 	if (!*end)
 		return;
 
-	if (end != beginning) {
-		argument->length = (size_t)(end - beginning);
-		argument->text = emalloc(argument->length + 1);
-		memcpy(argument->text, beginning, argument->length);
-		argument->text[argument->length] = '\0';
-	}
+	/* may be empty, but .text must not be left pointing to the freed text */
+	argument->length = (size_t)(end - beginning);
+	argument->text = emalloc(argument->length + 1);
+	memcpy(argument->text, beginning, argument->length);
+	argument->text[argument->length] = '\0';
 
 	do {
 		beginning = &end[1];
@@ -251,7 +411,7 @@ interpret_unquoted_text(struct argument **argumentp)
 						end = &end[1];
 				}
 			} else {
-				beginning--;
+				end = beginning--; /* the '$' is literal */
 				goto append_text;
 			}
 			break;
@@ -259,7 +419,7 @@ interpret_unquoted_text(struct argument **argumentp)
 			if (isalpha(*beginning) || *beginning == '_') {
 				for (end = &beginning[1]; isdigit(*end) || isalpha(*end) || *end == '_'; end++);
 			} else {
-				beginning--;
+				end = beginning--; /* the '$' is literal */
 				goto append_text;
 			}
 		}
@@ -272,6 +432,7 @@ interpret_unquoted_text(struct argument **argumentp)
 		argument->text = emalloc(argument->length + 1);
 		memcpy(argument->text, beginning, argument->length);
 		argument->text[argument->length] = '\0';
+		argument->variable = get_variable_slot(argument->text, argument->length);
 
 		beginning = end;
 		can_append = 0;
@@ -322,20 +483,22 @@ translate_text_argument(struct argument *argument)
 			break;
 
 		case QUOTE_EXPRESSION:
+			interpret_nested_code(argument, TEXT_ROOT, 0);
+			break;
+
 		case ARITHMETIC_EXPRESSION:
 		case ARITHMETIC_SUBSHELL:
-			/* ARITHMETIC_EXPRESSION and ARITHMETIC_SUBSHELL can only be interpreted
-			 * when evaluated as substitution can be used to insert operators */
+			/* ARITHMETIC_EXPRESSION and ARITHMETIC_SUBSHELL can only be fully interpreted
+			 * when evaluated if substitution is used as it can insert operators */
 			interpret_nested_code(argument, TEXT_ROOT, 0);
+			compile_arithmetic_expression(argument);
 			break;
 
 		case VARIABLE_SUBSTITUTION:
 			interpret_nested_code(argument, VARIABLE_SUBSTITUTION_BRACKET, NEED_PREFIX_OR_VARIABLE_NAME);
 			nested_state = argument->command;
-			if (nested_state->requirement != NEED_INDEX_OR_OPERATOR_OR_END &&
-			    nested_state->requirement != NEED_INDEX_OR_END &&
-			    nested_state->requirement != NEED_OPERATOR_OR_END &&
-			    nested_state->requirement != NEED_END) {
+			if (nested_state->requirement == NEED_PREFIX_OR_VARIABLE_NAME ||
+			    nested_state->requirement == NEED_AT_OPERAND) {
 				eprintf("invalid variable substitution at line %zu\n", argument->line_number);
 			}
 			break;
@@ -361,8 +524,9 @@ translate_text_argument(struct argument *argument)
 
 
 static void
-push_redirection(struct command *command, struct argument **argumentp)
+push_redirection(struct parser_context *ctx, struct command *command, struct argument **argumentp)
 {
+	struct interpreter_state *state = ctx->interpreter_state;
 	struct redirection *redirection;
 	struct argument *argument, *argument_end, *last_part;
 
@@ -399,6 +563,9 @@ push_redirection(struct command *command, struct argument **argumentp)
 	if (redirection->left_hand_side)
 		translate_text_argument(redirection->left_hand_side);
 	translate_text_argument(redirection->right_hand_side);
+
+	state->redirections = erealloc(state->redirections, (state->nredirections + 1) * sizeof(*state->redirections));
+	state->redirections[state->nredirections++] = redirection;
 }
 
 
@@ -430,21 +597,37 @@ push_typed_text(struct parser_context *ctx, struct argument *argument, char *tex
 {
 	struct argument *new_argument;
 
-	new_argument = ecalloc(1, sizeof(new_argument));
+	new_argument = ecalloc(1, sizeof(*new_argument));
 	new_argument->type = type;
 	new_argument->line_number = argument->line_number;
 	new_argument->length = text_length;	
 	new_argument->text = emalloc(text_length + 1);
 	memcpy(new_argument->text, text, text_length);
 	new_argument->text[text_length] = '\0';
+	if (type == VARIABLE)
+		new_argument->variable = get_variable_slot(text, text_length);
 
 	push_interpreted_argument(ctx, new_argument);
 }
 
 
 static void
-push_unquoted_segment(struct parser_context *ctx, struct argument *argument, char *text, size_t text_length) /* TODO (must handle $) */
+push_unquoted_segment(struct parser_context *ctx, struct argument *argument, char *text, size_t text_length)
 {
+	struct argument *new_argument;
+
+	new_argument = ecalloc(1, sizeof(*new_argument));
+	new_argument->type = UNQUOTED;
+	new_argument->line_number = argument->line_number;
+	new_argument->length = text_length;
+	new_argument->text = emalloc(text_length + 1);
+	memcpy(new_argument->text, text, text_length);
+	new_argument->text[text_length] = '\0';
+
+	/* splits out $name into VARIABLE parts */
+	translate_text_argument(new_argument);
+
+	push_interpreted_argument(ctx, new_argument);
 }
 
 
@@ -524,6 +707,7 @@ push_variable_substitution_argument(struct parser_context *ctx, struct command *
 					ctx->interpreter_state->requirement = NEED_OPERATOR_OR_END;
 				index:
 					/* TODO push INDEX substate that exits on ] */
+					eprintf("arrays (at line %zu) have not been implemented yet\n", line_number);
 				} else {
 				operator:
 					ctx->interpreter_state->requirement = NO_REQUIREMENT;
@@ -540,7 +724,10 @@ push_variable_substitution_argument(struct parser_context *ctx, struct command *
 							length = 1;
 					} else if (s[0] == '/' && check_extension("/", line_number)) {
 						ctx->interpreter_state->requirement = NEED_TEXT_OR_SLASH;
-						length = 1;
+						if (s[1] == '/' || s[1] == '#' || s[1] == '%')
+							length = 2;
+						else
+							length = 1;
 					} else if (s[0] == ':' && check_extension(":", line_number)) {
 						ctx->interpreter_state->requirement = NEED_TEXT_OR_COLON;
 						length = 1;
@@ -550,7 +737,7 @@ push_variable_substitution_argument(struct parser_context *ctx, struct command *
 					} else {
 						goto bad_syntax;
 					}
-					push_operator(ctx, argument, s, 2);
+					push_operator(ctx, argument, s, length);
 					s = &s[length];
 				}
 
@@ -621,7 +808,9 @@ push_variable_substitution_argument(struct parser_context *ctx, struct command *
 				}
 
 			} else {
+				length = strlen(s);
 				push_unquoted_segment(ctx, argument, s, length);
+				s = &s[length];
 			}
 		}
 		free(argument->text);
@@ -647,11 +836,97 @@ bad_syntax:
 }
 
 
+static int
+defer_command(struct parser_context *ctx, struct command *command)
+{
+	struct interpreter_state *state = ctx->interpreter_state;
+	struct argument *argument;
+	int command_position = 1, function_body_position = 0, for_position = 0;
+	size_t arg_i;
+
+	/* case patterns are not in command position */
+	if (command->terminal == CLOSE_PARENTHESIS)
+		command_position = 0;
+
+	/* Only the curly brackets need to be paired up to find the end of
+	 * the function body, so rather than interpreting the commands, we
+	 * only need to track which words are in a command position */
+	for (arg_i = 0; arg_i < command->narguments; arg_i++) {
+		argument = command->arguments[arg_i];
+		if (argument->type == FUNCTION_MARK) {
+			command_position = function_body_position = 1;
+			continue;
+		} else if (argument->type == REDIRECTION) {
+			command_position = function_body_position;
+			continue;
+		} else if (for_position) {
+			for_position -= 1;
+			command_position = (!for_position && get_reserved_word(argument) == DO);
+			continue;
+		} else if (!command_position) {
+			continue;
+		}
+		function_body_position = 0;
+
+		switch (get_reserved_word(argument)) {
+		case OPEN_CURLY:
+			state->deferred_curly_depth += 1;
+			break;
+
+		case CLOSE_CURLY:
+			if (state->deferred_curly_depth) {
+				state->deferred_curly_depth -= 1;
+				command_position = 0;
+			} else if (arg_i) {
+				stray_reserved_word(argument);
+			} else {
+				return 0;
+			}
+			break;
+
+		case FOR:
+			for_position = 2;
+			command_position = 0;
+			break;
+
+		case BANG:
+		case DO:
+		case ELIF:
+		case ELSE:
+		case IF:
+		case THEN:
+		case UNTIL:
+		case WHILE:
+			break;
+
+		default:
+			command_position = 0;
+			break;
+		}
+	}
+
+	ctx->parser_state->commands[ctx->interpreter_offset] = NULL;
+
+	if (!command->narguments && command->terminal == NEWLINE) {
+		/* newline directly after '{' */
+		free(command->arguments);
+		free(command->redirections);
+		free(command);
+		return 1;
+	}
+
+	state->commands = erealloc(state->commands, (state->ncommands + 1) * sizeof(*state->commands));
+	state->commands[state->ncommands++] = command;
+	return 1;
+}
+
+
 void
 interpret_and_eliminate(struct parser_context *ctx)
 {
+	struct interpreter_state *state;
 	size_t interpreted = 0, arg_i;
-	struct command *command;
+	struct command *command, *header;
 	struct argument *argument, *next_argument;
 	enum reserved_word reserved_word;
 
@@ -662,44 +937,27 @@ interpret_and_eliminate(struct parser_context *ctx)
 
 	for (; ctx->interpreter_offset < ctx->parser_state->ncommands; ctx->interpreter_offset++) {
 		command = ctx->parser_state->commands[ctx->interpreter_offset];
+	deferred_function_body:
 		argument = NULL;
+		arg_i = 0;
+
+		if (ctx->interpreter_state->dealing_with == DEFERRED_FUNCTION_BODY && defer_command(ctx, command))
+			continue;
 
 		if (ctx->interpreter_state->dealing_with == TEXT_ROOT) {
 			ctx->interpreter_state->requirement = NEED_VALUE;
 		} else if (ctx->interpreter_state->dealing_with != FOR_STATEMENT &&
+		           ctx->interpreter_state->dealing_with != CASE_STATEMENT &&
 		           ctx->interpreter_state->dealing_with != VARIABLE_SUBSTITUTION_BRACKET) {
 			ctx->interpreter_state->requirement = NEED_COMMAND;
 		}
 
-		for (arg_i = 0; argument || arg_i < command->narguments; arg_i += !argument) {
+		for (; argument || arg_i < command->narguments; arg_i += !argument) {
 			if (!argument)
 				argument = command->arguments[arg_i];
 
-			/* TODO Implement alias substitution
-			 * 
-			 * Unless a word was quoted/backslashed, it is subject
-			 * to alias substitution if it is the first argument
-			 * of a command (after any previous alias substitution)
-			 * or if it immediately follows an alias substitution
-			 * resulting in an unquoted whitespace at the end.
-			 * However, if the word is a reserved word (which may
-			 * indeed the name of an alias) it shall not be subject
-			 * to alias substitution if it has meaning in the context
-			 * it appears in (for example: alias while=x be expanded
-			 * for followed by the expansion of alias echo='echo '
-			 * but not if it is the first word in a command). Creating
-			 * aliases named after reserved words is stupid and we
-			 * should only allow it in POSIX mode.
-			 * 
-			 * (Alias substitution occurs before the grammar is
-			 * interpreted, meaning definition an alias does not
-			 * modify already declared function that use a command
-			 * with the same name as the alias.)
-			 * 
-			 * The result of alias substition is subject to
-			 * alias substition, however (to avoid infinite loop),
-			 * already expanded aliases shall not be recognised.
-			 */
+			/* Alias substitution is done by the parser,
+			 * see substitute_alias() in parser.c */
 
 			if (ctx->interpreter_state->requirement == NEED_COMMAND &&
 			    (reserved_word = get_reserved_word(argument))) {
@@ -717,17 +975,19 @@ interpret_and_eliminate(struct parser_context *ctx)
 					goto new_command;
 
 				case CLOSE_CURLY:
-					if (ctx->interpreter_state->dealing_with != CURLY_NESTING)
+					if (ctx->interpreter_state->dealing_with != CURLY_NESTING &&
+					    ctx->interpreter_state->dealing_with != DEFERRED_FUNCTION_BODY)
 						stray_reserved_word(argument);
 					pop_state(ctx);
 					ctx->interpreter_state->requirement = NEED_COMMAND_END;
 					break;
 
-				case CASE: /* (TODO) */
-					eprintf("reserved word 'case' (at line %zu) has not been implemented yet\n",
-					        argument->line_number);
-					/* NEWLINEs surrounding 'in' shall be ignored; ';' is not allowed */
-					break;
+				case CASE:
+					push_state(ctx, CASE_STATEMENT, argument->line_number);
+					ctx->interpreter_state->requirement = NEED_WORD;
+					free_text_argument(&argument);
+					ctx->interpreter_state->allow_newline = 0;
+					continue;
 
 				case DO:
 					if (ctx->interpreter_state->dealing_with != REPEAT_CONDITIONAL)
@@ -760,7 +1020,13 @@ interpret_and_eliminate(struct parser_context *ctx)
 					goto new_command;
 
 				case ESAC:
-					stray_reserved_word(argument);
+					if (ctx->interpreter_state->dealing_with != CASE_CLAUSE)
+						stray_reserved_word(argument);
+					pop_state(ctx);
+				end_of_case:
+					compile_case_statement(ctx->interpreter_state);
+					pop_state(ctx);
+					ctx->interpreter_state->requirement = NEED_COMMAND_END;
 					break;
 
 				case FI:
@@ -824,9 +1090,11 @@ interpret_and_eliminate(struct parser_context *ctx)
 				push_variable_substitution_argument(ctx, command, &argument);
 
 			} else if (argument->type == REDIRECTION) {
-				if (ctx->interpreter_state->dealing_with == FOR_STATEMENT)
+				if (ctx->interpreter_state->dealing_with == FOR_STATEMENT ||
+				    ctx->interpreter_state->dealing_with == CASE_STATEMENT ||
+				    ctx->interpreter_state->dealing_with == CASE_PATTERNS)
 					stray_redirection(command, argument);
-				push_redirection(command, &argument);
+				push_redirection(ctx, command, &argument);
 				if (ctx->interpreter_state->requirement != NEED_FUNCTION_BODY)
 					ctx->interpreter_state->requirement = NO_REQUIREMENT; /* e.g. "<somefile;" is ok */
 
@@ -834,7 +1102,9 @@ interpret_and_eliminate(struct parser_context *ctx)
 				if (ctx->interpreter_state->requirement == NEED_FUNCTION_BODY ||
 				    ctx->interpreter_state->requirement == NEED_COMMAND_END ||
 				    ctx->interpreter_state->narguments != 1 ||
-				    ctx->interpreter_state->dealing_with == FOR_STATEMENT)
+				    ctx->interpreter_state->dealing_with == FOR_STATEMENT ||
+				    ctx->interpreter_state->dealing_with == CASE_STATEMENT ||
+				    ctx->interpreter_state->dealing_with == CASE_PATTERNS)
 					eprintf("stray '()' at line %zu\n", argument->line_number);
 
 				next_argument = argument->next_part;
@@ -853,10 +1123,29 @@ interpret_and_eliminate(struct parser_context *ctx)
 			} else if (ctx->interpreter_state->requirement == NEED_FUNCTION_BODY) {
 				reserved_word = get_reserved_word(argument);
 				if (reserved_word == OPEN_CURLY) {
-					goto open_curly;
+					if (check_syntax_only)
+						goto open_curly;
+					push_state(ctx, DEFERRED_FUNCTION_BODY, argument->line_number);
+					free_text_argument(&argument);
+					/* the rest of the command is the first command in the body */
+					memmove(&command->arguments[0], &command->arguments[arg_i + 1],
+					        (command->narguments -= arg_i + 1) * sizeof(*command->arguments));
+					if (command->redirections_offset) {
+						memmove(&command->redirections[0], &command->redirections[command->redirections_offset],
+						        (command->nredirections -= command->redirections_offset) *
+						        sizeof(*command->redirections));
+						command->redirections_offset = 0;
+					}
+					goto deferred_function_body;
 				} else if (argument->type == SUBSHELL) {
 					ctx->interpreter_state->requirement = NEED_COMMAND_END;
-					push_argument(ctx, &argument);
+					if (check_syntax_only || argument->next_part) {
+						push_argument(ctx, &argument);
+					} else {
+						defer_nested_code(argument);
+						push_interpreted_argument(ctx, argument);
+						argument = NULL;
+					}
 				} else {
 					eprintf("required function body or redirection at line %zu;\n", argument->line_number);
 				}
@@ -868,7 +1157,9 @@ interpret_and_eliminate(struct parser_context *ctx)
 						eprintf("required variable name after 'for' at line %zu\n", argument->line_number);
 					validate_identifier_name(argument, "variable name", "for");
 					argument->type = VARIABLE;
+					argument->variable = get_variable_slot(argument->text, argument->length);
 					push_interpreted_argument(ctx, argument);
+					argument = NULL;
 					ctx->interpreter_state->requirement = NEED_IN_OR_DO;
 					ctx->interpreter_state->allow_newline = 1;
 				} else {
@@ -884,15 +1175,42 @@ interpret_and_eliminate(struct parser_context *ctx)
 			} else if (ctx->interpreter_state->requirement == NEED_IN_OR_DO) {
 				reserved_word = get_reserved_word(argument);
 				if (reserved_word == DO) {
-					push_command(ctx, command);
+					/* 'for name do': the rest of this command is the
+					 * first command in the body, so the header is not
+					 * this command, but a command of its own */
+					header = ecalloc(1, sizeof(*header));
+					header->terminal = SEMICOLON;
+					header->terminal_line_number = argument->line_number;
+					push_command(ctx, header);
 					goto do_keyword;
 				} else if (reserved_word == IN) {
+					free_text_argument(&argument);
 					ctx->interpreter_state->requirement = NEED_VALUE;
 					ctx->interpreter_state->allow_newline = 0;
 				} else {
 					stray_reserved_word(argument);
 				}
 
+			} else if (ctx->interpreter_state->requirement == NEED_WORD) {
+				/* the word after 'case' */
+				push_argument(ctx, &argument);
+				ctx->interpreter_state->requirement = NEED_IN;
+				ctx->interpreter_state->allow_newline = 1;
+
+			} else if (ctx->interpreter_state->requirement == NEED_IN) {
+				if (get_reserved_word(argument) != IN)
+					eprintf("required 'in' after 'case' at line %zu\n", argument->line_number);
+				free_text_argument(&argument);
+				ctx->interpreter_state->requirement = NEED_PATTERN_OR_ESAC;
+				ctx->interpreter_state->allow_newline = 1;
+
+			} else if (ctx->interpreter_state->requirement == NEED_PATTERN_OR_ESAC) {
+				if (get_reserved_word(argument) == ESAC)
+					goto end_of_case;
+				push_state(ctx, CASE_PATTERNS, argument->line_number);
+				ctx->interpreter_state->requirement = NO_REQUIREMENT;
+				push_argument(ctx, &argument);
+
 			} else {
 				if (ctx->interpreter_state->requirement == NEED_COMMAND_END) {
 					eprintf("required %s at line %zu after control statement\n",
@@ -913,28 +1231,61 @@ interpret_and_eliminate(struct parser_context *ctx)
 
 		if (ctx->interpreter_state->dealing_with == TEXT_ROOT ||
 		    ctx->interpreter_state->dealing_with == VARIABLE_SUBSTITUTION_BRACKET) {
+		drop_command:
 			free(command->redirections);
 			free(command->arguments);
 			free(command);
 			continue;
 		}
 
+		if (ctx->interpreter_state->dealing_with == CASE_PATTERNS) {
+			if (command->terminal != CLOSE_PARENTHESIS)
+				stray_command_terminal(command);
+			pop_state(ctx);
+			push_state(ctx, CASE_CLAUSE, command->terminal_line_number);
+			ctx->interpreter_state->requirement = NEED_COMMAND;
+			ctx->interpreter_state->allow_newline = 1;
+			goto drop_command;
+		}
+
 		if (ctx->interpreter_state->allow_newline) {
 			ctx->interpreter_state->allow_newline = 0;
-			if (command->terminal == NEWLINE) {
+			if (command->terminal == NEWLINE)
+				goto drop_command;
+		}
+
+		if (command->terminal == DOUBLE_SEMICOLON && ctx->interpreter_state->dealing_with == CASE_CLAUSE) {
+			if (ctx->interpreter_state->requirement != NEED_COMMAND || command->narguments != arg_i) {
+				push_command(ctx, command);
+			} else if (ctx->interpreter_state->ncommands &&
+			           ctx->interpreter_state->commands[ctx->interpreter_state->ncommands - 1]->terminal != SEMICOLON &&
+			           ctx->interpreter_state->commands[ctx->interpreter_state->ncommands - 1]->terminal != NEWLINE &&
+			           ctx->interpreter_state->commands[ctx->interpreter_state->ncommands - 1]->terminal != AMPERSAND) {
+				stray_command_terminal(command);
+			} else {
+				/* empty clause, or ';;' after ';' */
+				ctx->parser_state->commands[ctx->interpreter_offset] = NULL;
 				free(command->redirections);
 				free(command->arguments);
 				free(command);
-				continue;
 			}
+			pop_state(ctx);
+			ctx->interpreter_state->requirement = NEED_PATTERN_OR_ESAC;
+			ctx->interpreter_state->allow_newline = 1;
+			ctx->interpreter_state->disallow_bang = 0;
+			continue;
 		}
 
 		if ((ctx->interpreter_state->requirement == NEED_COMMAND && command->narguments == arg_i) ||
 		    ctx->interpreter_state->requirement == NEED_FUNCTION_BODY ||
-		    ctx->interpreter_state->requirement == NEED_VARIABLE_NAME)
+		    ctx->interpreter_state->requirement == NEED_VARIABLE_NAME ||
+		    ctx->interpreter_state->requirement == NEED_WORD ||
+		    ctx->interpreter_state->requirement == NEED_IN ||
+		    ctx->interpreter_state->requirement == NEED_PATTERN_OR_ESAC)
 			stray_command_terminal(command);
 
-		if (ctx->interpreter_state->requirement == NEED_IN_OR_DO) {
+		if (ctx->interpreter_state->requirement == NEED_IN_OR_DO ||
+		    ctx->interpreter_state->requirement == NEED_VALUE) {
 			ctx->interpreter_state->requirement = NEED_DO;
 			if (command->terminal != SEMICOLON && command->terminal != NEWLINE)
 				stray_command_terminal(command);
@@ -947,10 +1298,25 @@ interpret_and_eliminate(struct parser_context *ctx)
 		    command->terminal == AMPERSAND) {
 			ctx->interpreter_state->disallow_bang = 0;
 			if (ctx->interpreter_state->dealing_with == MAIN_BODY) {
-				/* TODO execute and destroy queued up commands (also destroy list) */
+				state = ctx->interpreter_state;
+				if (ctx->compiled_cache)
+					write_compiled_commands(ctx->compiled_cache, &state->commands[ctx->ncommands_completed],
+					                        state->ncommands - ctx->ncommands_completed);
+				if (ctx->queue_commands) {
+					/* the executor thread takes over the array */
+					queue_commands(state->commands, state->ncommands);
+					state->commands = NULL;
+					state->ncommands = 0;
+				} else if (ctx->run_commands) {
+					/* run as soon as complete, and released afterwards,
+					 * so memory use does not grow with the script */
+					execute_and_release(state->commands, state->ncommands);
+					state->ncommands = 0;
+				}
+				ctx->ncommands_completed = state->ncommands;
 				interpreted = ctx->interpreter_offset + 1;
 			}
-		} else if (command->terminal == DOUBLE_SEMICOLON) {
+		} else if (command->terminal == DOUBLE_SEMICOLON || command->terminal == CLOSE_PARENTHESIS) {
 			stray_command_terminal(command);
 		} else {
 			ctx->interpreter_state->disallow_bang = 1;
@@ -959,7 +1325,7 @@ interpret_and_eliminate(struct parser_context *ctx)
 
 	memmove(&ctx->parser_state->commands[0],
 	        &ctx->parser_state->commands[interpreted],
-	        ctx->parser_state->ncommands - interpreted);
+	        (ctx->parser_state->ncommands - interpreted) * sizeof(*ctx->parser_state->commands));
 	ctx->parser_state->ncommands -= interpreted;
 	ctx->interpreter_offset -= interpreted;
 
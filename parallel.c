@@ -0,0 +1,250 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+#include <sys/wait.h>
+
+
+/* Syntax checking (-n), which is also how the compiled cache is
+ * built without running the script, is done in parallel for large
+ * scripts: the script is split at newlines into one chunk per job,
+ * and each chunk is parsed in its own process on the assumption
+ * that it begins at the top level, with no open quote, compound
+ * command, or here-document.
+ *
+ * The first chunk's assumption is true, and every state that is
+ * not the top level is rejected as a premature end of file, so if
+ * a chunk is parsed without error, the next chunk's assumption is
+ * true as well. The results are therefore accepted in order up to
+ * the first chunk that failed, and the rest of the script, from
+ * the beginning of that chunk, is parsed serially, which also
+ * reports any actual syntax error as it would have been reported
+ * without this.
+ *
+ * Processes are used rather than threads because a syntax error
+ * in a chunk is fatal, and because the chunks must not share the
+ * alias and variable tables. Each process writes its cache records
+ * and its warnings to files that are copied in order if accepted */
+
+struct chunk {
+	size_t start;
+	size_t end;
+	size_t line_number;
+	int records_fd;
+	int warnings_fd;
+	pid_t pid;
+};
+
+struct memory_source {
+	const char *data;
+	size_t length;
+	size_t offset;
+};
+
+
+static ssize_t
+read_memory(void *data, char *buffer, size_t size)
+{
+	struct memory_source *source = data;
+
+	size = MIN(size, source->length - source->offset);
+	memcpy(buffer, &source->data[source->offset], size);
+	source->offset += size;
+	return (ssize_t)size;
+}
+
+
+PURE_FUNC
+static int
+is_line_continued(const char *data, const char *newline)
+{
+	size_t backslashes;
+
+	/* a newline that ends a line continuation is removed by
+	 * the preparser, so the next line continues the command */
+	for (backslashes = 0; newline - backslashes != data && newline[-1 - (ptrdiff_t)backslashes] == '\\'; backslashes++);
+	return backslashes & 1;
+}
+
+
+PURE_FUNC
+static int
+is_likely_top_level(const char *data, size_t size, const char *newline)
+{
+	const char *p = newline;
+
+	/* nested lines are usually indented, and a line ending
+	 * with an operator is usually continued on the next line */
+	if (newline + 1 == &data[size] || strchr(" \t\n#)};", newline[1]))
+		return 0;
+	while (p != data && (p[-1] == ' ' || p[-1] == '\t'))
+		p--;
+	return p == data || !strchr("|&{(", p[-1]);
+}
+
+
+static size_t
+find_chunk_boundary(const char *data, size_t size, size_t offset)
+{
+	const char *p, *fallback = NULL;
+	size_t start = offset;
+
+	/* the boundary is a guess, that if wrong, makes the rest of
+	 * the script parse serially, so the next few lines are looked
+	 * at for one that is more likely to be at the top level */
+	for (;;) {
+		p = memchr(&data[offset], '\n', size - offset);
+		if (!p)
+			return fallback ? (size_t)(fallback - data) + 1 : size;
+		offset = (size_t)(p - data) + 1;
+		if (is_line_continued(data, p))
+			continue;
+		if (is_likely_top_level(data, size, p))
+			return offset;
+		if (!fallback)
+			fallback = p;
+		if (offset - start > PARALLEL_PARSE_BOUNDARY_SEARCH)
+			return (size_t)(fallback - data) + 1;
+	}
+}
+
+
+static size_t
+count_lines(const char *data, size_t start, size_t end)
+{
+	const char *p = &data[start];
+	size_t n = 0;
+
+	while ((p = memchr(p, '\n', (size_t)(&data[end] - p)))) {
+		p++;
+		n++;
+	}
+	return n;
+}
+
+
+static int
+create_chunk_file(void)
+{
+	int fd = memfd_create("apsh-chunk", MFD_CLOEXEC);
+	if (fd < 0)
+		eprintf("memfd_create:");
+	return fd;
+}
+
+
+static void
+copy_chunk_warnings(int fd)
+{
+	char buffer[4096];
+	ssize_t r;
+
+	if (lseek(fd, 0, SEEK_SET))
+		return;
+	while ((r = read(fd, buffer, sizeof(buffer))) > 0)
+		fwrite(buffer, 1, (size_t)r, stderr);
+}
+
+
+static void
+parse_chunk(const char *data, struct chunk *chunk, const char *name, int write_records)
+{
+	struct parser_context ctx;
+	struct memory_source source = {&data[chunk->start], chunk->end - chunk->start, 0};
+
+	if (dup2(chunk->warnings_fd, STDERR_FILENO) < 0)
+		exit(1);
+
+	initialise_parser_context(&ctx, 1, 1);
+	ctx.run_commands = 1; /* only releases the commands, as this is -n */
+	ctx.preparser_line_number = chunk->line_number;
+	ctx.tokeniser_line_number = chunk->line_number;
+	if (write_records)
+		ctx.compiled_cache = create_compiled_cache_fragment(chunk->records_fd);
+
+	/* exits with an error on a premature end of file,
+	 * which is what rejects a chunk that does not end
+	 * at the top level */
+	parse_input(&ctx, read_memory, &source, name);
+
+	_exit(0);
+}
+
+
+int
+parse_file_in_parallel(struct parser_context *ctx, int fd, const char *name, size_t jobs)
+{
+	struct chunk *chunks;
+	struct memory_source source;
+	struct stat st;
+	char *data;
+	size_t size, nchunks, naccepted, i;
+	int status;
+
+	if (!jobs)
+		jobs = (size_t)MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || (uintmax_t)st.st_size > SIZE_MAX)
+		return 0;
+	size = (size_t)st.st_size;
+	nchunks = MIN(jobs, size / PARALLEL_PARSE_MIN_CHUNK_SIZE);
+	if (nchunks < 2)
+		return 0;
+
+	data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		return 0;
+
+	chunks = ecalloc(nchunks, sizeof(*chunks));
+	for (i = 0; i < nchunks; i++) {
+		chunks[i].start = i ? chunks[i - 1].end : 0;
+		chunks[i].end = i + 1 < nchunks ? find_chunk_boundary(data, size, MAX(size / nchunks * (i + 1), chunks[i].start)) : size;
+		chunks[i].line_number = i ? chunks[i - 1].line_number + count_lines(data, chunks[i - 1].start, chunks[i - 1].end) : 1;
+	}
+
+	fflush(NULL);
+	for (i = 0; i < nchunks; i++) {
+		chunks[i].records_fd = ctx->compiled_cache ? create_chunk_file() : -1;
+		chunks[i].warnings_fd = create_chunk_file();
+		chunks[i].pid = fork();
+		if (chunks[i].pid < 0)
+			eprintf("fork:");
+		if (!chunks[i].pid)
+			parse_chunk(data, &chunks[i], name, !!ctx->compiled_cache);
+	}
+
+	for (naccepted = 0; naccepted < nchunks; naccepted++) {
+		if (waitpid(chunks[naccepted].pid, &status, 0) < 0)
+			eprintf("waitpid:");
+		chunks[naccepted].pid = 0;
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			break;
+		copy_chunk_warnings(chunks[naccepted].warnings_fd);
+		if (ctx->compiled_cache)
+			append_compiled_cache_fragment(ctx->compiled_cache, chunks[naccepted].records_fd);
+	}
+
+	/* the assumption of the remaining chunks cannot be verified */
+	for (i = naccepted; i < nchunks; i++) {
+		if (chunks[i].pid) {
+			kill(chunks[i].pid, SIGKILL);
+			waitpid(chunks[i].pid, &status, 0);
+		}
+	}
+
+	for (i = 0; i < nchunks; i++) {
+		if (chunks[i].records_fd >= 0)
+			close(chunks[i].records_fd);
+		close(chunks[i].warnings_fd);
+	}
+
+	if (naccepted < nchunks) {
+		ctx->preparser_line_number = chunks[naccepted].line_number;
+		ctx->tokeniser_line_number = chunks[naccepted].line_number;
+		source.data = &data[chunks[naccepted].start];
+		source.length = size - chunks[naccepted].start;
+		source.offset = 0;
+		parse_input(ctx, read_memory, &source, name);
+	}
+
+	free(chunks);
+	munmap(data, size);
+	return 1;
+}
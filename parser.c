@@ -51,9 +51,187 @@ push_end_of_file(struct parser_context *ctx)
 }
 
 
+static void
+end_case_statement(struct parser_state *state)
+{
+	if (state->case_depth) {
+		state->case_depth -= 1;
+		state->case_position = CASE_IN_CLAUSE;
+	} else {
+		state->case_position = NOT_IN_CASE;
+	}
+}
+
+
+static void
+track_command_position(struct parser_context *ctx, struct argument *word)
+{
+	struct parser_state *state = ctx->parser_state;
+	enum reserved_word reserved_word = get_reserved_word(word);
+
+	/* Like in defer_command(), only words in command position
+	 * are tracked, and only so that case statements can be
+	 * recognised, as ')' and '|' have another meaning in case
+	 * patterns; everything else is checked by the interpreter */
+	switch (state->case_position) {
+	case CASE_NEED_WORD:
+		state->case_position = CASE_NEED_IN;
+		return;
+	case CASE_NEED_IN:
+		state->case_position = CASE_NEED_PATTERN;
+		return;
+	case CASE_NEED_PATTERN:
+		if (reserved_word == ESAC) {
+			end_case_statement(state);
+			state->not_command_position = 1;
+			return;
+		}
+		/* fall through */
+	case CASE_NEED_ALTERNATIVE:
+		state->case_position = CASE_AFTER_PATTERN;
+		return;
+	case CASE_AFTER_PATTERN:
+		eprintf("required '|' or ')' after case pattern at line %zu\n", word->line_number);
+		return;
+	default:
+		break;
+	}
+
+	if (word->type == FUNCTION_MARK) {
+		state->not_command_position = 0;
+		return;
+	} else if (state->for_position) {
+		state->for_position -= 1;
+		state->not_command_position = (state->for_position || reserved_word != DO);
+		return;
+	} else if (state->not_command_position) {
+		return;
+	}
+
+	switch (reserved_word) {
+	case CASE:
+		if (state->case_position)
+			state->case_depth += 1;
+		state->case_position = CASE_NEED_WORD;
+		state->not_command_position = 1;
+		break;
+
+	case ESAC:
+		if (state->case_position == CASE_IN_CLAUSE)
+			end_case_statement(state);
+		state->not_command_position = 1;
+		break;
+
+	case FOR:
+		state->for_position = 2;
+		state->not_command_position = 1;
+		break;
+
+	case BANG:
+	case OPEN_CURLY:
+	case DO:
+	case ELIF:
+	case ELSE:
+	case IF:
+	case THEN:
+	case UNTIL:
+	case WHILE:
+		break;
+
+	default:
+		state->not_command_position = 1;
+		break;
+	}
+}
+
+
+static void push_command_terminal(struct parser_context *ctx, enum command_terminal terminal);
+static void push_word(struct parser_context *ctx, struct argument *word);
+
+
+static int
+substitute_alias(struct parser_context *ctx, struct argument *word)
+{
+	struct parser_state *state = ctx->parser_state, *expansion;
+	struct alias *alias;
+	size_t line_number = word->line_number, i, j, r;
+	struct command *command;
+
+	if (word->type != UNQUOTED || word->next_part)
+		return 0;
+	alias = get_alias(word->text, word->length);
+	if (!alias || alias->expanding)
+		return 0;
+
+	/* the interpreted tree now depends on the aliases defined
+	 * at run-time, so it may not be reused for another run */
+	if (ctx->compiled_cache) {
+		close_compiled_cache(ctx->compiled_cache, 0);
+		ctx->compiled_cache = NULL;
+	}
+	ctx->aliases_substituted = 1;
+	free(word->text);
+	free(word);
+
+	/* The words were tokenised when the alias was defined, so
+	 * they are only copied here, but they are pushed one by one
+	 * so that they are themselves subject to alias substitution;
+	 * .expanding stops an alias from being substituted within
+	 * its own expansion */
+	alias->expanding = 1;
+	expansion = alias->expansion;
+	for (i = 0; i <= expansion->ncommands; i++) {
+		command = i < expansion->ncommands ? expansion->commands[i] : NULL;
+		for (j = 0, r = 0; j < (command ? command->narguments : expansion->narguments); j++) {
+			word = command ? command->arguments[j] : expansion->arguments[j];
+			if (word->type == REDIRECTION) {
+				state->redirections = erealloc(state->redirections, (state->nredirections + 1) *
+				                                                    sizeof(*state->redirections));
+				state->redirections[state->nredirections++] =
+					copy_raw_redirection(command ? command->redirections[r++] : expansion->redirections[r++],
+					                     line_number);
+			}
+			push_word(ctx, copy_raw_argument(word, line_number));
+		}
+		if (command)
+			push_command_terminal(ctx, command->terminal);
+	}
+	alias->expanding = 0;
+
+	/* a trailing blank makes the next word subject to alias substitution */
+	ctx->parser_state->alias_blank = alias->trailing_blank;
+	return 1;
+}
+
+
+static void
+push_word(struct parser_context *ctx, struct argument *word)
+{
+	struct parser_state *state = ctx->parser_state;
+	int command_position;
+
+	if (ctx->mode_stack->mode == NORMAL_MODE) {
+		command_position = (!state->not_command_position && !state->for_position &&
+		                    (state->case_position == NOT_IN_CASE || state->case_position == CASE_IN_CLAUSE));
+		if (state->alias_blank || (command_position && !get_reserved_word(word))) {
+			state->alias_blank = 0;
+			if (!ctx->no_alias_substitution && substitute_alias(ctx, word))
+				return;
+		}
+	}
+
+	state->arguments = erealloc(state->arguments, (state->narguments + 1) * sizeof(*state->arguments));
+	state->arguments[state->narguments++] = word;
+	if (ctx->mode_stack->mode == NORMAL_MODE)
+		track_command_position(ctx, word);
+}
+
+
 void
 push_whitespace(struct parser_context *ctx, int strict)
 {
+	struct argument *word;
+
 	if (ctx->parser_state->need_right_hand_side) {
 		if (strict)
 			eprintf("premature end of command\n");
@@ -61,12 +239,10 @@ push_whitespace(struct parser_context *ctx, int strict)
 	}
 
 	if (ctx->parser_state->current_argument) {
-		ctx->parser_state->arguments = erealloc(ctx->parser_state->arguments,
-		                                        (ctx->parser_state->narguments + 1) *
-		                                        sizeof(*ctx->parser_state->arguments));
-		ctx->parser_state->arguments[ctx->parser_state->narguments++] = ctx->parser_state->current_argument;
+		word = ctx->parser_state->current_argument;
 		ctx->parser_state->current_argument = NULL;
 		ctx->parser_state->current_argument_end = NULL;
+		push_word(ctx, word);
 	}
 }
 
@@ -93,6 +269,11 @@ push_command_terminal(struct parser_context *ctx, enum command_terminal terminal
 	ctx->parser_state->narguments = 0;
 	ctx->parser_state->redirections = NULL;
 	ctx->parser_state->nredirections = 0;
+	ctx->parser_state->not_command_position = 0;
+	ctx->parser_state->for_position = 0;
+	ctx->parser_state->alias_blank = 0;
+	if (terminal == DOUBLE_SEMICOLON && ctx->parser_state->case_position == CASE_IN_CLAUSE)
+		ctx->parser_state->case_position = CASE_NEED_PATTERN;
 
 	if (!ctx->parser_state->parent && !ctx->do_not_run)
 		if (terminal == DOUBLE_SEMICOLON || terminal == SEMICOLON || terminal == NEWLINE || terminal == AMPERSAND)
@@ -108,8 +289,8 @@ push_semicolon(struct parser_context *ctx, int actually_newline)
 }
 
 
-static void
-push_new_argument_part(struct parser_context *ctx, enum argument_type type)
+static struct argument *
+push_new_argument_part(struct parser_context *ctx, enum argument_type type, struct here_document *here_document)
 {
 	struct argument *new_part;
 
@@ -117,9 +298,9 @@ push_new_argument_part(struct parser_context *ctx, enum argument_type type)
 	new_part->type = type;
 	new_part->line_number = ctx->tokeniser_line_number;
 
-	if (ctx->mode_stack->mode == HERE_DOCUMENT_MODE) {
-		ctx->here_document_stack->first->argument_end->next_part = new_part;
-		ctx->here_document_stack->first->argument_end = new_part;
+	if (here_document) {
+		here_document->argument_end->next_part = new_part;
+		here_document->argument_end = new_part;
 	} else if (ctx->parser_state->current_argument_end) {
 		ctx->parser_state->current_argument_end->next_part = new_part;
 		ctx->parser_state->current_argument_end = new_part;
@@ -127,6 +308,8 @@ push_new_argument_part(struct parser_context *ctx, enum argument_type type)
 		ctx->parser_state->current_argument = new_part;
 		ctx->parser_state->current_argument_end = new_part;
 	}
+
+	return new_part;
 }
 
 
@@ -216,6 +399,7 @@ push_redirection(struct parser_context *ctx, enum redirection_type type)
 	new_argument->type = REDIRECTION;
 	new_argument->line_number = ctx->tokeniser_line_number;
 	ctx->parser_state->current_argument = new_argument;
+	ctx->parser_state->current_argument_end = new_argument;
 
 	if (type == HERE_DOCUMENT || type == HERE_DOCUMENT_INDENTED) {
 		new_here_document = emalloc(sizeof(*new_here_document));
@@ -242,11 +426,47 @@ static void
 push_function_mark(struct parser_context *ctx)
 {
 	push_whitespace(ctx, 1);
-	push_new_argument_part(ctx, FUNCTION_MARK);
+	push_new_argument_part(ctx, FUNCTION_MARK, NULL);
 	push_whitespace(ctx, 1);
 }
 
 
+int
+push_case_pattern_symbol(struct parser_context *ctx, char symbol)
+{
+	struct parser_state *state = ctx->parser_state;
+
+	if (ctx->mode_stack->mode != NORMAL_MODE)
+		return 0;
+
+	if (symbol == '(') {
+		/* optional before the first pattern, and ignored */
+		return state->case_position == CASE_NEED_PATTERN && !state->current_argument;
+	} else if (symbol != '|' && symbol != ')') {
+		return 0;
+	} else if (state->case_position != CASE_NEED_PATTERN &&
+	           state->case_position != CASE_NEED_ALTERNATIVE &&
+	           state->case_position != CASE_AFTER_PATTERN) {
+		return 0;
+	}
+
+	/* the pending word may be 'esac', ending the statement */
+	push_whitespace(ctx, 1);
+	if (state->case_position == NOT_IN_CASE || state->case_position == CASE_IN_CLAUSE)
+		return 0;
+	if (state->case_position != CASE_AFTER_PATTERN)
+		eprintf("missing case pattern before '%c' at line %zu\n", symbol, ctx->tokeniser_line_number);
+
+	if (symbol == '|') {
+		state->case_position = CASE_NEED_ALTERNATIVE;
+	} else {
+		state->case_position = CASE_IN_CLAUSE;
+		push_command_terminal(ctx, CLOSE_PARENTHESIS);
+	}
+	return 1;
+}
+
+
 size_t
 push_symbol(struct parser_context *ctx, char *token, size_t token_len)
 {
@@ -282,12 +502,15 @@ push_symbol(struct parser_context *ctx, char *token, size_t token_len)
 	_(1, "|", push_command_terminal(ctx, PIPE))\
 	_(1, "&", push_command_terminal(ctx, AMPERSAND))
 
+	if (push_case_pattern_symbol(ctx, token[0]))
+		return 1;
+
 #define X(PORTABLE, SYMBOL, ACTION)\
 	if (token_len >= sizeof(SYMBOL) - 1 &&\
 	    !strncmp(token, SYMBOL, sizeof(SYMBOL) - 1) &&\
 	    (PORTABLE || check_extension(SYMBOL, ctx->tokeniser_line_number))) {\
 		ACTION;\
-		return token_len;\
+		return sizeof(SYMBOL) - 1;\
 	}
 	LIST_SYMBOLS(X)
 #undef X
@@ -303,10 +526,9 @@ push_text(struct parser_context *ctx, char *text, size_t text_len, enum argument
 	struct argument *arg_part;
 
 	if (ctx->mode_stack->mode == HERE_DOCUMENT_MODE) {
-		type = QUOTED;
 		if (ctx->here_document_stack->first->argument_end->type != type ||
 		    ctx->here_document_stack->first->argument_end->line_number != ctx->tokeniser_line_number)
-			push_new_argument_part(ctx, type);
+			push_new_argument_part(ctx, type, ctx->here_document_stack->first);
 		arg_part = ctx->here_document_stack->first->argument_end;
 
 	} else {
@@ -315,7 +537,7 @@ push_text(struct parser_context *ctx, char *text, size_t text_len, enum argument
 		if (!ctx->parser_state->current_argument_end ||
 		    ctx->parser_state->current_argument_end->type != type ||
 		    ctx->parser_state->current_argument_end->line_number != ctx->tokeniser_line_number)
-			push_new_argument_part(ctx, type);
+			push_new_argument_part(ctx, type, NULL);
 		arg_part = ctx->parser_state->current_argument_end;
 	}
 
@@ -360,8 +582,8 @@ encode_utf8(char *buf, uint32_t value)
 	return len;
 }
 
-void
-push_escaped(struct parser_context *ctx, char *text, size_t text_len)
+size_t
+decode_escapes(char *text, size_t text_len, size_t line_number)
 {
 	uint32_t value;
 	size_t r, w, n;
@@ -414,8 +636,7 @@ push_escaped(struct parser_context *ctx, char *text, size_t text_len)
 				if (value) {
 					text[w++] = (char)value;
 				} else {
-					weprintf("ignoring NUL byte result from $''-expression at line %zu\n",
-					          ctx->tokeniser_line_number);
+					weprintf("ignoring NUL byte result from $''-expression at line %zu\n", line_number);
 				}
 			} else if (text[r + 1] == 'x' && text_len - r >= 3 && isxdigit(text[r + 2])) {
 				value = 0;
@@ -426,8 +647,7 @@ push_escaped(struct parser_context *ctx, char *text, size_t text_len)
 				if (value) {
 					text[w++] = (char)value;
 				} else {
-					weprintf("ignoring NUL byte result from $''-expression at line %zu\n",
-					          ctx->tokeniser_line_number);
+					weprintf("ignoring NUL byte result from $''-expression at line %zu\n", line_number);
 				}
 			} else if (text[r + 1] == 'u' && text_len - r >= 3 && isxdigit(text[r + 2])) {
 				value = 0;
@@ -438,8 +658,7 @@ push_escaped(struct parser_context *ctx, char *text, size_t text_len)
 				if (value) {
 					w += encode_utf8(&text[w], value);
 				} else {
-					weprintf("ignoring NUL byte result from $''-expression at line %zu\n",
-					          ctx->tokeniser_line_number);
+					weprintf("ignoring NUL byte result from $''-expression at line %zu\n", line_number);
 				}
 			} else if (text[r + 1] == 'U') {
 				value = 0;
@@ -450,15 +669,13 @@ push_escaped(struct parser_context *ctx, char *text, size_t text_len)
 				if (value) {
 					w += encode_utf8(&text[w], value);
 				} else {
-					weprintf("ignoring NUL byte result from $''-expression at line %zu\n",
-					          ctx->tokeniser_line_number);
+					weprintf("ignoring NUL byte result from $''-expression at line %zu\n", line_number);
 				}
 			} else if (text[r + 1] == 'c' && text_len - r >= 3) {
 				if (text[r + 2] & (' ' - 1)) {
 					text[w++] = (char)(text[r + 2] & (' ' - 1));
 				} else {
-					weprintf("ignoring NUL byte result from $''-expression at line %zu\n",
-					          ctx->tokeniser_line_number);
+					weprintf("ignoring NUL byte result from $''-expression at line %zu\n", line_number);
 				}
 				r += 3;
 			} else {
@@ -468,7 +685,14 @@ push_escaped(struct parser_context *ctx, char *text, size_t text_len)
 			text[w++] = text[r++];
 		}
 	}
-	push_text(ctx, text, w, QUOTED);
+	return w;
+}
+
+
+void
+push_escaped(struct parser_context *ctx, char *text, size_t text_len)
+{
+	push_text(ctx, text, decode_escapes(text, text_len, ctx->tokeniser_line_number), QUOTED);
 }
 
 
@@ -479,19 +703,31 @@ push_unquoted(struct parser_context *ctx, char *text, size_t text_len)
 }
 
 
+PURE_FUNC
+static struct here_document *
+get_enclosing_here_document(struct parser_context *ctx)
+{
+	/* the mode of the substitution is pushed before push_enter()
+	 * is called, and popped after push_leave() is called, and
+	 * push_mode() gives it a here-document stack of its own */
+	if (ctx->mode_stack->previous && ctx->mode_stack->previous->mode == HERE_DOCUMENT_MODE)
+		return ctx->here_document_stack->previous->first;
+	return NULL;
+}
+
+
 void
 push_enter(struct parser_context *ctx, enum argument_type type)
 {
 	struct parser_state *new_state;
+	struct here_document *here_document = get_enclosing_here_document(ctx);
 
-	if (ctx->mode_stack->mode != HERE_DOCUMENT_MODE)
+	if (!here_document)
 		ctx->parser_state->need_right_hand_side = 0;
 
-	push_new_argument_part(ctx, type);
-
 	new_state = ecalloc(1, sizeof(*new_state));
 	new_state->parent = ctx->parser_state;
-	ctx->parser_state->current_argument_end->child = new_state;
+	push_new_argument_part(ctx, type, here_document)->child = new_state;
 	ctx->parser_state = new_state;
 }
 
@@ -500,13 +736,16 @@ void
 push_leave(struct parser_context *ctx)
 {
 	struct parser_context subctx;
+	struct here_document *here_document;
+	struct parser_state *text;
 	struct argument *argument;
 	char *code;
 	size_t code_length;
 	size_t parsed_length;
-	size_t arg_i;
 
+	/* called before the mode is popped, so this is the mode being left */
 	if (ctx->mode_stack->mode == NORMAL_MODE) {
+		push_whitespace(ctx, 0);
 		push_semicolon(ctx, 1);
 
 	} else if (ctx->mode_stack->mode == BQ_QUOTE_MODE) {
@@ -515,8 +754,8 @@ push_leave(struct parser_context *ctx)
 		subctx.end_of_file_reached = 1;
 		code = NULL;
 		code_length = 0;
-		for (arg_i = 0; arg_i < ctx->parser_state->narguments; arg_i++) {
-			argument = ctx->parser_state->arguments[arg_i];
+		/* the text is pushed as parts of a single word */
+		for (argument = ctx->parser_state->current_argument; argument; argument = argument->next_part) {
 			code = erealloc(code, code_length + argument->length);
 			memcpy(&code[code_length], argument->text, argument->length);
 			code_length += argument->length;
@@ -524,14 +763,31 @@ push_leave(struct parser_context *ctx)
 		code = erealloc(code, code_length + 1);
 		code[code_length] = '\0';
 		parsed_length = parse_preparsed(&subctx, code, code_length);
-		if (parsed_length < code_length || subctx.premature_end_of_file) {
+		if (!subctx.mode_stack->previous) {
+			/* as for aliases, nothing after the last word ends it */
+			push_whitespace(&subctx, 0);
+			push_semicolon(&subctx, 1);
+		}
+		/* .premature_end_of_file is also set if any command is left,
+		 * which is always the case as they are not run, so like for
+		 * aliases, only an unterminated quote or nesting is checked */
+		if (parsed_length < code_length || subctx.mode_stack->previous || subctx.parser_state->parent) {
 			eprintf("premature end of file backquote expression at line %zu\n",
 			        ctx->parser_state->parent->current_argument_end->line_number);
 		}
 		free(code);
+		free(subctx.mode_stack);
 		free(subctx.here_document_stack);
 		free(subctx.interpreter_state);
-		ctx->parser_state->parent->current_argument_end->child = subctx.parser_state;
+		if ((here_document = get_enclosing_here_document(ctx)))
+			here_document->argument_end->child = subctx.parser_state;
+		else
+			ctx->parser_state->parent->current_argument_end->child = subctx.parser_state;
+		/* the text is replaced by the parsed code */
+		text = ctx->parser_state;
+		ctx->parser_state = text->parent;
+		destroy_parser_state(text);
+		return;
 
 	} else {
 		/* In quote modes we want everything in a dummy command
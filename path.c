@@ -0,0 +1,326 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+
+/* Commands are looked up in $PATH once, and then remembered, both
+ * where they were found and that they were not found. An entry is
+ * still valid if no directory that was searched to create it has
+ * been modified since, which is checked with fstat(2) on a directory
+ * file descriptor, so there is no path to resolve; if a directory
+ * has been modified, every entry is forgotten, as that is rare.
+ *
+ * Relative directories in $PATH depend on the working directory,
+ * so commands that are looked up through them are not remembered */
+
+struct path_directory {
+	char *path;
+	size_t length;
+	int fd; /* O_PATH, -1 if it could not be opened or is relative */
+	struct timespec mtime;
+};
+
+struct command_location {
+	char *name;
+	size_t name_length;
+	size_t hash;
+	char *path; /* NULL if not found */
+	size_t directory; /* index of the directory it was found in, ndirectories if not found */
+	struct command_location *next; /* in hash bucket */
+};
+
+
+static struct command_location **location_table;
+static size_t location_table_size;
+static size_t nlocations;
+
+static struct path_directory *directories;
+static size_t ndirectories;
+static char *current_path; /* value of $PATH that .directories were created from */
+static char *uncached_path;
+
+static struct command_hash_statistics statistics;
+
+static struct variable *path_variable;
+static struct text_buffer path_copy;
+
+
+PURE_FUNC
+static size_t
+hash_command_name(const char *name, size_t length)
+{
+	size_t hash = 5381;
+	while (length--)
+		hash = (hash << 5) + hash + (unsigned char)*name++;
+	return hash;
+}
+
+
+static struct command_location **
+find_location(const char *name, size_t length, size_t hash)
+{
+	struct command_location **locationp;
+
+	locationp = &location_table[hash & (location_table_size - 1)];
+	for (; *locationp; locationp = &(*locationp)->next)
+		if ((*locationp)->hash == hash && (*locationp)->name_length == length &&
+		    !memcmp((*locationp)->name, name, length))
+			break;
+	return locationp;
+}
+
+
+static void
+grow_location_table(void)
+{
+	struct command_location **old_table = location_table, *location, *next;
+	size_t old_size = location_table_size, i, bucket;
+
+	location_table_size = old_size ? old_size * 2 : COMMAND_HASH_TABLE_INITIAL_SIZE;
+	location_table = ecalloc(location_table_size, sizeof(*location_table));
+
+	for (i = 0; i < old_size; i++) {
+		for (location = old_table[i]; location; location = next) {
+			next = location->next;
+			bucket = location->hash & (location_table_size - 1);
+			location->next = location_table[bucket];
+			location_table[bucket] = location;
+		}
+	}
+
+	free(old_table);
+}
+
+
+void
+forget_commands(void)
+{
+	struct command_location *location, *next;
+	size_t i;
+
+	for (i = 0; i < location_table_size; i++) {
+		for (location = location_table[i]; location; location = next) {
+			next = location->next;
+			free(location->name);
+			free(location->path);
+			free(location);
+		}
+		location_table[i] = NULL;
+	}
+	nlocations = 0;
+}
+
+
+static void
+open_directory(struct path_directory *directory)
+{
+	struct stat st;
+
+	directory->fd = -1;
+	if (directory->path[0] != '/')
+		return;
+	directory->fd = open(directory->path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (directory->fd < 0)
+		return;
+	if (fstat(directory->fd, &st)) {
+		close(directory->fd);
+		directory->fd = -1;
+		return;
+	}
+	directory->mtime = st.st_mtim;
+}
+
+
+static void
+set_directories(const char *path)
+{
+	const char *end;
+	size_t i;
+
+	for (i = 0; i < ndirectories; i++) {
+		free(directories[i].path);
+		if (directories[i].fd >= 0)
+			close(directories[i].fd);
+	}
+	free(directories);
+	directories = NULL;
+	ndirectories = 0;
+	free(current_path);
+	current_path = estrdup(path);
+
+	for (;; path = &end[1]) {
+		end = strchrnul(path, ':');
+		directories = erealloc(directories, (ndirectories + 1) * sizeof(*directories));
+		/* an empty entry is the working directory */
+		if (end == path) {
+			directories[ndirectories].path = estrdup(".");
+			directories[ndirectories].length = 1;
+		} else {
+			directories[ndirectories].path = estrndup(path, (size_t)(end - path));
+			directories[ndirectories].length = (size_t)(end - path);
+		}
+		open_directory(&directories[ndirectories++]);
+		if (!*end)
+			break;
+	}
+}
+
+
+static int
+are_directories_unchanged(size_t n)
+{
+	struct stat st;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (directories[i].fd < 0) {
+			/* it may have been created since */
+			open_directory(&directories[i]);
+			if (directories[i].fd >= 0)
+				goto changed;
+			continue;
+		}
+		if (fstat(directories[i].fd, &st) ||
+		    st.st_mtim.tv_sec != directories[i].mtime.tv_sec ||
+		    st.st_mtim.tv_nsec != directories[i].mtime.tv_nsec)
+			goto changed;
+	}
+	return 1;
+
+changed:
+	/* the entries that depend on the other directories are forgotten
+	 * too, and the directories' times are updated for the new ones */
+	statistics.invalidations += 1;
+	forget_commands();
+	for (i = 0; i < ndirectories; i++) {
+		if (directories[i].fd >= 0) {
+			close(directories[i].fd);
+			open_directory(&directories[i]);
+		}
+	}
+	return 0;
+}
+
+
+static char *
+search_directories(const char *name, size_t length, size_t *directoryp)
+{
+	struct path_directory *directory;
+	struct stat st;
+	char *path;
+	size_t i;
+
+	for (i = 0; i < ndirectories; i++) {
+		directory = &directories[i];
+		if (directory->fd >= 0) {
+			if (fstatat(directory->fd, name, &st, 0) || !S_ISREG(st.st_mode) ||
+			    faccessat(directory->fd, name, X_OK, AT_EACCESS))
+				continue;
+		}
+		path = emalloc(directory->length + 1 + length + 1);
+		memcpy(path, directory->path, directory->length);
+		path[directory->length] = '/';
+		memcpy(&path[directory->length + 1], name, length + 1);
+		if (directory->fd >= 0 ||
+		    (!stat(path, &st) && S_ISREG(st.st_mode) && !access(path, X_OK))) {
+			*directoryp = i;
+			return path;
+		}
+		free(path);
+	}
+	*directoryp = ndirectories;
+	return NULL;
+}
+
+
+const char *
+find_command(const char *name)
+{
+	struct command_location **locationp, *location;
+	size_t length, hash, directory, i;
+	const char *path;
+	char *found;
+
+	if (strchr(name, '/'))
+		return name;
+
+	if (!path_variable)
+		path_variable = get_variable_slot("PATH", sizeof("PATH") - 1);
+	path = get_variable_value(path_variable, &length, &path_copy);
+	if (!path)
+		path = "/bin:/usr/bin"; /* as execvp(3) */
+	if (!current_path || strcmp(path, current_path)) {
+		forget_commands();
+		set_directories(path);
+	}
+
+	length = strlen(name);
+	hash = hash_command_name(name, length);
+	if (nlocations) {
+		location = *find_location(name, length, hash);
+		if (location && are_directories_unchanged(location->path ? location->directory + 1 : ndirectories)) {
+			if (location->path)
+				statistics.hits += 1;
+			else
+				statistics.negative_hits += 1;
+			return location->path;
+		}
+	}
+
+	statistics.misses += 1;
+	found = search_directories(name, length, &directory);
+	for (i = 0; i < (found ? directory + 1 : ndirectories); i++) {
+		if (directories[i].path[0] != '/') {
+			/* kept until the next call */
+			free(uncached_path);
+			uncached_path = found;
+			return found;
+		}
+	}
+
+	if (nlocations >= location_table_size / 4 * 3)
+		grow_location_table();
+	locationp = find_location(name, length, hash);
+	location = *locationp = ecalloc(1, sizeof(*location));
+	location->name = estrndup(name, length);
+	location->name_length = length;
+	location->hash = hash;
+	location->path = found;
+	location->directory = directory;
+	nlocations += 1;
+	return found;
+}
+
+
+static int
+location_name_cmp(const void *a, const void *b)
+{
+	return strcmp((*(struct command_location *const *)a)->name, (*(struct command_location *const *)b)->name);
+}
+
+
+size_t
+get_remembered_commands(const char ***pathsp)
+{
+	struct command_location **locations, *location;
+	size_t i, n = 0;
+
+	locations = emalloc(nlocations * sizeof(*locations) + 1);
+	for (i = 0; i < location_table_size; i++)
+		for (location = location_table[i]; location; location = location->next)
+			if (location->path)
+				locations[n++] = location;
+	qsort(locations, n, sizeof(*locations), location_name_cmp);
+
+	*pathsp = (const char **)locations;
+	for (i = 0; i < n; i++)
+		(*pathsp)[i] = locations[i]->path;
+	return n;
+}
+
+
+void
+get_command_hash_statistics(struct command_hash_statistics *statisticsp)
+{
+	*statisticsp = statistics;
+	statisticsp->entries = nlocations;
+}
@@ -0,0 +1,435 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+
+enum pattern_segment_type {
+	LITERAL,
+	ANY_CHARACTER,
+	CHARACTER_SET,
+	ANY_STRING
+};
+
+struct pattern_segment {
+	enum pattern_segment_type type;
+	size_t length; /* for LITERAL */
+	const char *text; /* for LITERAL, points into .text in struct pattern */
+	uint64_t set[4]; /* for CHARACTER_SET, bit per byte value */
+};
+
+struct pattern {
+	struct pattern_segment *segments;
+	size_t nsegments;
+	size_t min_length;
+	size_t max_length; /* SIZE_MAX if the pattern contains '*' */
+	int first_byte; /* -1 unless the pattern starts with a literal */
+	int last_byte; /* -1 unless the pattern ends with a literal */
+	char *text; /* literals with escapes removed */
+	char *source; /* the text the pattern was compiled from */
+	size_t source_length;
+};
+
+
+static const struct {
+	const char *name;
+	int (*function)(int c);
+} character_classes[] = {
+	{"alnum", isalnum},
+	{"alpha", isalpha},
+	{"blank", isblank},
+	{"cntrl", iscntrl},
+	{"digit", isdigit},
+	{"graph", isgraph},
+	{"lower", islower},
+	{"print", isprint},
+	{"punct", ispunct},
+	{"space", isspace},
+	{"upper", isupper},
+	{"xdigit", isxdigit}
+};
+
+
+static size_t
+parse_character_set(const char *s, size_t length, uint64_t set[4])
+{
+	size_t i = 1, j, k, name_length;
+	int negated = 0, at_start, c, first, last;
+
+	memset(set, 0, 4 * sizeof(*set));
+
+	if (i < length && (s[i] == '!' || s[i] == '^')) {
+		negated = 1;
+		i++;
+	}
+
+	for (at_start = 1; i < length; at_start = 0) {
+		if (s[i] == ']' && !at_start) {
+			if (negated)
+				for (k = 0; k < 4; k++)
+					set[k] = ~set[k];
+			return i + 1;
+		}
+
+		if (s[i] == '[' && i + 1 < length && s[i + 1] == ':') {
+			for (j = i + 2; j + 1 < length && !(s[j] == ':' && s[j + 1] == ']'); j++);
+			if (j + 1 < length) {
+				name_length = j - (i + 2);
+				for (k = 0; k < ELEMSOF(character_classes); k++) {
+					if (strlen(character_classes[k].name) == name_length &&
+					    !strncmp(character_classes[k].name, &s[i + 2], name_length))
+						break;
+				}
+				if (k < ELEMSOF(character_classes))
+					for (c = 0; c < 256; c++)
+						if (character_classes[k].function(c))
+							set[c >> 6] |= (uint64_t)1 << (c & 63);
+				i = j + 2;
+				continue;
+			}
+		}
+
+		if (s[i] == '\\' && i + 1 < length)
+			i++;
+		first = (unsigned char)s[i++];
+		last = first;
+		if (i + 1 < length && s[i] == '-' && s[i + 1] != ']') {
+			i++;
+			if (s[i] == '\\' && i + 1 < length)
+				i++;
+			last = (unsigned char)s[i++];
+		}
+		for (c = first; c <= last; c++)
+			set[c >> 6] |= (uint64_t)1 << (c & 63);
+	}
+
+	/* unterminated, '[' is an ordinary character */
+	return 0;
+}
+
+
+struct pattern *
+compile_pattern(const char *source, size_t length)
+{
+	struct pattern *pattern;
+	struct pattern_segment *segment = NULL;
+	size_t i, n, text_length = 0;
+	uint64_t set[4];
+
+	pattern = ecalloc(1, sizeof(*pattern));
+	pattern->segments = emalloc((length + 1) * sizeof(*pattern->segments));
+	pattern->text = emalloc(length + 1);
+	pattern->source = emalloc(length + 1);
+	memcpy(pattern->source, source, length);
+	pattern->source[length] = '\0';
+	pattern->source_length = length;
+
+	for (i = 0; i < length;) {
+		if (source[i] == '*') {
+			i++;
+			if (segment && segment->type == ANY_STRING)
+				continue;
+			segment = &pattern->segments[pattern->nsegments++];
+			segment->type = ANY_STRING;
+			continue;
+		}
+
+		if (source[i] == '?') {
+			i++;
+			segment = &pattern->segments[pattern->nsegments++];
+			segment->type = ANY_CHARACTER;
+			continue;
+		}
+
+		if (source[i] == '[' && (n = parse_character_set(&source[i], length - i, set))) {
+			i += n;
+			segment = &pattern->segments[pattern->nsegments++];
+			segment->type = CHARACTER_SET;
+			memcpy(segment->set, set, sizeof(set));
+			continue;
+		}
+
+		if (source[i] == '\\' && i + 1 < length)
+			i++;
+		if (!segment || segment->type != LITERAL) {
+			segment = &pattern->segments[pattern->nsegments++];
+			segment->type = LITERAL;
+			segment->text = &pattern->text[text_length];
+			segment->length = 0;
+		}
+		pattern->text[text_length++] = source[i++];
+		segment->length += 1;
+	}
+
+	pattern->first_byte = pattern->last_byte = -1;
+	for (i = 0; i < pattern->nsegments; i++) {
+		segment = &pattern->segments[i];
+		if (segment->type == ANY_STRING)
+			pattern->max_length = SIZE_MAX;
+		else
+			pattern->min_length += segment->type == LITERAL ? segment->length : 1;
+	}
+	if (pattern->max_length != SIZE_MAX)
+		pattern->max_length = pattern->min_length;
+	if (pattern->nsegments && pattern->segments[0].type == LITERAL)
+		pattern->first_byte = (unsigned char)pattern->segments[0].text[0];
+	if (pattern->nsegments && (segment = &pattern->segments[pattern->nsegments - 1])->type == LITERAL)
+		pattern->last_byte = (unsigned char)segment->text[segment->length - 1];
+
+	return pattern;
+}
+
+
+void
+free_pattern(struct pattern *pattern)
+{
+	if (pattern) {
+		free(pattern->segments);
+		free(pattern->text);
+		free(pattern->source);
+		free(pattern);
+	}
+}
+
+
+size_t
+measure_pattern(const struct pattern *pattern)
+{
+	if (!pattern)
+		return 0;
+	return sizeof(*pattern) + pattern->nsegments * sizeof(*pattern->segments) + 2 * (pattern->source_length + 1);
+}
+
+
+int
+pattern_compiled_from(const struct pattern *pattern, const char *source, size_t length)
+{
+	return pattern && pattern->source_length == length && !memcmp(pattern->source, source, length);
+}
+
+
+int
+is_literal_pattern(const struct pattern *pattern)
+{
+	return pattern->nsegments == 0 || (pattern->nsegments == 1 && pattern->segments[0].type == LITERAL);
+}
+
+
+const char *
+get_literal_pattern_text(const struct pattern *pattern, size_t *lengthp)
+{
+	/* only meaningful if is_literal_pattern() */
+	*lengthp = pattern->min_length;
+	return pattern->text;
+}
+
+
+static int
+match_segment(const struct pattern_segment *segment, const char *s)
+{
+	unsigned char c = (unsigned char)*s;
+	switch (segment->type) {
+	case LITERAL:
+		return !memcmp(s, segment->text, segment->length);
+	case ANY_CHARACTER:
+		return 1;
+	case CHARACTER_SET:
+		return (int)((segment->set[c >> 6] >> (c & 63)) & 1);
+	default:
+		abort();
+	}
+}
+
+
+int
+match_pattern(const struct pattern *pattern, const char *s, size_t length)
+{
+	const struct pattern_segment *segments = pattern->segments, *segment;
+	size_t i = 0, j = 0, star_i = SIZE_MAX, star_j = 0, n;
+	const char *found;
+
+	if (length < pattern->min_length || length > pattern->max_length)
+		return 0;
+
+	/* greedy matching, backtracking to the last '*' on mismatch,
+	 * which is sufficient since a later '*' can absorb anything
+	 * an earlier '*' could have */
+	for (;;) {
+		if (i < pattern->nsegments) {
+			segment = &segments[i];
+			if (segment->type == ANY_STRING) {
+				if (i + 1 == pattern->nsegments)
+					return 1;
+				star_i = i++;
+				star_j = j;
+				continue;
+			}
+			n = segment->type == LITERAL ? segment->length : 1;
+			if (n <= length - j && match_segment(segment, &s[j])) {
+				i++;
+				j += n;
+				continue;
+			}
+		} else if (j == length) {
+			return 1;
+		}
+
+		if (star_i == SIZE_MAX || star_j >= length)
+			return 0;
+		star_j += 1;
+		segment = &segments[star_i + 1];
+		if (star_i + 1 < pattern->nsegments && segment->type == LITERAL) {
+			/* skip directly to the next occurrence of the literal */
+			found = memmem(&s[star_j], length - star_j, segment->text, segment->length);
+			if (!found)
+				return 0;
+			star_j = (size_t)(found - s);
+		}
+		i = star_i + 1;
+		j = star_j;
+	}
+}
+
+
+int
+find_pattern_prefix(const struct pattern *pattern, const char *s, size_t length, int longest, size_t *endp)
+{
+	size_t end, min_end, max_end;
+	const char *p;
+
+	if (pattern->first_byte >= 0 && (!length || (unsigned char)*s != pattern->first_byte))
+		return 0;
+	if (is_literal_pattern(pattern)) {
+		if (pattern->min_length > length || memcmp(s, pattern->text, pattern->min_length))
+			return 0;
+		*endp = pattern->min_length;
+		return 1;
+	}
+
+	min_end = pattern->min_length;
+	max_end = MIN(pattern->max_length, length);
+	if (min_end > max_end)
+		return 0;
+
+	/* if the pattern ends with a literal, only lengths ending with
+	 * its last byte are tried (in which case min_end is non-zero) */
+	if (longest) {
+		for (end = max_end;; end--) {
+			if (pattern->last_byte >= 0) {
+				p = memrchr(&s[min_end - 1], pattern->last_byte, end - (min_end - 1));
+				if (!p)
+					return 0;
+				end = (size_t)(p - s) + 1;
+			}
+			if (match_pattern(pattern, s, end))
+				break;
+			if (end == min_end)
+				return 0;
+		}
+	} else {
+		for (end = min_end;; end++) {
+			if (pattern->last_byte >= 0) {
+				p = memchr(&s[end - 1], pattern->last_byte, max_end - (end - 1));
+				if (!p)
+					return 0;
+				end = (size_t)(p - s) + 1;
+			}
+			if (match_pattern(pattern, s, end))
+				break;
+			if (end == max_end)
+				return 0;
+		}
+	}
+
+	*endp = end;
+	return 1;
+}
+
+
+int
+find_pattern_suffix(const struct pattern *pattern, const char *s, size_t length, int longest, size_t *startp)
+{
+	size_t start, min_start, max_start;
+	const char *p;
+
+	if (pattern->last_byte >= 0 && (!length || (unsigned char)s[length - 1] != pattern->last_byte))
+		return 0;
+	if (is_literal_pattern(pattern)) {
+		if (pattern->min_length > length || memcmp(&s[length - pattern->min_length], pattern->text, pattern->min_length))
+			return 0;
+		*startp = length - pattern->min_length;
+		return 1;
+	}
+
+	if (pattern->min_length > length)
+		return 0;
+	max_start = length - pattern->min_length;
+	min_start = pattern->max_length >= length ? 0 : length - pattern->max_length;
+
+	/* likewise, if the pattern starts with a literal, only offsets
+	 * starting with its first byte are tried */
+	if (longest) {
+		for (start = min_start;; start++) {
+			if (pattern->first_byte >= 0) {
+				p = memchr(&s[start], pattern->first_byte, max_start + 1 - start);
+				if (!p)
+					return 0;
+				start = (size_t)(p - s);
+			}
+			if (match_pattern(pattern, &s[start], length - start))
+				break;
+			if (start == max_start)
+				return 0;
+		}
+	} else {
+		for (start = max_start;; start--) {
+			if (pattern->first_byte >= 0) {
+				p = memrchr(&s[min_start], pattern->first_byte, start + 1 - min_start);
+				if (!p)
+					return 0;
+				start = (size_t)(p - s);
+			}
+			if (match_pattern(pattern, &s[start], length - start))
+				break;
+			if (start == min_start)
+				return 0;
+		}
+	}
+
+	*startp = start;
+	return 1;
+}
+
+
+int
+find_pattern(const struct pattern *pattern, const char *s, size_t length, size_t *startp, size_t *endp)
+{
+	size_t start;
+	const char *p;
+
+	if (is_literal_pattern(pattern)) {
+		if (!pattern->min_length)
+			return 0;
+		p = memmem(s, length, pattern->text, pattern->min_length);
+		if (!p)
+			return 0;
+		*startp = (size_t)(p - s);
+		*endp = *startp + pattern->min_length;
+		return 1;
+	}
+
+	/* leftmost, then longest, match */
+	for (start = 0; start + pattern->min_length <= length; start++) {
+		if (pattern->first_byte >= 0) {
+			p = memchr(&s[start], pattern->first_byte, length - start);
+			if (!p)
+				return 0;
+			start = (size_t)(p - s);
+		}
+		if (find_pattern_prefix(pattern, &s[start], length - start, 1, endp)) {
+			*startp = start;
+			*endp += start;
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,159 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+
+/* Pipes and sockets created with mkpipe are kept by the shell under
+ * a name until they are removed with rmpipe, so that a topology of
+ * long-running commands can be connected through them without FIFOs
+ * on disk and without new pipes per iteration. They are referenced
+ * by name in '<&name', '<>&name' (which are given the first end) and
+ * '>&name' (which is given the second end), just like fds[0] and fds[1]
+ * of pipe(2). They are close on exec, so a command only receives
+ * the ends that it names */
+
+struct plumbing {
+	char *name;
+	int fds[2];
+	struct plumbing *next;
+};
+
+static struct plumbing *plumbing_list;
+
+
+static struct plumbing **
+find_plumbing(const char *name)
+{
+	struct plumbing **entryp;
+
+	for (entryp = &plumbing_list; *entryp; entryp = &(*entryp)->next)
+		if (!strcmp((*entryp)->name, name))
+			break;
+	return entryp;
+}
+
+
+int
+get_plumbing_fd(const char *name, int output)
+{
+	struct plumbing *entry = *find_plumbing(name);
+	return entry ? entry->fds[!!output] : -1;
+}
+
+
+PURE_FUNC
+static int
+is_valid_plumbing_name(const char *name)
+{
+	/* must not be confused with a file descriptor number or '-' */
+	if (!isalpha(*name) && *name != '_')
+		return 0;
+	for (name++; *name; name++)
+		if (!isalnum(*name) && *name != '_')
+			return 0;
+	return 1;
+}
+
+
+static int
+move_fd_high(int fd)
+{
+	int copy;
+
+	/* out of the way of the file descriptors used in redirections */
+	copy = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+	if (copy < 0)
+		weprintf("fcntl %i F_DUPFD_CLOEXEC:", fd);
+	close(fd);
+	return copy;
+}
+
+
+BUILTIN_USAGE(mkpipe_usage, "[-s] name ...")
+int
+mkpipe_main(int argc, char **argv)
+{
+	int (*usage)(void) = mkpipe_usage;
+	struct plumbing *entry;
+	int socket = 0, ret = 0;
+
+	ARGBEGIN {
+	case 's':
+		socket = 1;
+		break;
+	default:
+		return usage();
+	} ARGEND;
+
+	if (!argc)
+		return usage();
+
+	for (; argc--; argv++) {
+		if (!is_valid_plumbing_name(*argv)) {
+			weprintf("%s: invalid name\n", *argv);
+			ret = 1;
+			continue;
+		}
+		if (*find_plumbing(*argv)) {
+			weprintf("%s: already exists\n", *argv);
+			ret = 1;
+			continue;
+		}
+		/* mkpipe runs in the shell itself, so running out of
+		 * file descriptors must not take the shell down with it */
+		entry = emalloc(sizeof(*entry));
+		if (try_create_pipe(entry->fds, socket)) {
+			free(entry);
+			ret = 1;
+			continue;
+		}
+		entry->fds[0] = move_fd_high(entry->fds[0]);
+		entry->fds[1] = move_fd_high(entry->fds[1]);
+		if (entry->fds[0] < 0 || entry->fds[1] < 0) {
+			if (entry->fds[0] >= 0)
+				close(entry->fds[0]);
+			if (entry->fds[1] >= 0)
+				close(entry->fds[1]);
+			free(entry);
+			ret = 1;
+			continue;
+		}
+		entry->name = estrdup(*argv);
+		entry->next = plumbing_list;
+		plumbing_list = entry;
+	}
+	return ret;
+}
+
+
+BUILTIN_USAGE(rmpipe_usage, "name ...")
+int
+rmpipe_main(int argc, char **argv)
+{
+	int (*usage)(void) = rmpipe_usage;
+	struct plumbing **entryp, *entry;
+	int ret = 0;
+
+	ARGBEGIN {
+	default:
+		return usage();
+	} ARGEND;
+
+	if (!argc)
+		return usage();
+
+	for (; argc--; argv++) {
+		entryp = find_plumbing(*argv);
+		if (!*entryp) {
+			weprintf("%s: not found\n", *argv);
+			ret = 1;
+			continue;
+		}
+		entry = *entryp;
+		*entryp = entry->next;
+		close(entry->fds[0]);
+		close(entry->fds[1]);
+		free(entry->name);
+		free(entry);
+	}
+	return ret;
+}
@@ -24,11 +24,13 @@ BUILTIN_USAGE(pwd_usage, "[-L | -P]")
 int
 pwd_main(int argc, char **argv)
 {
-	void (*usage)(void) = pwd_usage;
+	int (*usage)(void) = pwd_usage;
         int physical = 0;
         char *cwd = NULL;
         size_t size = 64 / 2;
         const char *pwd;
+	struct text_buffer pwd_copy = {NULL, 0, 0};
+	size_t pwd_length;
 	struct stat cst, pst;
 
 	ARGBEGIN {
@@ -39,7 +41,7 @@ pwd_main(int argc, char **argv)
 		physical = 1;
 		break;
 	default:
-		usage();
+		return usage();
 	} ARGEND;
 
 	if (argc)
@@ -49,11 +51,15 @@ pwd_main(int argc, char **argv)
 		cwd = erealloc(cwd, size *= 2);
 		if (getcwd(cwd, size))
 			break;
-		if (errno != ERANGE)
-			eprintf("getcwd %zu:", size);
+		if (errno != ERANGE) {
+			weprintf("getcwd %zu:", size);
+			free(cwd);
+			return 1;
+		}
 	}
 
-	if (physical || !(pwd = getenv("PWD")) || *pwd != '/' || stat(pwd, &pst) || stat(cwd, &cst))
+	pwd = physical ? NULL : get_variable_value(get_variable_slot("PWD", sizeof("PWD") - 1), &pwd_length, &pwd_copy);
+	if (!pwd || *pwd != '/' || stat(pwd, &pst) || stat(cwd, &cst))
 		puts(cwd);
 	else if (pst.st_dev == cst.st_dev && pst.st_ino == cst.st_ino)
 		puts(pwd);
@@ -61,7 +67,226 @@ pwd_main(int argc, char **argv)
 		puts(cwd);
 
 	free(cwd);
+	free(pwd_copy.text);
 	if (fflush(stdout) || ferror(stdout))
 		weprintf("fflush <stdout>:");
 	return 0;
 }
+
+
+BUILTIN_USAGE(sourcestat_usage, "")
+int
+sourcestat_main(int argc, char **argv)
+{
+	int (*usage)(void) = sourcestat_usage;
+	struct source_cache_statistics statistics;
+
+	ARGBEGIN {
+	default:
+		return usage();
+	} ARGEND;
+
+	if (argc)
+		return usage();
+
+	get_source_cache_statistics(&statistics);
+	printf("hits: %zu\n", statistics.hits);
+	printf("misses: %zu\n", statistics.misses);
+	printf("evictions: %zu\n", statistics.evictions);
+	printf("entries: %zu\n", statistics.entries);
+	printf("memory: %zu\n", statistics.memory);
+
+	if (fflush(stdout) || ferror(stdout))
+		weprintf("fflush <stdout>:");
+	return 0;
+}
+
+
+BUILTIN_USAGE(hash_usage, "[-r | -s | utility ...]")
+int
+hash_main(int argc, char **argv)
+{
+	int (*usage)(void) = hash_usage;
+	struct command_hash_statistics statistics;
+	const char **paths;
+	int forget = 0, print_statistics = 0, ret = 0;
+	size_t n, i;
+
+	ARGBEGIN {
+	case 'r':
+		forget = 1;
+		break;
+	case 's':
+		print_statistics = 1;
+		break;
+	default:
+		return usage();
+	} ARGEND;
+
+	if ((forget || print_statistics) && (argc || forget == print_statistics))
+		return usage();
+
+	if (forget) {
+		forget_commands();
+		return 0;
+	}
+
+	if (print_statistics) {
+		get_command_hash_statistics(&statistics);
+		printf("hits: %zu\n", statistics.hits);
+		printf("negative hits: %zu\n", statistics.negative_hits);
+		printf("misses: %zu\n", statistics.misses);
+		printf("invalidations: %zu\n", statistics.invalidations);
+		printf("entries: %zu\n", statistics.entries);
+	} else if (!argc) {
+		n = get_remembered_commands(&paths);
+		for (i = 0; i < n; i++)
+			puts(paths[i]);
+		free(paths);
+	}
+
+	for (; argc--; argv++) {
+		if (!find_command(*argv)) {
+			weprintf("%s: not found\n", *argv);
+			ret = 1;
+		}
+	}
+
+	if (fflush(stdout) || ferror(stdout))
+		weprintf("fflush <stdout>:");
+	return ret;
+}
+
+
+static void
+print_alias(const struct alias *alias)
+{
+	const char *s;
+
+	printf("%s='", alias->name);
+	for (s = alias->value; *s; s++) {
+		if (*s == '\'')
+			fputs("'\\''", stdout);
+		else
+			putchar(*s);
+	}
+	printf("'\n");
+}
+
+
+static int
+is_valid_alias_name(const char *name, size_t length)
+{
+	struct argument word;
+	size_t i;
+
+	if (!length)
+		return 0;
+	for (i = 0; i < length; i++)
+		if (!isalnum(name[i]) && !strchr("_!%,@", name[i]))
+			return 0;
+
+	/* POSIX allows aliases named after reserved words, even though
+	 * they can only be used where the reserved word is not recognised */
+	if (!posix_mode) {
+		memset(&word, 0, sizeof(word));
+		word.type = UNQUOTED;
+		word.text = (char *)name;
+		word.length = length;
+		if (get_reserved_word(&word))
+			return 0;
+	}
+
+	return 1;
+}
+
+
+BUILTIN_USAGE(alias_usage, "[name[=value] ...]")
+int
+alias_main(int argc, char **argv)
+{
+	int (*usage)(void) = alias_usage;
+	struct alias **aliases, *alias;
+	size_t naliases, i, length;
+	char *value;
+	int ret = 0;
+
+	ARGBEGIN {
+	default:
+		return usage();
+	} ARGEND;
+
+	if (!argc) {
+		naliases = get_aliases(&aliases);
+		for (i = 0; i < naliases; i++)
+			print_alias(aliases[i]);
+		free(aliases);
+	}
+
+	for (; argc--; argv++) {
+		value = strchr(*argv, '=');
+		length = value ? (size_t)(value - *argv) : strlen(*argv);
+		if (value) {
+			if (parsing_ahead) {
+				weprintf("%.*s: aliases cannot be defined with -T\n", (int)length, *argv);
+				ret = 1;
+			} else if (!is_valid_alias_name(*argv, length)) {
+				weprintf("%.*s: invalid alias name\n", (int)length, *argv);
+				ret = 1;
+			} else if (define_alias(*argv, length, &value[1])) {
+				ret = 1;
+			}
+		} else if ((alias = get_alias(*argv, length))) {
+			print_alias(alias);
+		} else {
+			weprintf("%s: not found\n", *argv);
+			ret = 1;
+		}
+	}
+
+	if (fflush(stdout) || ferror(stdout))
+		weprintf("fflush <stdout>:");
+	return ret;
+}
+
+
+BUILTIN_USAGE(unalias_usage, "-a | name ...")
+int
+unalias_main(int argc, char **argv)
+{
+	int (*usage)(void) = unalias_usage;
+	int all = 0, ret = 0;
+
+	ARGBEGIN {
+	case 'a':
+		all = 1;
+		break;
+	default:
+		return usage();
+	} ARGEND;
+
+	/* the front end would be using the aliases, see threads.c */
+	if (parsing_ahead) {
+		weprintf("aliases cannot be removed with -T\n");
+		return 1;
+	}
+
+	if (all) {
+		if (argc)
+			return usage();
+		undefine_all_aliases();
+		return 0;
+	}
+
+	if (!argc)
+		return usage();
+
+	for (; argc--; argv++) {
+		if (undefine_alias(*argv, strlen(*argv))) {
+			weprintf("%s: not found\n", *argv);
+			ret = 1;
+		}
+	}
+
+	return ret;
+}
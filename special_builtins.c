@@ -9,3 +9,193 @@ colon_main(int argc, char **argv)
 	(void) argv;
 	return 0;
 }
+
+
+static int
+open_sourced_script(const char *name)
+{
+	struct variable *path_variable;
+	struct text_buffer copy = {NULL, 0, 0};
+	const char *path, *end;
+	struct stat st;
+	size_t length, name_length;
+	char *file;
+	int fd;
+
+	if (strchr(name, '/'))
+		return open(name, O_RDONLY | O_CLOEXEC);
+
+	/* unlike commands, sourced files need not be executable,
+	 * so they are not looked up with find_command() */
+	path_variable = get_variable_slot("PATH", sizeof("PATH") - 1);
+	path = get_variable_value(path_variable, &length, &copy);
+	if (!path)
+		path = "/bin:/usr/bin";
+	name_length = strlen(name);
+	file = emalloc(strlen(path) + 1 + name_length + 1);
+	for (fd = -1; fd < 0; path = &end[1]) {
+		end = strchrnul(path, ':');
+		length = (size_t)(end - path);
+		if (length) {
+			memcpy(file, path, length);
+			file[length++] = '/';
+		}
+		memcpy(&file[length], name, name_length + 1);
+		fd = open(file, O_RDONLY | O_CLOEXEC);
+		if (fd >= 0 && (fstat(fd, &st) || S_ISDIR(st.st_mode))) {
+			close(fd);
+			fd = -1;
+		}
+		if (!*end)
+			break;
+	}
+	free(file);
+	free(copy.text);
+	if (fd < 0)
+		errno = ENOENT;
+	return fd;
+}
+
+
+BUILTIN_USAGE(dot_usage, "file")
+int
+dot_main(int argc, char **argv)
+{
+	int (*usage)(void) = dot_usage;
+	struct sourced_script *script;
+	int fd;
+
+	ARGBEGIN {
+	default:
+		return usage();
+	} ARGEND;
+
+	if (argc != 1)
+		return usage();
+
+	fd = open_sourced_script(*argv);
+	if (fd < 0) {
+		weprintf("open %s:", *argv);
+		return 1;
+	}
+	script = acquire_sourced_script(fd, *argv);
+	close(fd);
+	return execute_and_release_script(script);
+}
+
+
+PURE_FUNC
+static int
+is_valid_variable_name(const char *name, size_t length)
+{
+	size_t i;
+
+	if (!length || isdigit(*name))
+		return 0;
+	for (i = 0; i < length; i++)
+		if (!isalnum(name[i]) && name[i] != '_')
+			return 0;
+	return 1;
+}
+
+
+static void
+print_exported_variable(struct variable *variable, struct text_buffer *copy)
+{
+	const char *value, *s;
+	size_t length;
+
+	value = get_variable_value(variable, &length, copy);
+	printf("export %s", variable->name);
+	if (!value) {
+		putchar('\n');
+		return;
+	}
+	fputs("='", stdout);
+	for (s = value; *s; s++) {
+		if (*s == '\'')
+			fputs("'\\''", stdout);
+		else
+			putchar(*s);
+	}
+	printf("'\n");
+}
+
+
+BUILTIN_USAGE(export_usage, "[-n] name[=value] ... | -p")
+int
+export_main(int argc, char **argv)
+{
+	int (*usage)(void) = export_usage;
+	struct text_buffer copy = {NULL, 0, 0};
+	struct variable **variables, *variable;
+	int print = 0, unexport = 0, ret = 0;
+	size_t nvariables, i, length;
+	char *value;
+
+	ARGBEGIN {
+	case 'p':
+		print = 1;
+		break;
+	case 'n':
+		unexport = 1;
+		break;
+	default:
+		return usage();
+	} ARGEND;
+
+	if (print ? argc || unexport : !argc)
+		return usage();
+
+	if (print) {
+		nvariables = get_exported_variables(&variables);
+		for (i = 0; i < nvariables; i++)
+			print_exported_variable(variables[i], &copy);
+		free(variables);
+		free(copy.text);
+		if (fflush(stdout) || ferror(stdout))
+			weprintf("fflush <stdout>:");
+		return 0;
+	}
+
+	for (; argc--; argv++) {
+		value = strchr(*argv, '=');
+		length = value ? (size_t)(value - *argv) : strlen(*argv);
+		if (!is_valid_variable_name(*argv, length)) {
+			weprintf("%.*s: invalid variable name\n", (int)length, *argv);
+			ret = 1;
+			continue;
+		}
+		variable = get_variable_slot(*argv, length);
+		if (value)
+			set_variable(variable, &value[1], strlen(&value[1]));
+		export_variable(variable, !unexport);
+	}
+	return ret;
+}
+
+
+BUILTIN_USAGE(unset_usage, "[-v] name ...")
+int
+unset_main(int argc, char **argv)
+{
+	int (*usage)(void) = unset_usage;
+	int ret = 0;
+
+	ARGBEGIN {
+	case 'v':
+		break;
+	default:
+		return usage();
+	} ARGEND;
+
+	for (; argc--; argv++) {
+		if (!is_valid_variable_name(*argv, strlen(*argv))) {
+			weprintf("%s: invalid variable name\n", *argv);
+			ret = 1;
+			continue;
+		}
+		unset_variable(get_variable_slot(*argv, strlen(*argv)));
+	}
+	return ret;
+}
@@ -0,0 +1,56 @@
+#!/bin/sh
+# 'for name do', 'for name; do' and 'for name in ...; do', at top level,
+# where there are no positional parameters, and in a function body
+# usage: for.sh apsh
+
+set -e
+apsh="$1"
+dir="$(mktemp -d)"
+trap 'rm -rf -- "$dir"' EXIT
+
+cat > "$dir/script" <<'SCRIPT'
+for x do echo "top do $x"; done
+for x; do echo "top semicolon $x"; done
+for x in a b; do echo "top in $x"; done
+for x
+do
+	echo "top newline $x"
+done
+f() {
+	for x do echo "function do $x"; done
+	for x; do echo "function semicolon $x"; done
+	for x in a b; do echo "function in $x"; done
+	for x
+	do
+		echo "function newline $x"
+	done
+}
+f 1 2
+echo end
+SCRIPT
+
+cat > "$dir/expected" <<'EXPECTED'
+top in a
+top in b
+function do 1
+function do 2
+function semicolon 1
+function semicolon 2
+function in a
+function in b
+function newline 1
+function newline 2
+end
+EXPECTED
+
+for flags in '' -n; do
+	"$apsh" $flags "$dir/script" > "$dir/output"
+	if test -n "$flags"; then
+		: > "$dir/expected"
+	fi
+	if ! cmp -s "$dir/expected" "$dir/output"; then
+		printf '%s\n' "apsh $flags printed:" >&2
+		cat "$dir/output" >&2
+		exit 1
+	fi
+done
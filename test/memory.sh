@@ -0,0 +1,39 @@
+#!/bin/sh
+# A never-ending stream of commands can be run in bounded memory:
+# millions of commands, including function definitions, are piped
+# into apsh, and its peak resident set size is checked at the end
+# usage: [COMMANDS=n] [MEMORY_LIMIT=kB] memory.sh apsh
+
+set -e
+apsh="$1"
+commands="${COMMANDS:-2000000}"
+limit="${MEMORY_LIMIT:-8192}"
+dir="$(mktemp -d)"
+trap 'rm -rf -- "$dir"' EXIT
+
+awk -v n="$commands" 'BEGIN {
+	for (i = 0; i < n; i += 5) {
+		print "x=" i
+		print "if : \"$x\"; then y=${x#1}; fi"
+		print "f() { z=$1; }"
+		print "f " i
+		print "for w in a b; do :; done"
+	}
+	print "echo \"$x $z\""
+	print "grep VmHWM /proc/$$/status"
+}' | "$apsh" > "$dir/output"
+
+last=$(( (commands + 4) / 5 * 5 - 5 ))
+{
+	read -r values
+	read -r _ peak _
+} < "$dir/output"
+
+if test "$values" != "$last $last"; then
+	printf '%s\n' "the last command values were '$values', but should be '$last $last'" >&2
+	exit 1
+fi
+if test -z "$peak" || test "$peak" -gt "$limit"; then
+	printf '%s\n' "peak RSS was '$peak' kB, which is over the limit of $limit kB" >&2
+	exit 1
+fi
@@ -0,0 +1,60 @@
+#!/bin/sh
+# $$, $# and $0 are set before the first command is run, and
+# "$@" is a field per positional parameter
+# usage: parameters.sh apsh
+
+set -e
+apsh="$1"
+dir="$(mktemp -d)"
+trap 'rm -rf -- "$dir"' EXIT
+
+cat > "$dir/script" <<'SCRIPT'
+echo "$$"
+cut -d ' ' -f 4 /proc/self/stat
+echo "[$#] [$0]"
+count() { echo "$#:$1:$2"; }
+f() {
+	count "$@"
+	count "<$@>"
+	for a in "$@"; do echo "[$a]"; done
+}
+f "a b" c
+f ""
+f
+count "$@"
+SCRIPT
+
+cat > "$dir/expected" <<'EXPECTED'
+2:a b:c
+2:<a b:c>
+[a b]
+[c]
+1::
+1:<>:
+[]
+0::
+1:<>:
+0::
+EXPECTED
+
+"$apsh" "$dir/script" > "$dir/output"
+{
+	read -r pid
+	read -r parent
+	read -r rest
+	cat > "$dir/fields"
+} < "$dir/output"
+
+if test -z "$pid" || test "$pid" != "$parent"; then
+	printf '%s\n' "\$\$ is '$pid', but apsh's process ID is '$parent'" >&2
+	exit 1
+fi
+if test "$rest" != "[0] [$dir/script]"; then
+	printf '%s\n' "\$# and \$0 are '$rest', but should be '[0] [$dir/script]'" >&2
+	exit 1
+fi
+if ! cmp -s "$dir/expected" "$dir/fields"; then
+	printf '%s\n' '"$@" was expanded to:' >&2
+	cat "$dir/fields" >&2
+	exit 1
+fi
@@ -0,0 +1,262 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+
+/* With -T, the script is processed by three threads: a reader that
+ * fills input segments, a front end that runs parse() through
+ * interpret_and_eliminate(), and the executor, which is the main
+ * thread. They are connected by single-producer/single-consumer
+ * queues, so the front end parses command N+1 while command N is
+ * being executed.
+ *
+ * The front end and the executor share the alias table, which only
+ * the front end reads, and the variable table, in which the front end
+ * looks up slots for $name parts and arithmetic expressions; anything
+ * else that the interpreter and the executor have in common must be
+ * accessed by only one of them. As the front end has already parsed the commands
+ * after the one being executed, the alias and unalias builtins refuse
+ * to change the aliases, rather than have their effect depend on how
+ * far ahead the front end is */
+
+struct queue_item {
+	void *pointer; /* NULL at the end of the stream */
+	size_t length;
+};
+
+struct queue {
+	struct queue_item items[MAX(INPUT_QUEUE_CAPACITY, COMMAND_QUEUE_CAPACITY)];
+	unsigned int capacity; /* must be a power of 2 */
+	atomic_uint head; /* next item to pop, only written by the consumer */
+	atomic_uint tail; /* next item to push, only written by the producer */
+	atomic_uint waiting; /* number of threads blocked on the queue */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+struct front_end {
+	struct parser_context *ctx;
+	const char *name;
+	struct queue_item segment; /* being consumed by parse_input() */
+	size_t segment_offset;
+};
+
+struct reader {
+	int fd;
+	const char *name;
+};
+
+static struct queue input_queue = {
+	.capacity = INPUT_QUEUE_CAPACITY,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER
+};
+
+static struct queue command_queue = {
+	.capacity = COMMAND_QUEUE_CAPACITY,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER
+};
+
+char parsing_ahead;
+
+static _Thread_local char is_front_end;
+static int spin_count; /* QUEUE_SPIN_COUNT, or 0 if there is only one processor */
+
+
+static void
+wait_for_change(struct queue *queue, atomic_uint *index, unsigned int seen)
+{
+	int i;
+
+	/* the other side is usually only a moment behind,
+	 * so it is worth polling for a while before sleeping */
+	for (i = 0; i < spin_count; i++)
+		if (atomic_load_explicit(index, memory_order_acquire) != seen)
+			return;
+
+	/* .waiting is incremented before the index is read again,
+	 * and notify() reads .waiting after the index is written,
+	 * so either this sees the new index or it is woken up; it
+	 * is a count rather than a flag because the producer may
+	 * start waiting just before the consumer stops waiting */
+	pthread_mutex_lock(&queue->mutex);
+	atomic_fetch_add(&queue->waiting, 1);
+	while (atomic_load(index) == seen)
+		pthread_cond_wait(&queue->cond, &queue->mutex);
+	atomic_fetch_sub(&queue->waiting, 1);
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+
+static void
+notify(struct queue *queue)
+{
+	if (atomic_load(&queue->waiting)) {
+		pthread_mutex_lock(&queue->mutex);
+		pthread_cond_broadcast(&queue->cond);
+		pthread_mutex_unlock(&queue->mutex);
+	}
+}
+
+
+static void
+push_item(struct queue *queue, void *pointer, size_t length)
+{
+	unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	unsigned int head;
+
+	while (tail - (head = atomic_load_explicit(&queue->head, memory_order_acquire)) == queue->capacity)
+		wait_for_change(queue, &queue->head, head);
+
+	queue->items[tail & (queue->capacity - 1)].pointer = pointer;
+	queue->items[tail & (queue->capacity - 1)].length = length;
+	atomic_store(&queue->tail, tail + 1);
+	notify(queue);
+}
+
+
+static struct queue_item
+pop_item(struct queue *queue)
+{
+	unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	unsigned int tail;
+	struct queue_item item;
+
+	while ((tail = atomic_load_explicit(&queue->tail, memory_order_acquire)) == head)
+		wait_for_change(queue, &queue->tail, tail);
+
+	item = queue->items[head & (queue->capacity - 1)];
+	atomic_store(&queue->head, head + 1);
+	notify(queue);
+	return item;
+}
+
+
+void
+queue_commands(struct command **commands, size_t ncommands)
+{
+	if (!ncommands) {
+		free(commands);
+		return;
+	}
+	push_item(&command_queue, commands, ncommands);
+}
+
+
+static void *
+run_reader(void *data)
+{
+	struct reader *reader = data;
+	char *segment;
+	ssize_t r;
+
+	for (;;) {
+		segment = emalloc(INPUT_SEGMENT_SIZE);
+		r = read(reader->fd, segment, INPUT_SEGMENT_SIZE);
+		if (r <= 0) {
+			free(segment);
+			if (!r)
+				break;
+			eprintf("read %s:", reader->name);
+		}
+		push_item(&input_queue, segment, (size_t)r);
+	}
+
+	push_item(&input_queue, NULL, 0);
+	return NULL;
+}
+
+
+static ssize_t
+read_segment(void *data, char *buffer, size_t size)
+{
+	struct front_end *front_end = data;
+	struct queue_item *segment = &front_end->segment;
+
+	if (!segment->pointer) {
+		*segment = pop_item(&input_queue);
+		front_end->segment_offset = 0;
+		if (!segment->pointer)
+			return 0;
+	}
+
+	size = MIN(size, segment->length - front_end->segment_offset);
+	memcpy(buffer, &((char *)segment->pointer)[front_end->segment_offset], size);
+	front_end->segment_offset += size;
+
+	if (front_end->segment_offset == segment->length) {
+		free(segment->pointer);
+		segment->pointer = NULL;
+	}
+	return (ssize_t)size;
+}
+
+
+static void *
+run_front_end(void *data)
+{
+	struct front_end *front_end = data;
+
+	is_front_end = 1;
+	parse_input(front_end->ctx, read_segment, front_end, front_end->name);
+	push_item(&command_queue, NULL, 0);
+	return NULL;
+}
+
+
+static void
+finish_executing(void)
+{
+	unsigned int head, tail;
+
+	/* If the front end exits on a syntax error, the commands
+	 * before the error are still executed, as they would have
+	 * been without threads. The executor stops at the marker
+	 * and lets this thread do the exit */
+	if (!is_front_end)
+		return;
+	push_item(&command_queue, NULL, 1);
+	tail = atomic_load(&command_queue.tail);
+	while ((head = atomic_load(&command_queue.head)) != tail)
+		wait_for_change(&command_queue, &command_queue.head, head);
+}
+
+
+void
+parse_file_threaded(struct parser_context *ctx, int fd, const char *name)
+{
+	struct reader reader = {fd, name};
+	struct front_end front_end = {ctx, name, {NULL, 0}, 0};
+	pthread_t reader_thread, front_end_thread;
+	struct queue_item item;
+	int err;
+
+	ctx->run_commands = 0;
+	ctx->queue_commands = 1;
+	variable_table_shared = 1;
+	parsing_ahead = 1;
+	spin_count = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? QUEUE_SPIN_COUNT : 0;
+
+	atexit(finish_executing);
+	if ((err = pthread_create(&reader_thread, NULL, run_reader, &reader)))
+		eprintf("pthread_create: %s\n", strerror(err));
+	if ((err = pthread_create(&front_end_thread, NULL, run_front_end, &front_end)))
+		eprintf("pthread_create: %s\n", strerror(err));
+
+	for (;;) {
+		item = pop_item(&command_queue);
+		if (!item.pointer) {
+			if (item.length)
+				for (;;)
+					pause();
+			break;
+		}
+		execute_and_release(item.pointer, item.length);
+		free(item.pointer);
+	}
+
+	pthread_join(front_end_thread, NULL);
+	pthread_join(reader_thread, NULL);
+}
@@ -159,6 +159,18 @@ get_here_document_terminator(struct parser_context *ctx)
 }
 
 
+static void
+push_here_document_text(struct parser_context *ctx, char *text, size_t text_len)
+{
+	/* unless the terminator was quoted, the text is subject to
+	 * parameter expansion, so it is interpreted as in "…" */
+	if (ctx->here_document_stack->verbatim)
+		push_quoted(ctx, text, text_len);
+	else
+		push_unquoted(ctx, text, text_len);
+}
+
+
 int
 check_extension(const char *token, size_t line_number)
 {
@@ -171,6 +183,17 @@ check_extension(const char *token, size_t line_number)
 }
 
 
+PURE_FUNC
+static size_t
+count_newlines(const char *text, size_t length)
+{
+	size_t n = 0;
+	while (length--)
+		n += *text++ == '\n';
+	return n;
+}
+
+
 size_t
 parse_preparsed(struct parser_context *ctx, char *code, size_t code_len)
 {
@@ -208,8 +231,10 @@ parse_preparsed(struct parser_context *ctx, char *code, size_t code_len)
 			} else if (*code == ')' && ctx->mode_stack->previous) {
 				token_len = 1;
 				ctx->mode_stack->she_is_comment = 1;
-				pop_mode(ctx);
-				push_leave(ctx);
+				if (!push_case_pattern_symbol(ctx, ')')) {
+					push_leave(ctx);
+					pop_mode(ctx);
+				}
 
 			} else if (IS_SYMBOL(*code)) {
 				ctx->mode_stack->she_is_comment = 1;
@@ -239,6 +264,7 @@ parse_preparsed(struct parser_context *ctx, char *code, size_t code_len)
 			squote_end:
 				token_len += 1;
 				push_quoted(ctx, &code[1], token_len - 2);
+				ctx->tokeniser_line_number += count_newlines(&code[1], token_len - 2);
 
 			} else if (*code == '"') {
 				ctx->mode_stack->she_is_comment = 0;
@@ -305,6 +331,7 @@ parse_preparsed(struct parser_context *ctx, char *code, size_t code_len)
 				dollar_squote_end:
 					token_len += 1;
 					push_escaped(ctx, &code[2], token_len - 3);
+					ctx->tokeniser_line_number += count_newlines(&code[2], token_len - 3);
 
 				} else {
 					token_len = 1;
@@ -370,22 +397,24 @@ parse_preparsed(struct parser_context *ctx, char *code, size_t code_len)
 								goto need_more;
 							} else if (code[token_len + 1] == '$' || code[token_len + 1] == '`') {
 								here_doc_stack->line_offset = 0;
-								push_quoted(ctx, code, token_len);
+								push_here_document_text(ctx, code, token_len);
 								push_quoted(ctx, &code[token_len + 1], 1);
+								token_len += 2;
 								goto next;
 							}
 							token_len += 1;
 						} else if (code[token_len] == '$') {
 							here_doc_stack->line_offset = 0;
-							push_quoted(ctx, code, token_len);
+							push_here_document_text(ctx, code, token_len);
 							bytes_read += token_len;
 							code = &code[token_len];
 							goto quote_mode_dollar_mode;
 						} else if (code[token_len] == '`') {
 							here_doc_stack->line_offset = 0;
-							push_quoted(ctx, code, token_len);
+							push_here_document_text(ctx, code, token_len);
 							push_mode(ctx, BQ_QUOTE_MODE);
 							push_enter(ctx, BACKQUOTE_EXPRESSION);
+							token_len += 1;
 							goto next;
 						}
 					}
@@ -394,13 +423,13 @@ parse_preparsed(struct parser_context *ctx, char *code, size_t code_len)
 
 			here_document_line_end:
 				token_len += 1;
-				ctx->tokeniser_line_number += 1;
 				here_doc_stack->line_offset = 0;
 				here_document = here_doc_stack->first;
 
 				if (token_len - 1 == here_document->terminator_length &&
 				    !strncmp(code, here_document->terminator, token_len - 1)) {
-					here_document->redirection->type = HERE_STRING;
+					ctx->tokeniser_line_number += 1;
+					here_document->redirection->type = HERE_DOCUMENT;
 					here_doc_stack->first = here_document->next;
 					free(here_document->terminator);
 					free(here_document);
@@ -415,7 +444,10 @@ parse_preparsed(struct parser_context *ctx, char *code, size_t code_len)
 						}
 					}
 				} else {
-					push_quoted(ctx, code, token_len);
+					/* the line is pushed before the line number is advanced
+					 * so that it is joined with text before a substitution */
+					push_here_document_text(ctx, code, token_len);
+					ctx->tokeniser_line_number += 1;
 				}
 			}
 			break;
@@ -440,8 +472,8 @@ parse_preparsed(struct parser_context *ctx, char *code, size_t code_len)
 
 			} else if (*code == '`') {
 				token_len = 1;
-				pop_mode(ctx);
 				push_leave(ctx);
+				pop_mode(ctx);
 
 			} else if (*code == '\n') {
 				token_len = 1;
@@ -460,8 +492,8 @@ parse_preparsed(struct parser_context *ctx, char *code, size_t code_len)
 		case DQ_QUOTE_MODE:
 			if (*code == '"') {
 				token_len = 1;
-				pop_mode(ctx);
 				push_leave(ctx);
+				pop_mode(ctx);
 			} else {
 				goto common_quote_mode;
 			}
@@ -473,8 +505,8 @@ parse_preparsed(struct parser_context *ctx, char *code, size_t code_len)
 					goto need_more;
 				} else if (code[1] == ')') {
 					token_len = 2;
-					pop_mode(ctx);
 					push_leave(ctx);
+					pop_mode(ctx);
 				} else {
 					goto common_quote_mode;
 				}
@@ -486,8 +518,8 @@ parse_preparsed(struct parser_context *ctx, char *code, size_t code_len)
 		case RB_QUOTE_MODE:
 			if (*code == ')') {
 				token_len = 1;
-				pop_mode(ctx);
 				push_leave(ctx);
+				pop_mode(ctx);
 			} else {
 				goto common_quote_mode;
 			}
@@ -496,8 +528,8 @@ parse_preparsed(struct parser_context *ctx, char *code, size_t code_len)
 		case SB_QUOTE_MODE:
 			if (*code == ']') {
 				token_len = 1;
-				pop_mode(ctx);
 				push_leave(ctx);
+				pop_mode(ctx);
 			} else {
 				goto common_quote_mode;
 			}
@@ -601,8 +633,8 @@ parse_preparsed(struct parser_context *ctx, char *code, size_t code_len)
 		case CB_QUOTE_MODE:
 			if (*code == '}') {
 				token_len = 1;
-				pop_mode(ctx);
 				push_leave(ctx);
+				pop_mode(ctx);
 
 			} else if (*code == '\\') {
 				goto backslash_mode;
@@ -0,0 +1,1030 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+
+/* All forks of the shell share its variables, except the ( ) subshells,
+ * which get a copy. The variables are therefore kept in a memfd that is
+ * mapped, before anything is forked, at an address that is reserved for
+ * VARIABLE_STORE_RESERVE bytes, so that pointers into it are valid in
+ * every fork, and that the memfd can grow without being remapped.
+ *
+ * Writes are serialised by a futex that holds the process ID of its
+ * owner, as a pipeline stage may be killed at any time: a process that
+ * has waited for a while checks whether the owner is still alive, and
+ * takes the lock over if not. Reads take no lock: each variable has
+ * a sequence number that is odd while it is being changed, and a reader
+ * copies the value and then checks that the number is still the same,
+ * retrying otherwise. Because of that, value buffers can be reused as
+ * soon as they are replaced; a reader that is still copying from one
+ * just retries, and the memory stays mapped.
+ *
+ * Both tables use open addressing with linear probing, with the hash
+ * next to the slot pointer, so a lookup usually touches one cache line
+ * before the name is compared. They are only added to, so a slot that
+ * has been filled is never changed, and when the shared table grows,
+ * the old table is left for the readers that may be probing it. Most
+ * lookups are done only once anyway: $name parts have their slot
+ * resolved when they are interpreted, see interpreter.c.
+ *
+ * The special parameters and the positional parameters are not shared,
+ * as they are the state of the process rather than variables, and are
+ * kept in a table of their own, as all variables are if there is no
+ * store, which is the case with -n */
+
+#define NSIZE_CLASSES 48
+#define LOCK_WAITERS 0x80000000U /* process IDs are at most 2²² */
+
+struct table_slot {
+	size_t hash;
+	struct variable *_Atomic variable; /* NULL if the slot is empty */
+};
+
+struct shared_table {
+	size_t size;
+	struct table_slot slots[];
+};
+
+struct variable_store {
+	atomic_uint lock; /* 0, or the owner's process ID and LOCK_WAITERS */
+	struct variable *writing; /* repaired if its writer dies */
+	size_t size; /* of the memfd */
+	size_t used;
+	size_t nvariables;
+	struct shared_table *_Atomic table;
+	void *free_values[NSIZE_CLASSES]; /* for values of 16 << i bytes */
+	atomic_uint environment_names; /* see count_environment_change() */
+	atomic_uint environment_values;
+};
+
+struct environment_entry {
+	struct variable *variable; /* NULL if inherited and not imported yet */
+	unsigned int sequence; /* of .variable when the entry was made */
+	char owned; /* allocated rather than inherited */
+	char stale; /* refreshed whatever .sequence is, as no sequence is
+	             * sure to differ while another fork is writing */
+};
+
+struct overlaid_entry {
+	size_t index;
+	char *string; /* NULL if appended */
+};
+
+
+static struct table_slot *variable_table;
+static size_t variable_table_size;
+static size_t nvariables;
+static pthread_mutex_t variable_table_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct variable_store *variable_store;
+static int variable_store_fd = -1;
+static unsigned int process_id; /* of this fork, identifies the owner of the lock */
+
+/* the environment for exec, per process; it is updated when an
+ * exported variable has been changed, by any fork */
+static char **environment;
+static struct environment_entry *environment_entries;
+static size_t nenvironment;
+static size_t environment_size;
+static struct text_buffer environment_copy;
+static unsigned int synced_environment_names;
+static unsigned int synced_environment_values;
+static atomic_uint environment_names; /* if there is no store */
+static atomic_uint environment_values;
+static struct overlaid_entry *overlaid; /* see get_environment() */
+static size_t noverlaid;
+static size_t nappended;
+
+/* with -T, slots are also looked up by the front end thread
+ * when it interprets $name parts and compiles arithmetic expressions, see threads.c */
+char variable_table_shared;
+
+
+static void grow_shared_table(void);
+static void import_variable(struct variable *variable);
+
+PURE_FUNC
+static size_t
+hash_variable_name(const char *name, size_t length)
+{
+	size_t hash = 5381;
+	while (length--)
+		hash = (hash << 5) + hash + (unsigned char)*name++;
+	return hash;
+}
+
+
+static void
+update_process_id(void)
+{
+	process_id = (unsigned int)getpid();
+}
+
+
+static int
+is_process_dead(pid_t pid)
+{
+	char path[sizeof("/proc//stat") + 3 * sizeof(pid)], buffer[512], *state;
+	ssize_t r;
+	int fd;
+
+	if (kill(pid, 0))
+		return errno == ESRCH;
+
+	/* a zombie has not released the lock either, and
+	 * it may be the shell, that would reap it, that waits */
+	sprintf(path, "/proc/%ji/stat", (intmax_t)pid);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	r = read(fd, buffer, sizeof(buffer) - 1);
+	close(fd);
+	if (r <= 0)
+		return 0;
+	buffer[r] = '\0';
+	state = strrchr(buffer, ')');
+	return state && state[1] == ' ' && (state[2] == 'Z' || state[2] == 'X');
+}
+
+
+static void
+take_over_lock(void)
+{
+	/* the value of the variable that was being changed is
+	 * left as it was written, which is enough for its readers */
+	if (variable_store->writing && (atomic_load(&variable_store->writing->sequence) & 1))
+		atomic_fetch_add(&variable_store->writing->sequence, 1);
+	variable_store->writing = NULL;
+}
+
+
+static void
+lock_store(void)
+{
+	const struct timespec timeout = {0, VARIABLE_STORE_LOCK_TIMEOUT};
+	unsigned int expected = 0, owner;
+
+	if (atomic_compare_exchange_strong_explicit(&variable_store->lock, &expected, process_id,
+	                                            memory_order_acquire, memory_order_relaxed))
+		return;
+
+	for (;;) {
+		owner = atomic_load_explicit(&variable_store->lock, memory_order_relaxed);
+		if (!owner) {
+			/* there may be other waiters */
+			if (atomic_compare_exchange_weak_explicit(&variable_store->lock, &owner, process_id | LOCK_WAITERS,
+			                                          memory_order_acquire, memory_order_relaxed))
+				return;
+			continue;
+		}
+		if (!(owner & LOCK_WAITERS) &&
+		    !atomic_compare_exchange_weak_explicit(&variable_store->lock, &owner, owner | LOCK_WAITERS,
+		                                           memory_order_relaxed, memory_order_relaxed))
+			continue;
+		owner |= LOCK_WAITERS;
+		if (syscall(SYS_futex, &variable_store->lock, FUTEX_WAIT, owner, &timeout, NULL, 0) &&
+		    errno == ETIMEDOUT && is_process_dead((pid_t)(owner & ~LOCK_WAITERS)) &&
+		    atomic_compare_exchange_strong_explicit(&variable_store->lock, &owner, process_id | LOCK_WAITERS,
+		                                            memory_order_acquire, memory_order_relaxed)) {
+			take_over_lock();
+			return;
+		}
+	}
+}
+
+
+static int
+try_lock_store(void)
+{
+	unsigned int expected = 0;
+	return atomic_compare_exchange_strong_explicit(&variable_store->lock, &expected, process_id,
+	                                               memory_order_acquire, memory_order_relaxed);
+}
+
+
+static void
+unlock_store(void)
+{
+	if (atomic_exchange_explicit(&variable_store->lock, 0, memory_order_release) & LOCK_WAITERS)
+		syscall(SYS_futex, &variable_store->lock, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+
+void
+create_variable_store(void)
+{
+	variable_store_fd = memfd_create("apsh-variables", MFD_CLOEXEC);
+	if (variable_store_fd < 0)
+		eprintf("memfd_create:");
+	if (ftruncate(variable_store_fd, VARIABLE_STORE_INITIAL_SIZE))
+		eprintf("ftruncate:");
+	variable_store = mmap(NULL, VARIABLE_STORE_RESERVE, PROT_READ | PROT_WRITE,
+	                      MAP_SHARED | MAP_NORESERVE, variable_store_fd, 0);
+	if (variable_store == MAP_FAILED)
+		eprintf("mmap:");
+
+	variable_store->size = VARIABLE_STORE_INITIAL_SIZE;
+	variable_store->used = (sizeof(*variable_store) + 15) & ~(size_t)15;
+	grow_shared_table();
+	update_process_id();
+	pthread_atfork(NULL, NULL, update_process_id);
+}
+
+
+void
+unshare_variables(void)
+{
+	size_t used, off = 0;
+	ssize_t r;
+	int fd;
+
+	if (!variable_store)
+		return;
+
+	/* only called in a fork, so there is only one thread */
+	fd = memfd_create("apsh-variables", MFD_CLOEXEC);
+	if (fd < 0)
+		eprintf("memfd_create:");
+	lock_store();
+	if (ftruncate(fd, (off_t)variable_store->size))
+		eprintf("ftruncate:");
+	used = variable_store->used;
+	while (off < used) {
+		r = write(fd, &((char *)variable_store)[off], used - off);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			eprintf("write:");
+		}
+		off += (size_t)r;
+	}
+	unlock_store();
+
+	if (mmap(variable_store, VARIABLE_STORE_RESERVE, PROT_READ | PROT_WRITE,
+	         MAP_SHARED | MAP_NORESERVE | MAP_FIXED, fd, 0) == MAP_FAILED)
+		eprintf("mmap:");
+	close(variable_store_fd);
+	variable_store_fd = fd;
+	/* it was copied while it was held */
+	atomic_store(&variable_store->lock, 0);
+}
+
+
+static void *
+allocate_in_store(size_t size)
+{
+	void *p;
+	size_t new_size;
+
+	/* only called with the lock held; memory that has not
+	 * been allocated before is zeroed, as the memfd was */
+	size = (size + 15) & ~(size_t)15;
+	if (size > VARIABLE_STORE_RESERVE - variable_store->used)
+		eprintf("variable store is full\n");
+	if (variable_store->used + size > variable_store->size) {
+		new_size = variable_store->size;
+		while (variable_store->used + size > new_size)
+			new_size *= 2;
+		new_size = MIN(new_size, VARIABLE_STORE_RESERVE);
+		if (ftruncate(variable_store_fd, (off_t)new_size))
+			eprintf("ftruncate:");
+		variable_store->size = new_size;
+	}
+	p = &((char *)variable_store)[variable_store->used];
+	variable_store->used += size;
+	return p;
+}
+
+
+CONST_FUNC
+static size_t
+get_size_class(size_t size)
+{
+	size_t class = 0;
+	while ((size_t)16 << class < size)
+		class++;
+	return class;
+}
+
+
+static char *
+allocate_value(size_t size, size_t *sizep)
+{
+	size_t class = get_size_class(size);
+	void **value;
+
+	if (class >= NSIZE_CLASSES)
+		eprintf("variable store is full\n");
+	*sizep = (size_t)16 << class;
+	value = variable_store->free_values[class];
+	if (!value)
+		return allocate_in_store(*sizep);
+	variable_store->free_values[class] = *value;
+	return (char *)value;
+}
+
+
+static void
+free_value(char *value, size_t size)
+{
+	size_t class = get_size_class(size);
+
+	*(void **)value = variable_store->free_values[class];
+	variable_store->free_values[class] = value;
+}
+
+
+static struct variable *
+probe_table(struct table_slot *slots, size_t size, const char *name, size_t length, size_t hash, size_t *indexp)
+{
+	struct variable *variable;
+	size_t i = hash & (size - 1);
+
+	for (;; i = (i + 1) & (size - 1)) {
+		variable = atomic_load_explicit(&slots[i].variable, memory_order_acquire);
+		if (!variable || (slots[i].hash == hash && variable->name_length == length &&
+		                  !memcmp(variable->name, name, length)))
+			break;
+	}
+	*indexp = i;
+	return variable;
+}
+
+
+static void
+insert_into_table(struct table_slot *slots, size_t size, struct variable *variable)
+{
+	size_t i = variable->hash & (size - 1);
+
+	while (atomic_load_explicit(&slots[i].variable, memory_order_relaxed))
+		i = (i + 1) & (size - 1);
+	slots[i].hash = variable->hash;
+	atomic_store_explicit(&slots[i].variable, variable, memory_order_release);
+}
+
+
+static void
+grow_variable_table(void)
+{
+	struct table_slot *old_table = variable_table;
+	size_t old_size = variable_table_size, i;
+
+	variable_table_size = old_size ? old_size * 2 : VARIABLE_TABLE_INITIAL_SIZE;
+	variable_table = ecalloc(variable_table_size, sizeof(*variable_table));
+	for (i = 0; i < old_size; i++)
+		if (old_table[i].variable)
+			insert_into_table(variable_table, variable_table_size, old_table[i].variable);
+	free(old_table);
+}
+
+
+static struct variable *
+find_or_add_variable(const char *name, size_t length, size_t hash)
+{
+	struct variable *variable;
+	size_t i;
+
+	if (nvariables >= variable_table_size / 4 * 3)
+		grow_variable_table();
+	variable = probe_table(variable_table, variable_table_size, name, length, hash, &i);
+	if (variable)
+		return variable;
+
+	/* slots are never freed, unsetting a variable only clears
+	 * its value, so that pointers to the slot stay valid */
+	variable = ecalloc(1, sizeof(*variable));
+	variable->name = emalloc(length + 1);
+	memcpy(variable->name, name, length);
+	variable->name[length] = '\0';
+	variable->name_length = length;
+	variable->hash = hash;
+	import_variable(variable);
+	variable_table[i].hash = hash;
+	variable_table[i].variable = variable;
+	nvariables += 1;
+
+	return variable;
+}
+
+
+static struct variable *
+find_shared_variable(const char *name, size_t length, size_t hash, size_t *indexp)
+{
+	struct shared_table *table = atomic_load_explicit(&variable_store->table, memory_order_acquire);
+	return probe_table(table->slots, table->size, name, length, hash, indexp);
+}
+
+
+static void
+grow_shared_table(void)
+{
+	struct shared_table *old_table = atomic_load(&variable_store->table), *table;
+	struct variable *variable;
+	size_t size, i;
+
+	size = old_table ? old_table->size * 2 : VARIABLE_TABLE_INITIAL_SIZE;
+	table = allocate_in_store(offsetof(struct shared_table, slots) + size * sizeof(*table->slots));
+	table->size = size;
+
+	/* the old table is never freed, so that it stays valid
+	 * for those that are looking up variables in it; this
+	 * wastes less memory than the new table uses */
+	for (i = 0; old_table && i < old_table->size; i++)
+		if ((variable = atomic_load_explicit(&old_table->slots[i].variable, memory_order_relaxed)))
+			insert_into_table(table->slots, size, variable);
+
+	atomic_store_explicit(&variable_store->table, table, memory_order_release);
+}
+
+
+static struct variable *
+get_shared_variable_slot(const char *name, size_t length, size_t hash)
+{
+	struct shared_table *table;
+	struct variable *variable;
+	size_t i;
+
+	variable = find_shared_variable(name, length, hash, &i);
+	if (variable)
+		return variable;
+
+	lock_store();
+	table = atomic_load(&variable_store->table);
+	if (variable_store->nvariables >= table->size / 4 * 3)
+		grow_shared_table();
+	variable = find_shared_variable(name, length, hash, &i);
+	if (!variable) {
+		variable = allocate_in_store(sizeof(*variable));
+		variable->name = allocate_in_store(length + 1);
+		memcpy(variable->name, name, length);
+		variable->name[length] = '\0';
+		variable->name_length = length;
+		variable->hash = hash;
+		variable->shared = 1;
+		import_variable(variable);
+		table = atomic_load(&variable_store->table);
+		table->slots[i].hash = hash;
+		atomic_store_explicit(&table->slots[i].variable, variable, memory_order_release);
+		variable_store->nvariables += 1;
+	}
+	unlock_store();
+	return variable;
+}
+
+
+struct variable *
+get_variable_slot(const char *name, size_t length)
+{
+	struct variable *variable;
+	size_t hash = hash_variable_name(name, length);
+
+	if (variable_store && (isalpha(*name) || *name == '_'))
+		return get_shared_variable_slot(name, length, hash);
+
+	if (!variable_table_shared)
+		return find_or_add_variable(name, length, hash);
+
+	pthread_mutex_lock(&variable_table_mutex);
+	variable = find_or_add_variable(name, length, hash);
+	pthread_mutex_unlock(&variable_table_mutex);
+	return variable;
+}
+
+
+static unsigned int
+begin_read(struct variable *variable)
+{
+	unsigned int sequence;
+
+	/* the writer holds the lock, so waiting for the lock
+	 * rather than spinning also works if it was preempted,
+	 * and repairs the sequence number if it has died */
+	while ((sequence = atomic_load_explicit(&variable->sequence, memory_order_acquire)) & 1) {
+		lock_store();
+		unlock_store();
+	}
+	return sequence;
+}
+
+
+static int
+end_read(struct variable *variable, unsigned int sequence)
+{
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&variable->sequence, memory_order_relaxed) == sequence;
+}
+
+
+static void
+begin_write(struct variable *variable)
+{
+	if (variable->shared)
+		variable_store->writing = variable;
+	atomic_store_explicit(&variable->sequence, atomic_load_explicit(&variable->sequence, memory_order_relaxed) + 1,
+	                      memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+
+static void
+end_write(struct variable *variable)
+{
+	atomic_store_explicit(&variable->sequence, atomic_load_explicit(&variable->sequence, memory_order_relaxed) + 1,
+	                      memory_order_release);
+	if (variable->shared)
+		variable_store->writing = NULL;
+}
+
+
+const char *
+get_variable_value(struct variable *variable, size_t *lengthp, struct text_buffer *copy)
+{
+	unsigned int sequence;
+	const char *value;
+	size_t length;
+
+	/* the returned value is valid until the variable is changed,
+	 * or if it is shared, until the next call with the same copy */
+	if (!variable->shared) {
+		*lengthp = variable->value_length;
+		return variable->value;
+	}
+
+	for (;;) {
+		sequence = begin_read(variable);
+		value = variable->value;
+		length = variable->value_length;
+		/* checked before copying, as the length may be
+		 * from another value than the buffer is */
+		if (!end_read(variable, sequence))
+			continue;
+		if (!value) {
+			*lengthp = 0;
+			return NULL;
+		}
+		if (copy->size <= length)
+			copy->text = erealloc(copy->text, copy->size = length + 1);
+		memcpy(copy->text, value, length);
+		if (end_read(variable, sequence))
+			break;
+	}
+
+	copy->text[length] = '\0';
+	copy->length = length;
+	*lengthp = length;
+	return copy->text;
+}
+
+
+int
+get_variable_integer(struct variable *variable, int64_t *valuep)
+{
+	unsigned int sequence;
+	int have_integer;
+
+	if (!variable->shared) {
+		*valuep = variable->integer;
+		return variable->have_integer;
+	}
+
+	do {
+		sequence = begin_read(variable);
+		have_integer = variable->have_integer;
+		*valuep = variable->integer;
+	} while (!end_read(variable, sequence));
+	return have_integer;
+}
+
+
+void
+cache_variable_integer(struct variable *variable, const char *value, size_t length, int64_t integer)
+{
+	/* value is what the variable was when it was parsed as
+	 * integer, a cache is not worth waiting for the lock */
+	if (!variable->shared) {
+		variable->integer = integer;
+		variable->have_integer = 1;
+		return;
+	}
+
+	if (!try_lock_store())
+		return;
+	if (variable->value && variable->value_length == length && !memcmp(variable->value, value, length)) {
+		begin_write(variable);
+		variable->integer = integer;
+		variable->have_integer = 1;
+		end_write(variable);
+	}
+	unlock_store();
+}
+
+
+static void
+count_environment_change(int membership)
+{
+	atomic_uint *names = variable_store ? &variable_store->environment_names : &environment_names;
+	atomic_uint *values = variable_store ? &variable_store->environment_values : &environment_values;
+
+	/* membership changes are those that may add or
+	 * remove an entry, see update_environment() */
+	if (membership)
+		atomic_fetch_add_explicit(names, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(values, 1, memory_order_release);
+}
+
+
+static void
+write_value(struct variable *variable, const char *value, size_t length, int64_t integer, int have_integer)
+{
+	char *old_value = NULL, *new_value = NULL;
+	size_t old_size = 0, new_size = 0;
+
+	/* called with the lock held if the variable is shared */
+	if (variable->exported)
+		count_environment_change(!variable->value);
+	if (!variable->value || variable->value_size <= length) {
+		if (variable->shared) {
+			old_value = variable->value;
+			old_size = variable->value_size;
+			new_value = allocate_value(length + 1, &new_size);
+		} else {
+			new_value = erealloc(variable->value, new_size = length + 1);
+		}
+	}
+	begin_write(variable);
+	if (new_value) {
+		variable->value = new_value;
+		variable->value_size = new_size;
+	}
+	memcpy(variable->value, value, length);
+	variable->value[length] = '\0';
+	variable->value_length = length;
+	variable->integer = integer;
+	variable->have_integer = (char)have_integer;
+	end_write(variable);
+	if (old_value)
+		free_value(old_value, old_size);
+}
+
+
+static void
+assign_value(struct variable *variable, const char *value, size_t length, int64_t integer, int have_integer)
+{
+	if (!variable->shared) {
+		write_value(variable, value, length, integer, have_integer);
+		return;
+	}
+	lock_store();
+	write_value(variable, value, length, integer, have_integer);
+	unlock_store();
+}
+
+
+void
+set_variable(struct variable *variable, const char *value, size_t length)
+{
+	assign_value(variable, value, length, 0, 0);
+}
+
+
+void
+set_variable_integer(struct variable *variable, int64_t value)
+{
+	char buffer[sizeof("-9223372036854775808")];
+	int length;
+
+	length = sprintf(buffer, "%ji", (intmax_t)value);
+	assign_value(variable, buffer, (size_t)length, value, 1);
+}
+
+
+void
+unset_variable(struct variable *variable)
+{
+	char *old_value;
+	size_t old_size;
+
+	if (variable->shared)
+		lock_store();
+	old_value = variable->value;
+	old_size = variable->value_size;
+	if (variable->exported)
+		count_environment_change(!!old_value);
+	begin_write(variable);
+	variable->value = NULL;
+	variable->value_length = 0;
+	variable->value_size = 0;
+	variable->have_integer = 0;
+	variable->exported = 0;
+	end_write(variable);
+	if (!variable->shared) {
+		free(old_value);
+	} else {
+		if (old_value)
+			free_value(old_value, old_size);
+		unlock_store();
+	}
+}
+
+
+void
+export_variable(struct variable *variable, int exported)
+{
+	if (variable->shared)
+		lock_store();
+	if (variable->exported != exported) {
+		begin_write(variable);
+		variable->exported = (char)exported;
+		end_write(variable);
+		count_environment_change(1);
+	}
+	if (variable->shared)
+		unlock_store();
+}
+
+
+static void
+import_variable(struct variable *variable)
+{
+	char **entry;
+	size_t length = variable->name_length;
+
+	/* environ(7) is only searched for the names that are referenced,
+	 * when their slots are created, which is before another thread
+	 * or fork can see them; so is the environment that is passed on,
+	 * see update_environment() */
+	if (!isalpha(*variable->name) && *variable->name != '_')
+		return;
+	for (entry = environ; *entry; entry++) {
+		if (!strncmp(*entry, variable->name, length) && (*entry)[length] == '=') {
+			write_value(variable, &(*entry)[length + 1], strlen(&(*entry)[length + 1]), 0, 0);
+			variable->exported = 1;
+			variable->imported = 1;
+			break;
+		}
+	}
+}
+
+
+static size_t
+find_environment_entry(struct variable *variable)
+{
+	size_t i = variable->environment_index;
+	size_t length = variable->name_length;
+
+	/* the index is only a hint, as the forks that share the
+	 * variable have environments of their own */
+	if (i < nenvironment && environment_entries[i].variable == variable)
+		return i;
+	for (i = 0; i < nenvironment; i++)
+		if (environment_entries[i].variable == variable)
+			goto found;
+	if (variable->imported)
+		for (i = 0; i < nenvironment; i++)
+			if (!environment_entries[i].variable && !strncmp(environment[i], variable->name, length) &&
+			    environment[i][length] == '=')
+				goto found;
+	return SIZE_MAX;
+
+found:
+	variable->environment_index = i;
+	return i;
+}
+
+
+static void
+reserve_environment(size_t n)
+{
+	if (nenvironment + n + 1 > environment_size) {
+		environment_size = (nenvironment + n + 1) * 2;
+		environment = erealloc(environment, environment_size * sizeof(*environment));
+		environment_entries = erealloc(environment_entries, environment_size * sizeof(*environment_entries));
+	}
+}
+
+
+static void
+remove_environment_entry(size_t i)
+{
+	if (environment_entries[i].owned)
+		free(environment[i]);
+	nenvironment -= 1;
+	environment[i] = environment[nenvironment];
+	environment_entries[i] = environment_entries[nenvironment];
+	environment[nenvironment] = NULL;
+	if (i < nenvironment && environment_entries[i].variable)
+		environment_entries[i].variable->environment_index = i;
+}
+
+
+static void
+bind_environment_entries(struct table_slot *slots, size_t size)
+{
+	struct variable *variable;
+	size_t i, j;
+
+	/* entries are added for exported variables that have none,
+	 * and the entries that were inherited are connected to their
+	 * variables once they have been imported; the values are
+	 * then set by refresh_environment_entries() */
+	for (i = 0; i < size; i++) {
+		variable = atomic_load_explicit(&slots[i].variable, memory_order_acquire);
+		if (!variable || (!variable->exported && !variable->imported))
+			continue;
+		j = find_environment_entry(variable);
+		if (j == SIZE_MAX) {
+			if (!variable->exported)
+				continue;
+			reserve_environment(1);
+			j = nenvironment++;
+			environment[j] = NULL;
+			environment[nenvironment] = NULL;
+			environment_entries[j].owned = 0;
+			variable->environment_index = j;
+		}
+		environment_entries[j].variable = variable;
+		environment_entries[j].stale = 1;
+	}
+}
+
+
+static void
+refresh_environment_entries(void)
+{
+	struct environment_entry *entry;
+	struct variable *variable;
+	unsigned int sequence;
+	const char *value;
+	size_t i, length;
+	char exported;
+
+	/* backwards, as removed entries are replaced by the last one */
+	for (i = nenvironment; i--;) {
+		entry = &environment_entries[i];
+		variable = entry->variable;
+		if (!variable || (!entry->stale &&
+		                  atomic_load_explicit(&variable->sequence, memory_order_acquire) == entry->sequence))
+			continue;
+
+		/* if it is changed while it is read, it will be read
+		 * again next time, as the older sequence is recorded */
+		do {
+			sequence = begin_read(variable);
+			exported = variable->exported;
+		} while (!end_read(variable, sequence));
+		value = get_variable_value(variable, &length, &environment_copy);
+		if (!exported || !value) {
+			/* a new entry is removed rather than left as NULL,
+			 * which would end the environment for exec */
+			remove_environment_entry(i);
+			continue;
+		}
+		entry->sequence = sequence;
+		entry->stale = 0;
+
+		/* inherited entries are kept until they are changed */
+		if (environment[i] && !strcmp(&environment[i][variable->name_length + 1], value))
+			continue;
+		if (entry->owned)
+			free(environment[i]);
+		environment[i] = emalloc(variable->name_length + 1 + length + 1);
+		memcpy(environment[i], variable->name, variable->name_length);
+		environment[i][variable->name_length] = '=';
+		memcpy(&environment[i][variable->name_length + 1], value, length + 1);
+		entry->owned = 1;
+	}
+}
+
+
+static void
+update_environment(void)
+{
+	atomic_uint *names = variable_store ? &variable_store->environment_names : &environment_names;
+	atomic_uint *values = variable_store ? &variable_store->environment_values : &environment_values;
+	unsigned int names_now, values_now;
+	struct shared_table *table;
+	size_t i;
+
+	if (!environment) {
+		/* inherited entries are used as they are until
+		 * their variables are imported */
+		for (i = 0; environ[i]; i++);
+		nenvironment = i;
+		reserve_environment(0);
+		memcpy(environment, environ, (nenvironment + 1) * sizeof(*environment));
+		memset(environment_entries, 0, nenvironment * sizeof(*environment_entries));
+		synced_environment_names = atomic_load(names) - 1;
+	}
+
+	/* read before the variables, so a concurrent change is seen next time */
+	names_now = atomic_load_explicit(names, memory_order_acquire);
+	values_now = atomic_load_explicit(values, memory_order_acquire);
+	if (names_now != synced_environment_names) {
+		if (variable_store) {
+			table = atomic_load_explicit(&variable_store->table, memory_order_acquire);
+			bind_environment_entries(table->slots, table->size);
+		} else {
+			bind_environment_entries(variable_table, variable_table_size);
+		}
+	} else if (values_now == synced_environment_values) {
+		return;
+	}
+	refresh_environment_entries();
+	synced_environment_names = names_now;
+	synced_environment_values = values_now;
+}
+
+
+char **
+get_environment(char **assignments)
+{
+	struct variable *variable;
+	size_t length, i, j, n;
+
+	/* the variables assigned for a command replace their entries
+	 * until restore_environment() is called, rather than the
+	 * whole environment being copied, and there is room for the
+	 * others at the end; they are expanded, so they are not in
+	 * the shell's variables; NULL is the same as none */
+	update_environment();
+	for (n = 0; assignments && assignments[n]; n++);
+	if (!n)
+		return environment;
+	reserve_environment(nappended + n);
+	overlaid = erealloc(overlaid, (noverlaid + n) * sizeof(*overlaid));
+
+	for (i = 0; i < n; i++) {
+		length = (size_t)(strchr(assignments[i], '=') - assignments[i]) + 1;
+		variable = get_variable_slot(assignments[i], length - 1);
+		j = variable->exported ? find_environment_entry(variable) : SIZE_MAX;
+		if (j == SIZE_MAX) {
+			for (j = nenvironment; j < nenvironment + nappended; j++)
+				if (!strncmp(environment[j], assignments[i], length))
+					break;
+			if (j == nenvironment + nappended)
+				nappended += 1;
+		}
+		overlaid[noverlaid].index = j;
+		overlaid[noverlaid].string = j < nenvironment ? environment[j] : NULL;
+		noverlaid += 1;
+		environment[j] = assignments[i];
+	}
+	environment[nenvironment + nappended] = NULL;
+	return environment;
+}
+
+
+void
+restore_environment(void)
+{
+	/* in reverse, in case a variable was assigned twice */
+	while (noverlaid--)
+		if (overlaid[noverlaid].index < nenvironment)
+			environment[overlaid[noverlaid].index] = overlaid[noverlaid].string;
+	noverlaid = 0;
+	nappended = 0;
+	if (environment)
+		environment[nenvironment] = NULL;
+}
+
+
+static int
+variable_name_cmp(const void *a, const void *b)
+{
+	return strcmp((*(struct variable *const *)a)->name, (*(struct variable *const *)b)->name);
+}
+
+
+size_t
+get_exported_variables(struct variable ***variablesp)
+{
+	struct shared_table *table;
+	struct table_slot *slots;
+	struct variable *variable;
+	size_t size, i, n = 0;
+	char **entry;
+
+	/* every inherited variable is imported first */
+	for (entry = environ; *entry; entry++)
+		if (strchr(*entry, '='))
+			get_variable_slot(*entry, (size_t)(strchr(*entry, '=') - *entry));
+
+	if (variable_store) {
+		table = atomic_load_explicit(&variable_store->table, memory_order_acquire);
+		slots = table->slots;
+		size = table->size;
+	} else {
+		slots = variable_table;
+		size = variable_table_size;
+	}
+	*variablesp = emalloc(size * sizeof(**variablesp) + 1);
+	for (i = 0; i < size; i++) {
+		variable = atomic_load_explicit(&slots[i].variable, memory_order_acquire);
+		if (variable && variable->exported)
+			(*variablesp)[n++] = variable;
+	}
+	qsort(*variablesp, n, sizeof(**variablesp), variable_name_cmp);
+	return n;
+}